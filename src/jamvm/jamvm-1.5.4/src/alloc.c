@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "jam.h"
 #include "alloc.h"
@@ -36,6 +37,7 @@
 #include "lock.h"
 #include "symbol.h"
 #include "excep.h"
+#include "hash.h"
 
 /* Trace GC heap mark/sweep phases - useful for debugging heap
  * corruption */
@@ -109,15 +111,12 @@ uintptr_t get_freelist_header();
 struct chunk *get_freelist_next();
 int file = FALSE;
 
+/* The pool was opened after a clean shutdown, so the
+   crash fix-ups (lock words, monitors) are skipped */
+int clean_restart = FALSE;
+
 /* HEAP MEM ADDRESS */
 #define HEAPADDR 		0xaf497000
-#define NVM_ADDRESS 	0xaeb0d000
-#define INCREASE_VALUE 	1000000
-
-// JaPHa Modification
- static int nvmHeaderSize = sizeof(nvmChunk);
- static int minSize = (0x3 + sizeof(nvmChunk) + sizeof(void*));
-// End of modification
 
 static int verbosegc;
 static int compact_override;
@@ -132,6 +131,12 @@ static char *heapbase;
 static char *heaplimit;
 static char *heapmax;
 
+// JaPHa Modification
+/* Young generation limits (see YOUNG GENERATION below) */
+static char *nursery_base;
+static char *nursery_limit;
+// End of modification
+
 /* Declared heap */
 static char *heapMem;
 static unsigned long maxHeap;
@@ -143,6 +148,12 @@ static unsigned long heapfree;
 static unsigned int *markbits;
 static int markbit_size;
 
+// JaPHa Modification
+/* The young generation has mark bits of its own */
+static unsigned int *nursery_markbits;
+static int nursery_markbit_size;
+// End of modification
+
 /* The mark stack is fixed size.  If it overflows (which
    shouldn't normally happen except in extremely nested
    structures), marking falls back to a slower heap scan */
@@ -155,6 +166,15 @@ static Object *mark_stack[MARK_STACK_SIZE];
    by limiting marking to a region of the heap */
 static char *mark_scan_ptr;
 
+// JaPHa Modification
+/* The young generation is scanned after the heap.  Set
+   while (and once) the scan pointer is within it */
+static int scanning_young;
+
+/* Set while collecting the young generation alone (see gcYoung) */
+static int minor_collection;
+// End of modification
+
 /* List holding objects which need to be finalized */
 static Object **has_finaliser_list = NULL;
 static int has_finaliser_count     = 0;
@@ -259,94 +279,880 @@ static int sys_page_size;
 #define LOG_MARKSIZEBITS        5
 #define MARKSIZEBITS            32
 
+// JaPHa Modification
+#define IN_NURSERY(ptr)    (((char*)(ptr)) >= nursery_base && \
+                            ((char*)(ptr)) < nursery_limit)
+
+#define MARKBASE(ptr)      (IN_NURSERY(ptr) ? nursery_base : heapbase)
+#define MARKBITS(ptr)      (IN_NURSERY(ptr) ? nursery_markbits : markbits)
+
+/* A collection of the young generation leaves the heap's mark bits
+   alone.  Its objects count as hard marked, so they aren't pushed */
+#define MARKABLE(ptr)      (!minor_collection || IN_NURSERY(ptr))
+// End of modification
+
 /* Macros for manipulating the mark bit array */
 
-#define MARKENTRY(ptr)     ((((char*)ptr)-heapbase)>> \
+#define MARKENTRY(ptr)     ((((char*)ptr)-MARKBASE(ptr))>> \
                            (LOG_BYTESPERMARK+LOG_MARKSIZEBITS-LOG_BITSPERMARK))
 
-#define MARKOFFSET(ptr)    ((((((char*)ptr)-heapbase)>>LOG_BYTESPERMARK)& \
+#define MARKOFFSET(ptr)    ((((((char*)ptr)-MARKBASE(ptr))>>LOG_BYTESPERMARK)& \
                            ((MARKSIZEBITS>>LOG_BITSPERMARK)-1)) \
                             <<LOG_BITSPERMARK)
 
-#define MARK(ptr,mark)     markbits[MARKENTRY(ptr)]|=mark<<MARKOFFSET(ptr);
+#define MARK(ptr,mark)     if(MARKABLE(ptr)) \
+                           MARKBITS(ptr)[MARKENTRY(ptr)]|=mark<<MARKOFFSET(ptr);
 
-#define SET_MARK(ptr,mark) markbits[MARKENTRY(ptr)]= \
-                           (markbits[MARKENTRY(ptr)]& \
+#define SET_MARK(ptr,mark) if(MARKABLE(ptr)) \
+                           MARKBITS(ptr)[MARKENTRY(ptr)]= \
+                           (MARKBITS(ptr)[MARKENTRY(ptr)]& \
                            ~(((1<<BITSPERMARK)-1)<<MARKOFFSET(ptr)))| \
                            mark<<MARKOFFSET(ptr)
 
-#define IS_MARKED(ptr)     ((markbits[MARKENTRY(ptr)]>> \
+#define IS_MARKED(ptr)     (!MARKABLE(ptr) ? HARD_MARK : \
+                           (MARKBITS(ptr)[MARKENTRY(ptr)]>> \
                            MARKOFFSET(ptr))&((1<<BITSPERMARK)-1))
 
 #define IS_HARD_MARKED(ptr)      (IS_MARKED(ptr) == HARD_MARK)
 #define IS_PHANTOM_MARKED(ptr)   (IS_MARKED(ptr) == PHANTOM_MARK)
 
-#define IS_OBJECT(ptr)  (((char*)ptr) > heapbase) && \
-                        (((char*)ptr) < heaplimit) && \
-                        !(((uintptr_t)ptr)&(OBJECT_GRAIN-1))
+#define IS_OBJECT(ptr)  (((((char*)ptr) > heapbase) && \
+                        (((char*)ptr) < heaplimit)) || IN_NURSERY(ptr)) && \
+                        !(((uintptr_t)ptr)&(OBJECT_GRAIN-1)) && \
+                        !inHeapGap((char*)(ptr))
 
 #define MIN_OBJECT_SIZE ((sizeof(Object)+HEADER_SIZE+OBJECT_GRAIN-1)& \
                         ~(OBJECT_GRAIN-1))
 
 static uintptr_t doSweep(Thread *self);
+static void recoverSweep();
+static void recoverCompaction();
+static void setGCPhase(int phase);
+static void publishFreeList();
+static void allocTransientBits();
+static void threadYoungSurvivors();
+static void scanRemembered(int mark_soft_refs);
+static int inHeapGap(char *ptr);
+static void growHeap(unsigned long max_heap);
+static void syncFreeList();
+unsigned long gc0_pmem(int mark_soft_refs, int compact);
 
 void allocMarkBits() {
     uint no_of_bits = (heaplimit-heapbase)>>(LOG_BYTESPERMARK-LOG_BITSPERMARK);
     markbit_size = (no_of_bits+MARKSIZEBITS-1)>>LOG_MARKSIZEBITS;
+
+    // JaPHa Modification
+    /* The persistent heap's mark bits are kept in the pool, sized
+       for its capacity, so a sweep can be redone after a crash */
+    if(persistent)
+        markbits = pmemobj_direct(pheap->markbits);
+    else
+    // End of modification
     markbits = sysMalloc(markbit_size * sizeof(*markbits));
 
     TRACE_GC("Allocated mark bits - size is %d\n", markbit_size);
 }
 
 void clearMarkBits() {
+	// JaPHa Modification
+	if(!minor_collection)
+	// End of modification
 	memset(markbits, 0, markbit_size * sizeof(*markbits));
+
+	// JaPHa Modification
+	if(nursery_markbits != NULL)
+		memset(nursery_markbits, 0,
+		       nursery_markbit_size * sizeof(*nursery_markbits));
+	// End of modification
+}
+
+// JaPHa Modification
+/* ------------------------- RELOCATION ------------------------- */
+
+/* The pool is normally mapped at the address it was created at (see
+   PMEM_MMAP_HINT).  Should it be mapped elsewhere, every pointer into
+   the pool is moved by the difference before anything else reads
+   it.  Java objects are scanned precisely using the same layout
+   information as the collector.  The VM metadata is reached from the
+   pheap fields, the persistent hash tables and the classes, and each
+   structure is relocated by its own layout: constant pool entries by
+   their tag, static fields by their signature and prepared code by
+   its handler indexes (see interp/direct.c).  Only the slots of the
+   stacks saved by a checkpoint are untyped, and as for the collector
+   they are taken conservatively.
+
+   Relocation is done in place without a transaction.  The new address
+   is added to the persistent list of bases before anything is written
+   and the base address is only updated once everything is flushed, so
+   after a crash part-way through the next open relocates from either */
+
+/* Work on the pool at open is split into slices, each done by a
+   thread of its own */
+#define MAX_SLICES 16
+
+typedef struct heap_slice {
+    char *start;
+    char *end;
+} HeapSlice;
+
+/* Start addresses of previous mappings of the pool, and of the current one */
+static char *reloc_from[RELOC_MAX_BASES + 1];
+static int reloc_from_count;
+static char *reloc_to;
+static uintptr_t reloc_len;
+
+/* Hash codes are object addresses (see getObjectHashcode), so they
+   are kept relative to the address the pool was created at */
+static uintptr_t hash_delta = 0;
+
+#define ADDRESS_HASHCODE(ob) (IN_NURSERY(ob) ? (uintptr_t)(ob) : \
+                              (uintptr_t)(ob) - hash_delta)
+
+#define IN_POOL(ptr) ((char*)(ptr) >= (char*)pop_heap && \
+                      (char*)(ptr) < (char*)pop_heap + pheap->pool_size)
+
+static char *relocatePtr(char *ptr) {
+    int i;
+
+    for(i = 0; i < reloc_from_count; i++)
+        if(ptr >= reloc_from[i] && ptr < reloc_from[i] + reloc_len)
+            return ptr + (reloc_to - reloc_from[i]);
+
+    return ptr;
+}
+
+#define RELOCATE(pntr) {                             \
+    char **_slot = (char**)(pntr);                   \
+    char *_new = relocatePtr(*_slot);                \
+                                                     \
+    if(_new != *_slot)                               \
+        *_slot = _new;                               \
+}
+
+/* The heap is flushed a slice at a time.  The metadata is spread
+   over the pool, so each slot written within it is flushed */
+#define RELOCATE_FLUSH(pntr) {                       \
+    char **_slot = (char**)(pntr);                   \
+    char *_new = relocatePtr(*_slot);                \
+                                                     \
+    if(_new != *_slot) {                             \
+        *_slot = _new;                               \
+        pmemobj_flush(pop_heap, _slot, sizeof(char*)); \
+    }                                                \
+}
+
+static void relocateSlot(void *slot) {
+    RELOCATE_FLUSH(slot);
+}
+
+static void relocateAnnotation(AnnotationData **annotation) {
+    RELOCATE_FLUSH(annotation);
+
+    if(*annotation != NULL)
+        RELOCATE_FLUSH(&(*annotation)->data);
+}
+
+static void relocateEntries(HashEntry *entries, int size) {
+    int i;
+
+    for(i = 0; i < size; i++)
+        RELOCATE_FLUSH(&entries[i].data);
+}
+
+/* A resized table's entries are wherever its descriptor says,
+   otherwise they are still in the initial array in the pheap */
+static HashEntry *relocateTable(char *name, char **initial, int count,
+                                int *size) {
+    PHashDesc *desc = persistentHashDesc(name);
+    HashEntry *entries = (HashEntry*)initial;
+
+    RELOCATE_FLUSH(&desc->entries);
+
+    if(desc->entries != NULL) {
+        entries = desc->entries;
+        count = desc->size;
+    }
+
+    relocateEntries(entries, count);
+    *size = count;
+    return entries;
+}
+
+/* The pheap fields, the OPC and the persistent hash tables, with the
+   monitors and the checkpoint they lead to.  The class loaders' tables
+   start out sharing the initial array of classes_ht, the rest of each
+   is relocated with the loader (see relocateObject) */
+static void relocateRoot() {
+    OPC *opc = &pheap->opc;
+    HashEntry *monitors;
+    SavedThread *saved;
+    int i, size;
+
+    RELOCATE_FLUSH(&pheap->freelist);
+    RELOCATE_FLUSH(&pheap->chunkpp);
+    RELOCATE_FLUSH(&pheap->heapbase);
+    RELOCATE_FLUSH(&pheap->heapmax);
+    RELOCATE_FLUSH(&pheap->heaplimit);
+    RELOCATE_FLUSH(&pheap->heapMem);
+
+    RELOCATE_FLUSH(&opc->java_lang_Class);
+    RELOCATE_FLUSH(&opc->chunkpp);
+    RELOCATE_FLUSH(&opc->freelist_next);
+    RELOCATE_FLUSH(&opc->loader_data_class);
+
+    for(i = 0; i < 9; i++)
+        RELOCATE_FLUSH(&opc->prim_classes[i]);
+
+    RELOCATE_FLUSH(&opc->has_finaliser_list);
+    if(IN_POOL(opc->has_finaliser_list))
+        for(i = 0; i < opc->has_finaliser_count; i++)
+            RELOCATE_FLUSH(&opc->has_finaliser_list[i]);
+
+    relocateTable(HT_NAME_UTF8, pheap->utf8_ht, UTF8_HT_ENTRY_COUNT, &size);
+    relocateTable(HT_NAME_BOOT, pheap->bootCl_ht, BOOTCL_HT_ENTRY_COUNT, &size);
+    relocateTable(HT_NAME_BOOTPKG, pheap->bootPck_ht, BOOTPCK_HT_ENTRY_COUNT, &size);
+    relocateTable(HT_NAME_STRING, pheap->string_ht, STRING_HT_ENTRY_COUNT, &size);
+    relocateEntries((HashEntry*)pheap->classes_ht, CLASSES_HT_ENTRY_COUNT);
+
+    /* A monitor's owner and waiters are reset as the
+       monitor cache is opened (see lock.c) */
+    monitors = relocateTable(HT_NAME_MONITOR, pheap->monitor_ht,
+                             MONITOR_HT_ENTRY_COUNT, &size);
+
+    for(i = 0; i < size; i++) {
+        Monitor *mon = monitors[i].data;
+
+        if(mon != NULL) {
+            RELOCATE_FLUSH(&mon->obj);
+            RELOCATE_FLUSH(&mon->next);
+        }
+    }
+
+    RELOCATE_FLUSH(&pheap->checkpoint);
+
+    for(saved = pheap->checkpoint; saved != NULL; saved = saved->next) {
+        uintptr_t *slots = (uintptr_t*)&saved->frame[saved->frames];
+
+        RELOCATE_FLUSH(&saved->thread);
+        RELOCATE_FLUSH(&saved->lock_obj);
+        RELOCATE_FLUSH(&saved->next);
+
+        for(i = 0; i < saved->frames; i++)
+            RELOCATE_FLUSH(&saved->frame[i].mb);
+
+        for(i = 0; i < saved->slots; i++)
+            RELOCATE_FLUSH(&slots[i]);
+    }
+}
+
+static void relocateClassBlock(ClassBlock *cb) {
+    RELOCATE(&cb->name);
+    RELOCATE(&cb->signature);
+    RELOCATE(&cb->super_name);
+    RELOCATE(&cb->source_file_name);
+    RELOCATE(&cb->super);
+    RELOCATE(&cb->fields);
+    RELOCATE(&cb->methods);
+    RELOCATE(&cb->interfaces);
+    RELOCATE(&cb->constant_pool.type);
+    RELOCATE(&cb->constant_pool.info);
+    RELOCATE(&cb->method_table);
+    RELOCATE(&cb->imethod_table);
+    RELOCATE(&cb->element_class);
+    RELOCATE(&cb->class_loader);
+    RELOCATE(&cb->inner_classes);
+    RELOCATE(&cb->refs_offsets_table);
+    RELOCATE(&cb->annotations);
+}
+
+/* The metadata of a class is only reached from its class, so it is
+   relocated as the class is, after the class block */
+static void relocateClassData(ClassBlock *cb) {
+    ConstantPool *cp = &cb->constant_pool;
+    int i;
+
+    if(cb->annotations != NULL)
+        RELOCATE_FLUSH(&cb->annotations->data);
+
+    for(i = 0; i < cb->interfaces_count; i++)
+        RELOCATE_FLUSH(&cb->interfaces[i]);
+
+    /* A locked entry holds either its index
+       or what it is being resolved to */
+    for(i = 1; i < cb->constant_pool_count; i++)
+        switch(CP_TYPE(cp, i)) {
+            case CONSTANT_Utf8:
+            case CONSTANT_Resolved:
+            case CONSTANT_ResolvedClass:
+            case CONSTANT_ResolvedString:
+            case CONSTANT_Locked:
+                RELOCATE_FLUSH(&CP_INFO(cp, i));
+                break;
+        }
+
+    for(i = 0; i < cb->fields_count; i++) {
+        FieldBlock *fb = &cb->fields[i];
+
+        RELOCATE_FLUSH(&fb->class);
+        RELOCATE_FLUSH(&fb->name);
+        RELOCATE_FLUSH(&fb->type);
+        RELOCATE_FLUSH(&fb->signature);
+        relocateAnnotation(&fb->annotations);
+
+        if(fb->access_flags & ACC_STATIC &&
+                       (fb->type[0] == 'L' || fb->type[0] == '['))
+            RELOCATE_FLUSH(&fb->u.static_value.p);
+    }
+
+    for(i = 0; i < cb->methods_count; i++) {
+        MethodBlock *mb = &cb->methods[i];
+
+        RELOCATE_FLUSH(&mb->class);
+        RELOCATE_FLUSH(&mb->name);
+        RELOCATE_FLUSH(&mb->type);
+        RELOCATE_FLUSH(&mb->signature);
+        RELOCATE_FLUSH(&mb->code);
+        RELOCATE_FLUSH(&mb->throw_table);
+        RELOCATE_FLUSH(&mb->exception_table);
+        RELOCATE_FLUSH(&mb->line_no_table);
+        RELOCATE_FLUSH(&mb->annotations);
+
+        if(mb->annotations != NULL) {
+            relocateAnnotation(&mb->annotations->annotations);
+            relocateAnnotation(&mb->annotations->parameters);
+            relocateAnnotation(&mb->annotations->dft_val);
+        }
+
+#ifdef DIRECT
+        relocateMethodCode(mb, relocateSlot);
+#endif
+    }
+
+    for(i = 0; i < cb->method_table_size; i++)
+        RELOCATE_FLUSH(&cb->method_table[i]);
+
+    for(i = 0; i < cb->imethod_table_size; i++) {
+        RELOCATE_FLUSH(&cb->imethod_table[i].interface);
+        RELOCATE_FLUSH(&cb->imethod_table[i].offsets);
+    }
+}
+
+static void relocateLoaderTable(HashTable **slot) {
+    HashTable *table;
+
+    RELOCATE(slot);
+
+    if((table = *slot) == NULL)
+        return;
+
+    RELOCATE_FLUSH(&table->hash_table);
+
+    if(table->hash_table != (HashEntry*)pheap->classes_ht)
+        relocateEntries(table->hash_table, table->hash_size);
+}
+
+/* Class loaders keep their class table in a long field of their
+   VMClassLoaderData, which the reference offsets don't cover.  The
+   pheap is relocated before the heap, so these are up to date */
+static Class *reloc_loader_data_class;
+static int reloc_ldr_data_tbl_offset;
+
+/* Other threads may be relocating the object's class at the same
+   time, so pointers read from it are passed through relocatePtr */
+
+static void relocateObject(Object *ob) {
+    RefsOffsetsEntry *refs;
+    ClassBlock *cb;
+    char *name;
+    int i;
+
+    RELOCATE(&ob->lock);
+    RELOCATE(&ob->class);
+
+    if(ob->class == NULL)
+        return;
+
+    cb = CLASS_CB(ob->class);
+    name = relocatePtr(cb->name);
+
+    if(name[0] == '[') {
+        if((name[1] == 'L') || (name[1] == '[')) {
+            Object **body = ARRAY_DATA(ob, Object*);
+            int len = ARRAY_LEN(ob);
+
+            for(i = 0; i < len; i++)
+                RELOCATE(&body[i]);
+        }
+        return;
+    }
+
+    if(IS_CLASS_CLASS(cb)) {
+        relocateClassBlock(CLASS_CB((Class*)ob));
+        relocateClassData(CLASS_CB((Class*)ob));
+    } else if(ob->class == reloc_loader_data_class)
+        relocateLoaderTable(&INST_DATA(ob, HashTable*,
+                                       reloc_ldr_data_tbl_offset));
+
+    refs = (RefsOffsetsEntry*)relocatePtr((char*)cb->refs_offsets_table);
+
+    for(i = 0; i < cb->refs_offsets_size; i++) {
+        int offset = refs[i].start;
+
+        for(; offset < refs[i].end; offset += sizeof(Object*))
+            RELOCATE(&INST_DATA(ob, Object*, offset));
+    }
+}
+
+static void *relocateSlice(void *arg) {
+    HeapSlice *slice = arg;
+    char *ptr;
+
+    for(ptr = slice->start; ptr < slice->end; ) {
+        uintptr_t hdr = HEADER(ptr);
+
+        if(HDR_ALLOCED(hdr))
+            relocateObject((Object*)(ptr+HEADER_SIZE));
+        else
+            RELOCATE(&((Chunk*)ptr)->next);
+
+        ptr += HDR_SIZE(hdr);
+    }
+
+    pmemobj_flush(pop_heap, slice->start, slice->end - slice->start);
+    return NULL;
+}
+
+static int sliceThreads() {
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return threads < 1 ? 1 : threads > MAX_SLICES ? MAX_SLICES : threads;
+}
+
+static void runSlices(HeapSlice *slices, int count, void *(*fn)(void*)) {
+    pthread_t tids[MAX_SLICES];
+    int created[MAX_SLICES];
+    int i;
+
+    for(i = 1; i < count; i++)
+        created[i] = pthread_create(&tids[i], NULL, fn, &slices[i]) == 0;
+
+    /* Slices which could not be given a thread
+       of their own are done by the caller */
+    for(i = 0; i < count; i++)
+        if(i == 0 || !created[i])
+            (*fn)(&slices[i]);
+
+    for(i = 1; i < count; i++)
+        if(created[i])
+            pthread_join(tids[i], NULL);
+}
+
+/* The heap is split on object boundaries, found by walking the headers */
+
+static int heapSlices(HeapSlice *slices, int count) {
+    char *base = pheap->heapbase, *limit = pheap->heaplimit;
+    uintptr_t len = (limit - base) / count;
+    char *ptr, *start = base;
+    int n = 0;
+
+    for(ptr = base; ptr < limit; ) {
+        ptr += HDR_SIZE(HEADER(ptr));
+
+        if(ptr - start >= len && n < count - 1) {
+            slices[n].start = start;
+            slices[n++].end = start = ptr;
+        }
+    }
+
+    slices[n].start = start;
+    slices[n++].end = limit;
+
+    return n;
+}
+
+/* The last collection recorded a number of live blocks spread over
+   the heap (see recordBlockHints), so it can be split without the
+   header walk.  Segments between hints are dealt out evenly */
+
+static int hintedHeapSlices(HeapSlice *slices, int count) {
+    char *bounds[BLOCK_HINTS + 2];
+    int segs = 0, n = 0, i;
+
+    bounds[0] = pheap->heapbase;
+    for(i = 0; i < pheap->block_hint_count; i++) {
+        char *hint = pheap->heapbase + pheap->block_hints[i];
+
+        if(hint > bounds[segs] && hint < pheap->heaplimit)
+            bounds[++segs] = hint;
+    }
+    bounds[++segs] = pheap->heaplimit;
+
+    if(segs == 1)
+        return heapSlices(slices, count);
+
+    for(i = 0; i < count; i++) {
+        char *start = bounds[i * segs / count];
+        char *end = bounds[(i + 1) * segs / count];
+
+        if(end > start) {
+            slices[n].start = start;
+            slices[n++].end = end;
+        }
+    }
+
+    return n;
+}
+
+/* On reopening a pool the classes' prepared code is unlinked from the
+   handlers of the last run (see interp/direct.c).  After a crash the
+   lock words also still hold the owners of the last run (thread ids
+   and inflated monitors) and the headers their FLC bits.  None of the
+   threads exist any more, so all of it is cleared, and the monitors
+   are reset as the monitor cache is opened (see lock.c).  Only the
+   objects whose words were cleared are flushed, those close together
+   as one range */
+
+#define RESUME_FLUSH_GAP 4096
+
+static void *resumeSlice(void *arg) {
+    HeapSlice *slice = arg;
+    char *dirty_start = NULL, *dirty_end = NULL;
+    char *ptr;
+
+    for(ptr = slice->start; ptr < slice->end; ) {
+        uintptr_t hdr = HEADER(ptr);
+
+        if(HDR_ALLOCED(hdr)) {
+            Object *ob = (Object*)(ptr+HEADER_SIZE);
+
+            if(!clean_restart && (hdr & FLC_BIT || ob->lock != 0)) {
+                if(hdr & FLC_BIT)
+                    clearFlcBit(ob);
+                ob->lock = 0;
+
+                if(dirty_start != NULL && ptr > dirty_end + RESUME_FLUSH_GAP) {
+                    pmemobj_flush(pop_heap, dirty_start, dirty_end - dirty_start);
+                    dirty_start = NULL;
+                }
+
+                if(dirty_start == NULL)
+                    dirty_start = ptr;
+                dirty_end = (char*)(&ob->lock + 1);
+            }
+
+#ifdef DIRECT
+            if(IS_CLASS(ob))
+                unlinkClassCode((Class*)ob);
+#endif
+        }
+
+        ptr += HDR_SIZE(hdr);
+    }
+
+    if(dirty_start != NULL)
+        pmemobj_flush(pop_heap, dirty_start, dirty_end - dirty_start);
+    return NULL;
+}
+
+static void resumeHeap() {
+    HeapSlice slices[MAX_SLICES];
+
+    runSlices(slices, hintedHeapSlices(slices, sliceThreads()), resumeSlice);
+    pmemobj_drain(pop_heap);
+}
+
+static int relocateHeap(InitArgs *args) {
+    HeapSlice slices[MAX_SLICES];
+    int threads = sliceThreads();
+    uintptr_t root_offset = (char*)pheap - (char*)pop_heap;
+    int i, j;
+
+    reloc_to = (char*)pop_heap;
+    reloc_len = pheap->pool_size;
+    reloc_from_count = 0;
+
+    /* The words in the pool may be relative to the last base or
+       to the target of any interrupted relocation.  The bases are
+       the address of the root object */
+    if(pheap->base_address != pheap)
+        reloc_from[reloc_from_count++] = (char*)pheap->base_address - root_offset;
+
+    for(i = 0; i < pheap->reloc_count; i++)
+        if(pheap->reloc_bases[i] != pheap)
+            reloc_from[reloc_from_count++] = (char*)pheap->reloc_bases[i] - root_offset;
+
+    if(reloc_from_count == 0)
+        return TRUE;
+
+    for(i = 0; i <= reloc_from_count; i++)
+        for(j = i + 1; j <= reloc_from_count; j++) {
+            char *a = i == reloc_from_count ? reloc_to : reloc_from[i];
+            char *b = j == reloc_from_count ? reloc_to : reloc_from[j];
+
+            if(a != b && (a < b ? b - a : a - b) < reloc_len) {
+                printf("ERROR: pool mapped at %p overlaps its previous mapping at %p\n",
+                       reloc_to, a == reloc_to ? b : a);
+                return FALSE;
+            }
+        }
+
+    if(pheap->reloc_count == RELOC_MAX_BASES) {
+        printf("ERROR: too many interrupted relocations of the pool\n");
+        return FALSE;
+    }
+
+    pheap->reloc_bases[pheap->reloc_count] = pheap;
+    pmemobj_persist(pop_heap, &pheap->reloc_bases[pheap->reloc_count], sizeof(void*));
+    pheap->reloc_count++;
+    pmemobj_persist(pop_heap, &pheap->reloc_count, sizeof(int));
+
+    /* The pheap holds the heap bounds, so it goes first.  Each
+       class's metadata is relocated with the class, by the slices */
+    relocateRoot();
+
+    reloc_loader_data_class = pheap->opc.loader_data_class;
+    reloc_ldr_data_tbl_offset = pheap->opc.ldr_data_tbl_offset;
+
+    runSlices(slices, heapSlices(slices, threads), relocateSlice);
+    pmemobj_drain(pop_heap);
+
+    if(args->verbosegc)
+        jam_printf("<GC: Relocated persistent heap from %p to %p using %d threads>\n",
+                   pheap->base_address, pheap, threads);
+
+    pheap->base_address = pheap;
+    pmemobj_persist(pop_heap, &pheap->base_address, sizeof(void*));
+    pheap->reloc_count = 0;
+    pmemobj_persist(pop_heap, &pheap->reloc_count, sizeof(int));
+
+    return TRUE;
 }
+// End of modification
 
 // JaPHa Modification
+/* The pool holds the root object and, allocated separately, the
+   heap.  The heap's capacity is set by -Xmx when the pool is created,
+   and grows by further extents when it's reopened with a larger -Xmx
+   (see growHeap).  Within it the heap starts out at -Xms and is
+   expanded online up to the capacity (see expandHeap).
+
+   Creation only writes the pool and heap headers.  The file is
+   created sparse (libpmemobj would allocate all of it), and unlike
+   the root object the heap is not zeroed by libpmemobj: objects
+   are zeroed as the free list hands them out (see ph_malloc) */
+static char *pool_path;
+
+static int createSparseFile(char *path, unsigned long size) {
+	int fd = open(path, O_RDWR|O_CREAT|O_EXCL, 0666);
+	int ok;
+
+	if(fd == -1)
+		return FALSE;
+
+	ok = ftruncate(fd, size) == 0;
+	close(fd);
+
+	if(!ok)
+		unlink(path);
+
+	return ok;
+}
+
+/* The extents the heap has grown by lie above it in the pool, but not
+   next to it.  The end of each extent is bridged to the start of the
+   next by an allocated object with no class, which every collection
+   pins, so the heap can still be walked from heapbase to heaplimit.
+   A bridge is written as the heap is expanded past it.  Every extent
+   leaves room for one at its end */
+#define BRIDGE_SIZE MIN_OBJECT_SIZE
+
+static char *bridges[HEAP_MAX_EXTENTS];
+static char *extent_bases[HEAP_MAX_EXTENTS];
+static int extent_count;
+
+static char *extentBase(PMEMoid oid) {
+	return (char*)(((uintptr_t)pmemobj_direct(oid) + HEADER_SIZE + OBJECT_GRAIN-1) &
+	               ~(OBJECT_GRAIN-1)) - HEADER_SIZE;
+}
+
+static void initialiseExtents() {
+	int i;
+
+	extent_count = pheap->heap_extent_count;
+
+	for(i = 0; i < extent_count; i++) {
+		bridges[i] = pheap->heapbase + pheap->heap_bridges[i];
+		extent_bases[i] = extentBase(pheap->heap_extents[i]);
+	}
+}
+
+/* Past a bridge object, before the start of the next extent */
+static int inHeapGap(char *ptr) {
+	int i;
+
+	for(i = 0; i < extent_count; i++)
+		if(ptr > bridges[i] + HEADER_SIZE && ptr < extent_bases[i] + HEADER_SIZE)
+			return TRUE;
+
+	return FALSE;
+}
+
+/* The part of the heap below limit taken by bridges */
+static uintptr_t bridgedBelow(char *limit) {
+	uintptr_t size = 0;
+	int i;
+
+	for(i = 0; i < extent_count; i++)
+		if(extent_bases[i] <= limit)
+			size += extent_bases[i] - bridges[i];
+
+	return size;
+}
+
+static uintptr_t heapSize() {
+	return heaplimit - heapbase - bridgedBelow(heaplimit);
+}
+
+/* On open the live part of the heap can be brought in ahead of use,
+   either by advising the kernel or by touching every page from
+   several threads.  Pages are touched for writing, as a read fault
+   maps the page read-only and the first store faults again.  The
+   kernel populates them writable itself where it can, otherwise
+   each page is written with its own contents (nothing else runs
+   on the heap while it is opened) */
+static void *touchSlice(void *arg) {
+	HeapSlice *slice = arg;
+	int page_size = getpagesize();
+	volatile char *ptr;
+
+#ifdef MADV_POPULATE_WRITE
+	if(slice->end == slice->start ||
+	       madvise(slice->start, slice->end - slice->start,
+	               MADV_POPULATE_WRITE) == 0)
+		return NULL;
+#endif
+
+	for(ptr = slice->start; ptr < slice->end; ptr += page_size)
+		*ptr = *ptr;
+
+	return NULL;
+}
+
+static void prefaultRange(int mode, char *start, char *end) {
+	uintptr_t page_mask = getpagesize() - 1;
+
+	start = (char*)((uintptr_t)start & ~page_mask);
+
+	if(mode == PREFAULT_WILLNEED)
+		madvise(start, end - start, MADV_WILLNEED);
+	else if(mode == PREFAULT_TOUCH) {
+		HeapSlice slices[MAX_SLICES];
+		int count = sliceThreads();
+		uintptr_t len = ((end - start) / count + page_mask) & ~page_mask;
+		int i;
+
+		for(i = 0; i < count; i++) {
+			slices[i].start = start + i * len;
+			slices[i].end = slices[i].start + len;
+			if(i == count - 1 || slices[i].end > end)
+				slices[i].end = end;
+			if(slices[i].start > end)
+				slices[i].start = end;
+		}
+
+		runSlices(slices, count, touchSlice);
+	}
+}
+
+/* Extent by extent, the gaps in between aren't the heap's */
+static void prefaultHeap(int mode) {
+	char *start = pheap->heapbase;
+	int i;
+
+	for(i = 0; i < extent_count && bridges[i] < pheap->heaplimit; i++) {
+		prefaultRange(mode, start, bridges[i] + BRIDGE_SIZE);
+		start = extent_bases[i];
+	}
+
+	prefaultRange(mode, start, pheap->heaplimit);
+}
+
 int initialiseRoot(InitArgs *args) {
-	unsigned long heap_size;
+	unsigned long capacity, pool_size;
+	PMEMoid heap_oid;
 
-	if(HEAP_SIZE < PMEMOBJ_MIN_POOL)
-		heap_size = PMEMOBJ_MIN_POOL;
-	else
-		heap_size = HEAP_SIZE;
+	pool_path = args->heap_file != NULL && *args->heap_file != '\0' ?
+	            args->heap_file : DEFAULT_POOL_PATH;
 
-	if(access(PATH, F_OK) != 0) {
-		if((pop_heap = pmemobj_create(PATH, POBJ_LAYOUT_NAME(HEAP_POOL), PHEAP_SIZE, 0666)) == NULL) {//8388608
-			printf("failed to create pool\n");
+	/* A snapshot left by snapshot mode is the pool's last
+	   consistent state, whatever the mode now (see snapshot.c) */
+	if(!restoreSnapshot(pool_path))
+		return FALSE;
+
+	first_ex = access(pool_path, F_OK) != 0;
+
+	if(first_ex) {
+		capacity = (args->max_heap + OBJECT_GRAIN-1) & ~(OBJECT_GRAIN-1);
+		pool_size = POOL_SIZE(capacity);
+
+		if(!createSparseFile(pool_path, pool_size) ||
+		   (pop_heap = pmemobj_create(pool_path, POBJ_LAYOUT_NAME(HEAP_POOL), 0, 0666)) == NULL) {
+			printf("failed to create pool %s\n", pool_path);
 			printf("error msg:\t%s\n", pmem_errormsg());
 			return FALSE;
 		}
-		BEGIN_TX("INITIALISEROOT CREATING")
-		root_heap = pmemobj_root(pop_heap, heap_size);
+		root_heap = pmemobj_root(pop_heap, sizeof(PHeap));
 		pheap = (PHeap*) pmemobj_direct(root_heap);
-		pheap->base_address = pheap;
-		pheap->heapfree = HEAP_SIZE - sizeof(Chunk);
-		pheap->maxHeap = HEAP_SIZE;
+		replayLog(pool_path, FALSE);
+		if(pmemobj_alloc(pop_heap, &heap_oid, capacity + BRIDGE_SIZE, 0, NULL, NULL) != 0 ||
+		   pmemobj_alloc(pop_heap, &pheap->markbits, MARKBITS_SIZE(capacity), 0, NULL, NULL) != 0 ||
+		   pmemobj_alloc(pop_heap, &pheap->forwarding, FORWARDING_SIZE(capacity), 0, NULL, NULL) != 0) {
+			printf("failed to allocate a heap of %ldM in pool %s\n",
+			       (long)(capacity / MB), pool_path);
+			printf("error msg:\t%s\n", pmemobj_errormsg());
+			return FALSE;
+		}
+		BEGIN_TX("INITIALISEROOT CREATING")
+		pheap->base_address = pheap->hash_base = pheap;
+		pheap->pool_size = pool_size;
+		pheap->maxHeap = capacity;
+		pheap->heapMem = pmemobj_direct(heap_oid);
 		pheap->heapbase = (char*) (((uintptr_t)pheap->heapMem + HEADER_SIZE + OBJECT_GRAIN-1) & ~(OBJECT_GRAIN-1)) - HEADER_SIZE;
 		pheap->heapmax = pheap->heapbase + ((args->max_heap - (pheap->heapbase - pheap->heapMem)) & ~(OBJECT_GRAIN - 1));
 		pheap->heaplimit = pheap->heapbase + ((args->min_heap - (pheap->heapbase - pheap->heapMem)) & ~(OBJECT_GRAIN - 1));
+		pheap->heapfree = pheap->heaplimit - pheap->heapbase;
 		pheap->freelist = (Chunk*) pheap->heapbase;
 		pheap->freelist->header = pheap->heaplimit - pheap->heapbase;
 		pheap->freelist->next = NULL;
 		pheap->chunkpp = &(pheap->freelist);
+		pmemobj_persist(pop_heap, pheap->freelist, sizeof(Chunk));
 	}
 	else {
-		if((pop_heap = pmemobj_open(PATH, POBJ_LAYOUT_NAME(HEAP_POOL))) == NULL) {
-			printf("failed to open pool\n");
+		if((pop_heap = pmemobj_open(pool_path, POBJ_LAYOUT_NAME(HEAP_POOL))) == NULL) {
+			printf("failed to open pool %s\n", pool_path);
 			return FALSE;
 		}
-		BEGIN_TX("INITIALISEROOT OPENING")
-		root_heap = pmemobj_root(pop_heap, heap_size);
+		root_heap = pmemobj_root(pop_heap, sizeof(PHeap));
 		pheap = (struct pheap*) pmemobj_direct(root_heap);
-		if(pheap->base_address != pheap) {
-			printf("ERROR: base addresses are different, will abort VM execution\n");
-			printf("Expected base address was %p, but current base address is %p\n", pheap->base_address, pheap);
-			//pmemobj_close(pop_heap);	// attempt to close memory pool is generating segfault, so we'll just skip it
-			exit(-1);
+		/* The redo log of snapshot mode goes over the snapshot
+		   restored above, before anything reads the pool */
+		replayLog(pool_path, TRUE);
+		if(pheap->base_address != pheap || pheap->reloc_count != 0) {
+			if(!relocateHeap(args)) {
+				//pmemobj_close(pop_heap);	// attempt to close memory pool is generating segfault, so we'll just skip it
+				exit(-1);
+			}
+			initialiseExtents();
+		} else {
+			/* Relocation has touched the whole heap already */
+			initialiseExtents();
+			prefaultHeap(args->prefault);
 		}
+		BEGIN_TX("INITIALISEROOT OPENING")
 	}
 
+	hash_delta = (char*)pheap - (char*)pheap->hash_base;
+
 	return TRUE;
 }
 //End of modification
@@ -367,13 +1173,10 @@ void initialiseAlloc(InitArgs *args) {
         persistent = TRUE;
 
         //JaPHa Modification
-        if( access(PATH, F_OK ) != -1 ) {
-            file = TRUE;
-        }
-
         if(!initialiseRoot(args)) {
             printf("Problem when creating/opening pool\n");
         }
+        file = !first_ex;
         //End of modification
     } else {
         heapMem = (char*)mmap(0, args->max_heap, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
@@ -415,15 +1218,17 @@ void initialiseAlloc(InitArgs *args) {
                 ph_value = &(pheap->opc);
                 set_java_lang_class(ph_value->java_lang_Class);
                 set_ldr_vmdata_offset(ph_value->ldr_vmdata_offset);
-        } else {
-                pheap->nvmCurrentSize = NVM_INIT_SIZE;
-                pheap->nvm_limit = (unsigned long) pheap->nvm + pheap->nvmCurrentSize;
-                pheap->nvmfreelist = (nvmChunk*) pheap->nvm;
-                pheap->nvmfreelist->chunkSize = pheap->nvmFreeSpace = (pheap->nvmCurrentSize - nvmHeaderSize);
-                pheap->nvmfreelist->allocBit = 0;
-                pheap->nvmfreelist->next = NULL;
-                pheap->nvmChunkpp = &(pheap->nvmfreelist);
-        }
+                if(ph_value->ref_referent_offset > 0) {
+                    ref_referent_offset = ph_value->ref_referent_offset;
+                    ref_queue_offset = ph_value->ref_queue_offset;
+                }
+
+                /* The allocation rover may have been rolled back to
+                   a free list which has since been swept */
+                chunkpp = pheap->chunkpp = &pheap->freelist;
+                pmemobj_persist(pop_heap, &pheap->chunkpp, sizeof(Chunk**));
+        }
+        initialiseNVM(!file);
     } else {
         freelist->header = heapfree = heaplimit-heapbase;
         freelist->next = NULL;
@@ -433,6 +1238,37 @@ void initialiseAlloc(InitArgs *args) {
     TRACE_GC("Alloced heap size %p\n", heaplimit-heapbase);
     allocMarkBits();
 
+    // JaPHa Modification
+    if(persistent) {
+        /* Only a crash can leave a collection to be redone.  The
+           flag is cleared first, so should this run crash its
+           restart isn't taken for a clean one */
+        if(file) {
+            if(pheap->clean_shutdown) {
+                pheap->clean_shutdown = FALSE;
+                pmemobj_persist(pop_heap, &pheap->clean_shutdown, sizeof(int));
+                clean_restart = TRUE;
+
+                if(verbosegc)
+                    jam_printf("<GC: Persistent heap was shut down cleanly>\n");
+            } else {
+                recoverSweep();
+                recoverCompaction();
+            }
+
+            resumeHeap();
+
+            /* Once the last run's collection is done with them, the
+               mark bits and forwarding table can be resized */
+            growHeap(args->max_heap);
+            allocMarkBits();
+        }
+
+        /* Sized by the heap's capacity, which is now fixed */
+        allocTransientBits();
+    }
+    // End of modification
+
     /* Initialise GC locks */
     initVMLock(heap_lock);
     initVMLock(has_fnlzr_lock);
@@ -449,10 +1285,17 @@ void initialiseAlloc(InitArgs *args) {
 
 /* ------------------------- MARK PHASE ------------------------- */
 
+// JaPHa Modification
+/* Whether the mark heap scan has already passed the object */
+#define SCANNED(ptr) (scanning_young ?                                 \
+                      !IN_NURSERY(ptr) || ((char*)(ptr)) < mark_scan_ptr : \
+                      !IN_NURSERY(ptr) && ((char*)(ptr)) < mark_scan_ptr)
+// End of modification
+
 #define MARK_AND_PUSH(object, mark) {                \
     SET_MARK(object, mark);                          \
                                                      \
-    if(((char*)object) < mark_scan_ptr) {            \
+    if(SCANNED(object)) {                            \
         if(mark_stack_count == MARK_STACK_SIZE)      \
             mark_stack_overflow++;                   \
         else                                         \
@@ -597,6 +1440,16 @@ void scanThread(Thread *thread) {
     }
 }
 
+// JaPHa Modification
+/* The slots of a stack saved by a checkpoint are scanned
+   like those of the stack itself (see checkpoint.c) */
+void markSavedSlots(uintptr_t *slot, uintptr_t *end) {
+    for(; slot < end; slot++)
+        if(IS_OBJECT(*slot))
+            markConservativeRoot((Object*)*slot);
+}
+// End of modification
+
 void markClassData(Class *class, int mark) {
     ClassBlock *cb = CLASS_CB(class);
     ConstantPool *cp = &cb->constant_pool;
@@ -690,6 +1543,15 @@ void markChildren(Object *ob, int mark, int mark_soft_refs) {
                                  " flags %d referent %p\n",
                                  ob, cb->name, cb->flags, referent);
 
+                        // JaPHa Modification
+                        /* Collecting the young generation alone, every
+                           referent is strongly reachable.  Clearing it
+                           is left to the next full collection */
+                        if(minor_collection) {
+                            if(referent != NULL && mark > IS_MARKED(referent))
+                                MARK_AND_PUSH(referent, mark);
+                        } else
+                        // End of modification
                         if(!IS_WEAK_REFERENCE(cb) && referent != NULL) {
                             int ref_mark = IS_MARKED(referent);
                             int new_mark;
@@ -770,8 +1632,9 @@ void markStack(int mark_soft_refs) {
     }
 }
 
-void scanHeap(int mark_soft_refs) {
-    for(mark_scan_ptr = heapbase; mark_scan_ptr < heaplimit;) {
+// JaPHa Modification
+static void scanRegion(char *base, char *limit, int mark_soft_refs) {
+    for(mark_scan_ptr = base; mark_scan_ptr < limit;) {
         uintptr_t hdr = HEADER(mark_scan_ptr);
         uintptr_t size;
 
@@ -792,6 +1655,27 @@ void scanHeap(int mark_soft_refs) {
     }
 }
 
+void scanHeap(int mark_soft_refs) {
+    /* Only the heap objects in the remembered set
+       can refer to young objects */
+    if(minor_collection) {
+        scanning_young = TRUE;
+        mark_scan_ptr = nursery_base;
+        scanRemembered(mark_soft_refs);
+        scanRegion(nursery_base, nursery_limit, mark_soft_refs);
+        return;
+    }
+
+    scanning_young = FALSE;
+    scanRegion(heapbase, heaplimit, mark_soft_refs);
+
+    if(nursery_base != NULL) {
+        scanning_young = TRUE;
+        scanRegion(nursery_base, nursery_limit, mark_soft_refs);
+    }
+}
+// End of modification
+
 void scanHeapAndMark(int mark_soft_refs) {
     do {
         mark_stack_overflow = 0; 
@@ -813,6 +1697,13 @@ static void doMark(Thread *self, int mark_soft_refs) {
     markBootClasses();
     markJNIGlobalRefs();
     scanThreads();
+    // JaPHa Modification
+    scanCheckpoint();
+
+    /* The bridges between the heap's extents never move (see growHeap) */
+    for(i = 0; i < extent_count && bridges[i] < heaplimit; i++)
+        markConservativeRoot((Object*)(bridges[i] + HEADER_SIZE));
+    // End of modification
 
     /* All roots should now be marked.  Scan the heap and recursively
        mark all marked objects - once the heap has been scanned all
@@ -893,6 +1784,30 @@ static void doMark(Thread *self, int mark_soft_refs) {
 
 /* ------------------------- SWEEP PHASE ------------------------- */
 
+// JaPHa Modification
+/* Set while sweeping without an undo log (see sweepPersistent), and
+   while redoing an interrupted collection on open (see recoverSweep
+   and recoverCompaction) */
+static int restartable_sweep;
+static int recovering_gc;
+
+#define IN_HEAP(ptr) (((char*)(ptr)) > heapbase && ((char*)(ptr)) < heaplimit)
+
+/* In log mode the collector's writes which aren't made through the
+   store barriers are added to its redo set (see walBeginGC) */
+#define GC_LOG(addr, size) \
+    (wal_mode ? walRange(getTxState(), (char*)(addr), size) : (void)0)
+
+/* Writes of a restartable sweep are flushed instead of logged.  They
+   are ordered before the end of the sweep by a single drain */
+#define SWEEP_FLUSH(addr, size) \
+    ((restartable_sweep ? pmemobj_flush(pop_heap, addr, size) : (void)0), \
+     GC_LOG(addr, size))
+
+#define SWEEP_FLUSH_LINK(chunk, list_head) \
+    if((chunk) != (list_head)) SWEEP_FLUSH(&(chunk)->next, sizeof(Chunk*))
+// End of modification
+
 int handleMarkedSpecial(Object *ob) {
     ClassBlock *cb = CLASS_CB(ob->class);
     int cleared = FALSE;
@@ -901,7 +1816,10 @@ int handleMarkedSpecial(Object *ob) {
         Object *referent = INST_DATA(ob, Object*, ref_referent_offset);
 
         if(referent != NULL) {
-            int ref_mark = IS_MARKED(referent);
+            /* A referent left in the last run's young generation
+               is dead (see recoverSweep) */
+            int ref_mark = recovering_gc && !IN_HEAP(referent) ? 0
+                                                                : IS_MARKED(referent);
 
             TRACE_GC("FREE: found Reference Object @%p class %s"
                      " flags %d referent %x mark %d\n",
@@ -916,13 +1834,15 @@ int handleMarkedSpecial(Object *ob) {
 
                 TRACE_GC("FREE: Clearing the referent field.\n");
                 INST_DATA(ob, Object*, ref_referent_offset) = NULL;
+                SWEEP_FLUSH(&INST_DATA(ob, Object*, ref_referent_offset), sizeof(Object*));
                 cleared = TRUE;
             }
 
             /* If the reference has a queue, add it to the list for enqueuing
-               by the Reference Handler thread. */
+               by the Reference Handler thread.  There is no Reference
+               Handler yet when recovering */
 
-            if(INST_DATA(ob, Object*, ref_queue_offset) != NULL) {
+            if(!recovering_gc && INST_DATA(ob, Object*, ref_queue_offset) != NULL) {
                 TRACE_GC("FREE: Adding to list for enqueuing.\n");
 
                 ADD_TO_OBJECT_LIST(reference, ob);
@@ -993,12 +1913,12 @@ static uintptr_t doSweep(Thread *self) {
             freed += size;
             unmarked++;
 
-            if(HDR_SPECIAL_OBJ(hdr) && ob->class != NULL)
+            if(HDR_SPECIAL_OBJ(hdr) && ob->class != NULL && !recovering_gc)
                 handleUnmarkedSpecial(ob);
 
             /* Clear any set flag bits within the header */
 			// JAPHA modification by Taciano on Apr 24 2016 to implement tx GC
-			if (persistent) { NVML_DIRECT("DO_SWEEP", &curr->header, sizeof(uintptr_t)) }
+			if (persistent && !restartable_sweep) { NVML_DIRECT("DO_SWEEP", &curr->header, sizeof(uintptr_t)) }
             curr->header &= HDR_FLAGS_MASK;
 
             TRACE_GC("FREE: Freeing ob @%p class %s - start of block\n", ob,
@@ -1030,7 +1950,7 @@ static uintptr_t doSweep(Thread *self) {
                 freed += size;
                 unmarked++;
 
-                if(HDR_SPECIAL_OBJ(hdr) && ob->class != NULL)
+                if(HDR_SPECIAL_OBJ(hdr) && ob->class != NULL && !recovering_gc)
                     handleUnmarkedSpecial(ob);
 
                 TRACE_GC("FREE: Freeing object @%p class %s - merging onto block @%p\n",
@@ -1052,11 +1972,13 @@ static uintptr_t doSweep(Thread *self) {
 
         /* Add onto total count of free chunks */
         heapfree += curr->header;
+        SWEEP_FLUSH(&curr->header, sizeof(uintptr_t));
 
        /* Add chunk onto the freelist only if it's
           large enough to hold an object */
         if(curr->header >= MIN_OBJECT_SIZE) {
             last->next = curr;
+            SWEEP_FLUSH_LINK(last, &newlist);
             last = curr;
         }
 
@@ -1081,11 +2003,13 @@ out_last_free:
         largest = curr->header;
 
     heapfree += curr->header;
+    SWEEP_FLUSH(&curr->header, sizeof(uintptr_t));
 
     /* Add chunk onto the freelist only if it's
        large enough to hold an object */
     if(curr->header >= MIN_OBJECT_SIZE) {
         last->next = curr;
+        SWEEP_FLUSH_LINK(last, &newlist);
         last = curr;
     }
 
@@ -1094,6 +2018,7 @@ out_last_marked:
     /* We've now reconstructed the freelist, set freelist
        pointer to new list */
     last->next = NULL;
+    SWEEP_FLUSH_LINK(last, &newlist);
     freelist = newlist.next;
 
     /* Reset next allocation block to beginning of list -
@@ -1121,9 +2046,28 @@ out_last_marked:
 
 /* ------------------------- COMPACT PHASE ------------------------- */
 
+// JaPHa Modification
+/* When set, threadReference hands references to this instead
+   (promotion and restart fix-ups, see YOUNG GENERATION) */
+static void (*young_ref_visitor)(Object **ref);
+// End of modification
+
 void threadReference(Object **ref) {
     Object *ob = *ref;
-    uintptr_t *hdr = HDR_ADDRESS(ob);
+    uintptr_t *hdr;
+
+    // JaPHa Modification
+    if(young_ref_visitor != NULL) {
+        (*young_ref_visitor)(ref);
+        return;
+    }
+
+    /* Young objects are not moved by the compaction */
+    if(IN_NURSERY(ob))
+        return;
+    // End of modification
+
+    hdr = HDR_ADDRESS(ob);
 
     TRACE_COMPACT("Threading ref addr %p object ref %p link %p\n",
                   ref, ob, *hdr);
@@ -1283,7 +2227,7 @@ int compactSlideBlock(char *block_addr, char *new_addr) {
 		}
 					  
         /* Add the original address onto the end of the object */
-        *hash_addr = (uintptr_t)(block_addr + HEADER_SIZE);
+        *hash_addr = ADDRESS_HASHCODE(block_addr + HEADER_SIZE);
         *hdr_addr &= ~HASHCODE_TAKEN_BIT;
         *hdr_addr |= HAS_HASHCODE_BIT;
         *hdr_addr += OBJECT_GRAIN;
@@ -1492,6 +2436,10 @@ uintptr_t doCompact() {
     threadInternedStrings();
     threadLiveClassLoaderDlls();
 
+    // JaPHa Modification
+    threadYoungSurvivors();
+    // End of modification
+
     TRACE_COMPACT("COMPACT PHASE ONE\n");
 
     /* First phase scans the heap, threads each objects references
@@ -1647,148 +2595,1983 @@ marked_phase2:
     return largest;
 }
 
-void expandHeap(int min) {
-    Chunk *chunk, *new;
-    uintptr_t delta;
+// JaPHa Modification
+/* Restartable compaction of the persistent heap (see compactPersistent).
+
+   Threading rewrites every reference twice and undo-logs both the
+   source and destination of each slid block.  Instead, new addresses
+   are derived from the mark bits into a forwarding table before
+   anything moves.  The heap is split into regions of one bitmap word
+   of grains.  Each region holds the new offset of its first live
+   grain, a live bitmap has a bit for every grain of a live object and
+   a grown bitmap one at the start of each moved object that gains a
+   hashcode word, so
+
+     forward(block) = base[region] + GRAIN * (live + grown bits below it)
+
+   Regions holding a conservative root are pinned: the objects starting
+   in them do not move.  The table depends only on the marks, so it
+   still gives an object's new address once the heap has been changed */
+
+#define FWD_BITS         (sizeof(uintptr_t) * 8)
+#define FWD_REGION_SIZE  (FWD_BITS << LOG_OBJECT_GRAIN)
+#define FWD_INDEX(ptr)   ((((char*)(ptr)) - heapbase) >> LOG_OBJECT_GRAIN)
+#define FWD_REGION(ptr)  (FWD_INDEX(ptr) / FWD_BITS)
+#define FWD_MASK(ptr)    ((uintptr_t)1 << (FWD_INDEX(ptr) % FWD_BITS))
+#define FWD_PINNED       1
+#define FWD_COUNT(word)  __builtin_popcountl(word)
+
+/* Entries are heap offsets, so the table survives the
+   pool being relocated after an interrupted compaction */
+static uintptr_t *fwd_base;
+static uintptr_t *fwd_live;
+static uintptr_t *fwd_grown;
+
+static void initForwarding() {
+    int regions = (heapmax - heapbase + FWD_REGION_SIZE - 1) / FWD_REGION_SIZE;
+
+    fwd_base = pmemobj_direct(pheap->forwarding);
+    fwd_live = fwd_base + regions;
+    fwd_grown = fwd_live + regions;
+}
 
-    if(verbosegc)
-        jam_printf("<GC: Expanding heap - minimum needed is %d>\n", min);
+static char *forwardBlock(char *block) {
+    int region = FWD_REGION(block);
+    uintptr_t below = FWD_MASK(block) - 1;
 
-    delta = (heaplimit-heapbase)/2;
-    delta = delta < min ? min : delta;
+    if(fwd_base[region] & FWD_PINNED)
+        return block;
 
-    if((heaplimit + delta) > heapmax)
-        delta = heapmax - heaplimit;
+    return heapbase + fwd_base[region] +
+           ((FWD_COUNT(fwd_live[region] & below) +
+             FWD_COUNT(fwd_grown[region] & below)) << LOG_OBJECT_GRAIN);
+}
 
-    /* Ensure new region is multiple of object grain in size */
+static Object *forwardObject(Object *ob) {
+    if(!IN_HEAP(ob))
+        return ob;
 
-    delta = (delta&~(OBJECT_GRAIN-1));
+    return (Object*)(forwardBlock((char*)ob - HEADER_SIZE) + HEADER_SIZE);
+}
 
-    if(verbosegc)
-        jam_printf("<GC: Expanding heap by %lld bytes>\n", (long long)delta);
+/* Scans the mark bits for the next live block at or after block */
+static char *nextMarkedBlock(char *block) {
+    char *ob = block + HEADER_SIZE;
 
-    new = (Chunk*)heaplimit;
-    new->header = delta;
-    new->next = NULL;
+    while(ob < heaplimit) {
+        unsigned int bits = markbits[MARKENTRY(ob)] >> MARKOFFSET(ob);
 
-    if(freelist != NULL) {
-        /* The freelist is in address order - find the last
-           free chunk and add the new area to the end.  */
+        if(bits == 0)
+            ob = heapbase + ((uintptr_t)(MARKENTRY(ob) + 1) <<
+                    (LOG_BYTESPERMARK+LOG_MARKSIZEBITS-LOG_BITSPERMARK));
+        else if(bits & ((1<<BITSPERMARK)-1))
+            return ob - HEADER_SIZE;
+        else
+            ob += OBJECT_GRAIN;
+    }
 
-        for(chunk = freelist; chunk->next != NULL; chunk = chunk->next);
-            chunk->next = new;
-    } else
-        freelist = new;
+    return heaplimit;
+}
 
-    heaplimit += delta;
-    heapfree += delta;
+static void setLiveBits(char *block, uintptr_t size) {
+    uintptr_t index = FWD_INDEX(block);
+    uintptr_t end = index + (size >> LOG_OBJECT_GRAIN);
 
-    /* The heap has increased in size - need to reallocate
-       the mark bits to cover new area */
+    while(index < end) {
+        int bit = index % FWD_BITS;
+        uintptr_t count = end - index;
 
-    sysFree(markbits);
+        if(count > FWD_BITS - bit)
+            count = FWD_BITS - bit;
 
-    allocMarkBits();
+        fwd_live[index / FWD_BITS] |= count == FWD_BITS ? ~(uintptr_t)0
+                                      : (((uintptr_t)1 << count) - 1) << bit;
+        index += count;
+    }
 }
 
+/* Builds the forwarding table and frees the special
+   unmarked objects, as phase one of doCompact does */
+static void buildForwardingTable(long long *marked, long long *unmarked,
+                                 long long *freed) {
+    int regions = (heaplimit - heapbase + FWD_REGION_SIZE - 1) / FWD_REGION_SIZE;
+    char *ptr, *new_addr;
+    int region = -1;
+    uintptr_t size;
+    int i;
 
-/* ------------------------- GARBAGE COLLECT ------------------------- */
+    memset(fwd_base, 0, regions * sizeof(uintptr_t));
+    memset(fwd_live, 0, regions * sizeof(uintptr_t));
+    memset(fwd_grown, 0, regions * sizeof(uintptr_t));
 
-static void getTime(struct timeval *tv) {
-    gettimeofday(tv, 0);
+    for(i = 0; i < conservative_root_count; i++)
+        if(IN_HEAP(conservative_roots[i]))
+            fwd_base[FWD_REGION((char*)conservative_roots[i] - HEADER_SIZE)] = FWD_PINNED;
+
+    for(new_addr = ptr = heapbase; ptr < heaplimit; ptr += size) {
+        uintptr_t hdr = HEADER(ptr);
+        Object *ob = (Object*)(ptr+HEADER_SIZE);
+
+        if(!HDR_ALLOCED(hdr)) {
+            size = hdr;
+            continue;
+        }
+
+        size = HDR_SIZE(hdr);
+
+        if(!IS_MARKED(ob)) {
+            if(HDR_SPECIAL_OBJ(hdr) && ob->class != NULL)
+                handleUnmarkedSpecial(ob);
+
+            *freed += size;
+            (*unmarked)++;
+            continue;
+        }
+
+        (*marked)++;
+
+        /* The first object starting in a region fixes its base.  Grains
+           below it in the region are the tail of an earlier object */
+        if(FWD_REGION(ptr) != region) {
+            region = FWD_REGION(ptr);
+
+            if(!(fwd_base[region] & FWD_PINNED))
+                fwd_base[region] = new_addr - heapbase -
+                    (FWD_COUNT(fwd_live[region] & (FWD_MASK(ptr) - 1)) << LOG_OBJECT_GRAIN);
+        }
+
+        if(fwd_base[region] & FWD_PINNED)
+            new_addr = ptr;
+        else
+            if(new_addr != ptr && HDR_HASHCODE_TAKEN(hdr)) {
+                fwd_grown[region] |= FWD_MASK(ptr);
+                new_addr += OBJECT_GRAIN;
+            }
+
+        setLiveBits(ptr, size);
+        new_addr += size;
+    }
+
+    pmemobj_persist(pop_heap, fwd_base, regions * sizeof(uintptr_t));
+    pmemobj_persist(pop_heap, fwd_live, regions * sizeof(uintptr_t));
+    pmemobj_persist(pop_heap, fwd_grown, regions * sizeof(uintptr_t));
 }
 
-static long endTime(struct timeval *start) {
-    struct timeval end;
-    int secs, usecs;
+/* Updates a reference held outside of the heap.  Used as the
+   reference visitor by the root threading functions */
+static void forwardRoot(Object **ref) {
+    Object *ob = forwardObject(*ref);
 
-    getTime(&end);
-    usecs = end.tv_usec - start->tv_usec;
-    secs = end.tv_sec - start->tv_sec;
+    if(ob != *ref) {
+        if(IN_POOL(ref))
+            NVML_DIRECT("COMPACT_ROOT", ref, sizeof(Object*))
+        *ref = ob;
+    }
+}
 
-    return secs * 1000000 + usecs;
+/* The parts of threadClassData which are outside of the class object.
+   The references within the ClassBlock move with the object */
+static void forwardClassData(Class *class) {
+    ClassBlock *cb = CLASS_CB(class);
+    ConstantPool *cp = &cb->constant_pool;
+    FieldBlock *fb = cb->fields;
+    Class *new_addr = forwardObject(class);
+    int i;
+
+    for(i = 0; i < cb->interfaces_count; i++)
+        if(cb->interfaces[i] != NULL)
+            forwardRoot(&cb->interfaces[i]);
+
+    for(i = 0; i < cb->imethod_table_size; i++)
+        forwardRoot(&cb->imethod_table[i].interface);
+
+    if(cb->state >= CLASS_LINKED)
+        for(i = 0; i < cb->fields_count; i++, fb++)
+            if((fb->access_flags & ACC_STATIC) &&
+               ((*fb->type == 'L') || (*fb->type == '[')))
+                forwardRoot((Object**)fb->u.static_value.data);
+
+    for(i = 1; i < cb->constant_pool_count; i++)
+        if(CP_TYPE(cp, i) == CONSTANT_ResolvedClass ||
+           CP_TYPE(cp, i) == CONSTANT_ResolvedString)
+            forwardRoot((Object**)&(CP_INFO(cp, i)));
+
+    if(new_addr == class)
+        return;
+
+    if(cb->fields_count > 0) {
+        NVML_DIRECT("COMPACT_FIELDS", cb->fields, cb->fields_count * sizeof(FieldBlock))
+        for(i = 0; i < cb->fields_count; i++)
+            cb->fields[i].class = new_addr;
+    }
+
+    if(cb->methods_count > 0) {
+        NVML_DIRECT("COMPACT_METHODS", cb->methods, cb->methods_count * sizeof(MethodBlock))
+        for(i = 0; i < cb->methods_count; i++)
+            cb->methods[i].class = new_addr;
+    }
 }
 
-/* JAPHA Change- modified by Taciano on Apr 24th to add transactional GC */
-unsigned long gc0_pmem(int mark_soft_refs, int compact) {
-    Thread *self = threadSelf();
-    uintptr_t largest;
+/* Updates every reference into the heap from outside of it,
+   as the root threading and threadChildren do for doCompact */
+static void forwardRoots() {
+    char *ptr;
 
-    /* Override compact if compaction has been specified
-       on the command line */
-    if(compact_override)
-        compact = compact_value;
+    young_ref_visitor = forwardRoot;
 
-    /* Reset flags.  Will be set during GC if a thread needs
-       to be woken up */
-    notify_finaliser_thread = notify_reference_thread = FALSE;
+    threadObjectLists();
+    threadRegisteredReferences();
+    threadBootClasses();
+    threadMonitorCache();
+    threadInternedStrings();
+    threadLiveClassLoaderDlls();
+    threadYoungSurvivors();
 
-    /* Grab locks associated with the suspension blocked
-       regions.  This ensures all threads have suspended
-       or gone to sleep, and cannot modify a list or obtain
-       a reference after the reference scans */
+    for(ptr = nextMarkedBlock(heapbase); ptr < heaplimit;
+            ptr = nextMarkedBlock(ptr + HDR_SIZE(HEADER(ptr)))) {
+        Object *ob = (Object*)(ptr+HEADER_SIZE);
 
-    /* Potential threads adding a newly created object */
-    lockVMLock(has_fnlzr_lock, self);
+        if(IS_CLASS(ob))
+            forwardClassData(ob);
+        else
+            if(ob->class != NULL && IS_CLASS_LOADER(CLASS_CB(ob->class)))
+                threadLoaderClasses(ob);
+    }
 
-    /* Held by the finaliser thread */
-	lockVMWaitLock(run_finaliser_lock, self);
+    young_ref_visitor = NULL;
+}
 
-    /* Held by the reference handler thread */
-    lockVMWaitLock(reference_lock, self);
+/* Updates a reference within a moved object.  In an object which
+   stays where it is the old value is logged */
+static void forwardField(Object **ref, int in_place) {
+    Object *ob = forwardObject(*ref);
 
-    /* Stop the world */
-    disableSuspend(self);
-    suspendAllThreads(self);
+    if(ob != *ref) {
+        if(in_place)
+            NVML_DIRECT("COMPACT_FIELD", ref, sizeof(Object*))
+        *ref = ob;
+    }
+}
 
-    if(verbosegc) {
-        struct timeval start;
-        float mark_time;
-        float scan_time;
+/* The in-object part of threadChildren.  ob is the object at its new
+   address, and block its old.  Objects are moved in address order, so
+   a class below the object has been moved already, and one above it
+   has not */
+static int forwardChildren(Object *ob, char *block, int in_place) {
+    Class *class = ob->class;
+    ClassBlock *cb;
+    int cleared = FALSE;
+    int i;
 
-        getTime(&start);
-		BEGIN_TX("GC-VERBOSE");
-        doMark(self, mark_soft_refs);
-        mark_time = endTime(&start)/1000000.0;
+    if(class == NULL)
+        return FALSE;
 
-        getTime(&start);
-        largest = compact ? doCompact() : doSweep(self);
-		END_TX("GC-VERBOSE");
-        scan_time = endTime(&start)/1000000.0;
+    cb = CLASS_CB((char*)class < block ? forwardObject(class) : class);
+
+    if(cb->name[0] == '[') {
+        if((cb->name[1] == 'L') || (cb->name[1] == '[')) {
+            Object **body = ARRAY_DATA(ob, Object*);
+            int len = ARRAY_LEN(ob);
+
+            for(i = 0; i < len; i++, body++)
+                forwardField(body, in_place);
+        }
+    } else {
+        if(IS_CLASS_CLASS(cb)) {
+            ClassBlock *class_cb = CLASS_CB(ob);
+
+            forwardField(&class_cb->class_loader, in_place);
+            forwardField(&class_cb->super, in_place);
+
+            if(IS_ARRAY(class_cb))
+                forwardField(&class_cb->element_class, in_place);
+        } else
+            if(IS_REFERENCE(cb)) {
+                Object **referent = &INST_DATA(ob, Object*, ref_referent_offset);
+
+                if(*referent != NULL) {
+                    int ref_mark = recovering_gc && !IN_HEAP(*referent) ? 0
+                                                                       : IS_MARKED(*referent);
+
+                    if(IS_PHANTOM_REFERENCE(cb)) {
+                        if(ref_mark != PHANTOM_MARK)
+                            goto out;
+                    } else {
+                        if(ref_mark == HARD_MARK)
+                            goto out;
+
+                        if(in_place)
+                            NVML_DIRECT("COMPACT_REFERENT", referent, sizeof(Object*))
+                        *referent = NULL;
+                        cleared = TRUE;
+                    }
+
+                    if(!recovering_gc && INST_DATA(ob, Object*, ref_queue_offset) != NULL) {
+                        ADD_TO_OBJECT_LIST(reference, ob);
+                        notify_reference_thread = TRUE;
+                    }
+out:
+                    if(!cleared)
+                        forwardField(referent, in_place);
+                }
+            }
+
+        for(i = 0; i < cb->refs_offsets_size; i++) {
+            int offset = cb->refs_offsets_table[i].start;
+            int end = cb->refs_offsets_table[i].end;
+
+            for(; offset < end; offset += sizeof(Object*))
+                forwardField(&INST_DATA(ob, Object*, offset), in_place);
+        }
+    }
+
+    forwardField(&ob->class, in_place);
+
+    return cleared;
+}
+
+/* Objects are moved in address order, in batches.  A batch commits
+   along with the cursor before an object is copied over one of the
+   batch's sources, so an interrupted pass can be resumed from the
+   cursor with every source it reads intact.  Copies into space no
+   longer needed are neither logged nor rolled back, they are simply
+   redone.  Only a destination overlapping the object's own source,
+   and references updated in an object which stays put, are logged.
+   Should the caller be within a transaction the batches can't
+   commit, and destinations overlapping the batch are logged too */
+
+#define COMPACT_BATCH_SIZE (1024*1024)
+
+static long long moveObjects(char *ptr, long long *cleared) {
+    int can_commit = getTxState()->depth == 0;
+    char *batch_start = NULL, *batch_end = NULL;
+    uintptr_t batch_size = 0;
+    long long moved = 0;
+
+    BEGIN_TX("COMPACT-MOVE")
+
+    for(ptr = nextMarkedBlock(ptr); ptr < heaplimit;
+            ptr = nextMarkedBlock(batch_end)) {
+        uintptr_t hdr = HEADER(ptr);
+        uintptr_t size = HDR_SIZE(hdr);
+        char *new_addr = forwardBlock(ptr);
+        int grow = new_addr != ptr && HDR_HASHCODE_TAKEN(hdr);
+        char *new_end = new_addr + size + (grow ? OBJECT_GRAIN : 0);
+        int overlap = batch_start != NULL && new_end > batch_start &&
+                                             new_addr < batch_end;
+
+        if(can_commit && (overlap || batch_size >= COMPACT_BATCH_SIZE)) {
+            NVML_DIRECT("COMPACT_CURSOR", &pheap->compact_cursor, sizeof(unsigned long))
+            pheap->compact_cursor = ptr - heapbase;
+            END_TX("COMPACT-MOVE")
+            BEGIN_TX("COMPACT-MOVE")
+
+            batch_start = NULL;
+            batch_size = 0;
+            overlap = FALSE;
+        }
+
+        if(new_addr == ptr) {
+            if(forwardChildren((Object*)(ptr+HEADER_SIZE), ptr, TRUE))
+                (*cleared)++;
+        } else {
+            TRACE_COMPACT("Moving object from %p to %p.\n",
+                          ptr+HEADER_SIZE, new_addr+HEADER_SIZE);
+
+            if(overlap || new_end > ptr)
+                NVML_DIRECT("COMPACT_MOVE", new_addr, new_end - new_addr)
+
+            memmove(new_addr, ptr, size);
+
+            if(forwardChildren((Object*)(new_addr+HEADER_SIZE), ptr, FALSE))
+                (*cleared)++;
+
+            /* Keep the hashCode as in compactSlideBlock */
+            if(grow) {
+                *(uintptr_t*)(new_addr + size) = ADDRESS_HASHCODE(ptr + HEADER_SIZE);
+                HEADER(new_addr) &= ~HASHCODE_TAKEN_BIT;
+                HEADER(new_addr) |= HAS_HASHCODE_BIT;
+                HEADER(new_addr) += OBJECT_GRAIN;
+            }
+
+            pmemobj_flush(pop_heap, new_addr, new_end - new_addr);
+            moved++;
+        }
+
+        if(batch_start == NULL)
+            batch_start = ptr;
+
+        batch_end = ptr + size;
+        batch_size += size;
+    }
+
+    NVML_DIRECT("COMPACT_CURSOR", &pheap->compact_cursor, sizeof(unsigned long))
+    pheap->compact_cursor = heaplimit - heapbase;
+    END_TX("COMPACT-MOVE")
+
+    return moved;
+}
+
+#define COMPACT_FREE_CHUNK(start, end)                              \
+{                                                                   \
+    Chunk *curr = (Chunk*)(start);                                  \
+    curr->header = (end) - (start);                                 \
+    pmemobj_flush(pop_heap, &curr->header, sizeof(uintptr_t));      \
+                                                                    \
+    if(curr->header >= MIN_OBJECT_SIZE) {                           \
+        last->next = curr;                                          \
+        if(last != &newlist)                                        \
+            pmemobj_flush(pop_heap, &last->next, sizeof(Chunk*));   \
+        last = curr;                                                \
+    }                                                               \
+                                                                    \
+    if(curr->header > largest)                                      \
+        largest = curr->header;                                     \
+                                                                    \
+    heapfree += curr->header;                                       \
+}
+
+/* Links the gaps left between the moved objects into the free list.
+   Only writes free space, so it may be redone.  The mark bits give
+   the old addresses of the objects in order, the table their new */
+static uintptr_t rebuildFreeList() {
+    char *ptr, *end = heapbase;
+    Chunk newlist;
+    Chunk *last = &newlist;
+    uintptr_t largest = 0;
+
+    heapfree = 0;
+
+    for(ptr = nextMarkedBlock(heapbase); ptr < heaplimit;
+            ptr = nextMarkedBlock(ptr + OBJECT_GRAIN)) {
+        char *new_addr = forwardBlock(ptr);
+
+        if(new_addr != end)
+            COMPACT_FREE_CHUNK(end, new_addr);
+
+        end = new_addr + HDR_SIZE(HEADER(new_addr));
+    }
+
+    if(end != heaplimit)
+        COMPACT_FREE_CHUNK(end, heaplimit);
+
+    last->next = NULL;
+    if(last != &newlist)
+        pmemobj_flush(pop_heap, &last->next, sizeof(Chunk*));
+    pmemobj_drain(pop_heap);
+
+    freelist = newlist.next;
+    chunkpp = &freelist;
+
+    return largest;
+}
+
+/* The live blocks at the given fractions of the heap are recorded for
+   the next open to split the heap on (see hintedHeapSlices).  They
+   are found from the mark bits, and stay block boundaries until the
+   next collection.  The hints are stored and persisted directly:
+   should a logged collection be rolled back, the blocks live after
+   it were at the same addresses before it */
+static void recordBlockHints(int compacted) {
+    uintptr_t len = (heaplimit - heapbase) / (BLOCK_HINTS + 1);
+    unsigned long last = 0;
+    int i, n = 0;
+
+    for(i = 1; i <= BLOCK_HINTS; i++) {
+        char *block = nextMarkedBlock(heapbase +
+                                      ((i * len) & ~(OBJECT_GRAIN-1)));
+
+        if(block >= heaplimit)
+            break;
+
+        if(compacted)
+            block = forwardBlock(block);
+
+        if(block - heapbase > last)
+            pheap->block_hints[n++] = last = block - heapbase;
+    }
+
+    pheap->block_hint_count = n;
+    pmemobj_persist(pop_heap, pheap->block_hints, sizeof(pheap->block_hints));
+    pmemobj_persist(pop_heap, &pheap->block_hint_count, sizeof(int));
+    GC_LOG(pheap->block_hints, sizeof(pheap->block_hints));
+    GC_LOG(&pheap->block_hint_count, sizeof(int));
+}
+
+/* A compaction without the forwarding table leaves no way to
+   map the mark bits to the new addresses */
+static void dropBlockHints() {
+    pheap->block_hint_count = 0;
+    pmemobj_persist(pop_heap, &pheap->block_hint_count, sizeof(int));
+}
+
+static uintptr_t doCompactRestartable() {
+    long long marked = 0, unmarked = 0, freed = 0, cleared = 0, moved;
+    uintptr_t largest;
+
+    initForwarding();
+
+    /* The roots are updated, and the compaction recorded, atomically.
+       From then on the heap is only consistent once the objects
+       have all been moved */
+    BEGIN_TX("COMPACT-ROOTS")
+    buildForwardingTable(&marked, &unmarked, &freed);
+    forwardRoots();
+
+    NVML_DIRECT("COMPACT_PHASE", &pheap->gc_phase, sizeof(int))
+    NVML_DIRECT("COMPACT_CURSOR", &pheap->compact_cursor, sizeof(unsigned long))
+    pheap->gc_phase = GC_COMPACTING;
+    pheap->compact_cursor = 0;
+    END_TX("COMPACT-ROOTS")
+
+    moved = moveObjects(heapbase, &cleared);
+    largest = rebuildFreeList();
+
+    recordBlockHints(TRUE);
+    publishFreeList();
+    setGCPhase(GC_IDLE);
+
+    if(verbosegc) {
+        long long size = heaplimit-heapbase;
+        long long pcnt_used = ((long long)heapfree)*100/size;
+        jam_printf("<GC: Allocated objects: %lld>\n", (long long)marked);
+        jam_printf("<GC: Freed %lld object(s) using %lld bytes",
+			(long long)unmarked, (long long)freed);
+        if(cleared)
+            jam_printf(", cleared %lld reference(s)", (long long)cleared);
+        jam_printf(">\n<GC: Moved %lld objects, largest block is %lld total"
+                   " free is %lld out of %lld (%lld%%)>\n", (long long)moved,
+                   (long long)largest, (long long)heapfree, size, pcnt_used);
+    }
+
+    return largest;
+}
+// End of modification
+
+void expandHeap(int min) {
+    Chunk *chunk, *new;
+    uintptr_t delta;
+    // JaPHa Modification
+    char *bridge = NULL, *end = heapmax;
+    int i;
+    // End of modification
+
+    if(verbosegc)
+        jam_printf("<GC: Expanding heap - minimum needed is %d>\n", min);
+
+    delta = (heaplimit-heapbase)/2;
+    delta = delta < min ? min : delta;
+
+    // JaPHa Modification
+    /* The heap is expanded up to the end of its extent.  Once there,
+       it's expanded past the bridge into the next (see growHeap) */
+    new = (Chunk*)heaplimit;
+
+    for(i = 0; i < extent_count; i++)
+        if(bridges[i] >= heaplimit) {
+            end = bridges[i];
+
+            if(bridges[i] == heaplimit) {
+                bridge = heaplimit;
+                new = (Chunk*)extent_bases[i];
+                end = i + 1 < extent_count ? bridges[i + 1] : heapmax;
+            }
+            break;
+        }
+
+    if(((char*)new + delta) > end)
+        delta = end - (char*)new;
+    // End of modification
+
+    /* Ensure new region is multiple of object grain in size */
+
+    delta = (delta&~(OBJECT_GRAIN-1));
+
+    if(verbosegc)
+        jam_printf("<GC: Expanding heap by %lld bytes>\n", (long long)delta);
+
+    // JaPHa Modification
+    /* The persistent allocator works on the pool's freelist directly
+       (see ph_malloc).  The new area, the link to it and the heap
+       bounds are updated in a transaction of their own, as is the
+       bridge should the new area be in the next extent */
+    if(persistent) {
+        BEGIN_TX("EXPAND_HEAP")
+        if(bridge != NULL) {
+            Object *ob = (Object*)(bridge + HEADER_SIZE);
+
+            NVML_DIRECT("EXPAND_HEAP_BRIDGE", bridge, HEADER_SIZE + sizeof(Object))
+            HEADER(bridge) = ((char*)new - bridge) | ALLOC_BIT;
+            ob->class = NULL;
+            ob->lock = 0;
+        }
+        NVML_DIRECT("EXPAND_HEAP_CHUNK", new, sizeof(Chunk))
+        NVML_DIRECT("EXPAND_HEAP_LIMIT", &pheap->heaplimit, sizeof(char*))
+        freelist = pheap->freelist;
+        heapfree = pheap->heapfree;
+    }
+    // End of modification
+
+    new->header = delta;
+    new->next = NULL;
+
+    if(freelist != NULL) {
+        /* The freelist is in address order - find the last
+           free chunk and add the new area to the end.  */
+
+        for(chunk = freelist; chunk->next != NULL; chunk = chunk->next);
+            // JaPHa Modification
+            if(persistent) {
+                NVML_DIRECT("EXPAND_HEAP_LINK", &chunk->next, sizeof(Chunk*))
+            }
+            // End of modification
+            chunk->next = new;
+    } else
+        freelist = new;
+
+    heaplimit = (char*)new + delta;
+    heapfree += delta;
+
+    // JaPHa Modification
+    if(persistent) {
+        pheap->heaplimit = heaplimit;
+        syncFreeList();
+        END_TX("EXPAND_HEAP")
+    }
+    // End of modification
+
+    /* The heap has increased in size - need to reallocate
+       the mark bits to cover new area */
+
+    if(!persistent)
+        sysFree(markbits);
+
+    allocMarkBits();
+}
+
+// JaPHa Modification
+/* Reopened with a larger -Xmx, the heap grows by an extent of the
+   difference allocated in the pool's spare room (see POOL_SIZE).  The
+   allocation links the extent into the pheap.  It's then adopted: the
+   mark bits and forwarding table are reallocated to cover it, and the
+   heap's capacity raised in a transaction.  An extent linked but not
+   adopted by an interrupted open is adopted by the next */
+
+static int adoptExtent(int n) {
+    PMEMoid *extent = &pheap->heap_extents[n];
+    char *base = extentBase(*extent);
+    char *end = (char*)pmemobj_direct(*extent) + pmemobj_alloc_usable_size(*extent);
+    char *limit = base + ((end - base - BRIDGE_SIZE) & ~(OBJECT_GRAIN-1));
+    uintptr_t span = (limit - heapbase + FWD_REGION_SIZE - 1) & ~(FWD_REGION_SIZE - 1);
+
+    /* The heap is walked upwards, so each extent must lie above it */
+    if(base < heapmax || limit - base < MIN_OBJECT_SIZE) {
+        pmemobj_free(extent);
+        return FALSE;
+    }
+
+    if(pmemobj_realloc(pop_heap, &pheap->markbits, MARKBITS_SIZE(span), 0) != 0 ||
+       (!OID_IS_NULL(pheap->forwarding) &&
+        pmemobj_realloc(pop_heap, &pheap->forwarding, FORWARDING_SIZE(span), 0) != 0))
+        return FALSE;
+
+    BEGIN_TX("GROW_HEAP")
+    NVML_DIRECT("GROW_HEAP_BRIDGE", &pheap->heap_bridges[n], sizeof(unsigned long))
+    NVML_DIRECT("GROW_HEAP_CAPACITY", &pheap->maxHeap, sizeof(unsigned long))
+    NVML_DIRECT("GROW_HEAP_MAX", &pheap->heapmax, sizeof(char*))
+    NVML_DIRECT("GROW_HEAP_EXTENTS", &pheap->heap_extent_count, sizeof(int))
+    pheap->heap_bridges[n] = heapmax - heapbase;
+    pheap->maxHeap += limit - base;
+    pheap->heapmax = limit;
+    pheap->heap_extent_count = n + 1;
+    END_TX("GROW_HEAP")
+
+    heapmax = limit;
+    maxHeap = pheap->maxHeap;
+    initialiseExtents();
+
+    return TRUE;
+}
+
+static void growHeap(unsigned long max_heap) {
+    int n = pheap->heap_extent_count;
+    unsigned long size;
+
+    if(max_heap > pheap->maxHeap && n == HEAP_MAX_EXTENTS) {
+        jam_printf("<GC: Persistent heap %s has grown by %d extents already, ignoring -Xmx>\n",
+                   pool_path, HEAP_MAX_EXTENTS);
+        return;
+    }
+
+    if(max_heap > pheap->maxHeap && OID_IS_NULL(pheap->heap_extents[n])) {
+        size = (max_heap - pheap->maxHeap + OBJECT_GRAIN-1) & ~(OBJECT_GRAIN-1);
+
+        if(pmemobj_alloc(pop_heap, &pheap->heap_extents[n],
+                         size + OBJECT_GRAIN + BRIDGE_SIZE, 0, NULL, NULL) != 0) {
+            jam_printf("<GC: Couldn't grow persistent heap %s by %ldM: %s>\n",
+                       pool_path, (long)(size / MB), pmemobj_errormsg());
+            return;
+        }
+    }
+
+    if(n == HEAP_MAX_EXTENTS || OID_IS_NULL(pheap->heap_extents[n]))
+        return;
+
+    if(!adoptExtent(n))
+        jam_printf("<GC: Couldn't grow persistent heap %s: %s>\n", pool_path,
+                   OID_IS_NULL(pheap->heap_extents[n]) ? "no room above the heap"
+                                                       : pmemobj_errormsg());
+    else if(verbosegc)
+        jam_printf("<GC: Grew persistent heap %s to a capacity of %ldM>\n",
+                   pool_path, (long)(maxHeap / MB));
+}
+// End of modification
+
+
+// JaPHa Modification
+/* ------------------------- PERSISTENCE BY REACHABILITY ------------------------- */
+
+/* Objects allocated by the interpreter start out transient: they are
+   not reachable from the persistent roots (static fields and objects
+   created by the VM itself), so stores into them are neither logged
+   nor flushed.  When a reference to a transient object is stored into
+   a durable object or a static field it is published -- it and every
+   transient object reachable from it are flushed and become durable.
+
+   Published objects can't be moved into a separate durable space, as
+   the conservative stack scan means not every reference to them can
+   be updated.  Instead one bit per OBJECT_GRAIN of heap records whether
+   the object at that address is transient.  The bits are volatile, on
+   restart every object is durable. */
+
+int persist_by_reachability = FALSE;
+
+static uintptr_t *transientbits;
+static int transientbit_size;
+
+#define TRANSIENTBITS        (sizeof(uintptr_t) * 8)
+#define TRANSIENTINDEX(ptr)  ((((char*)ptr) - heapbase) >> LOG_OBJECT_GRAIN)
+#define TRANSIENTENTRY(ptr)  (TRANSIENTINDEX(ptr) / TRANSIENTBITS)
+#define TRANSIENTMASK(ptr)   ((uintptr_t)1 << (TRANSIENTINDEX(ptr) % TRANSIENTBITS))
+
+/* The bits are updated outside of the heap lock, so they can't be
+   reallocated when the heap expands.  Instead they cover the heap's
+   maximum size, and are only touched as the heap grows into it */
+static void allocTransientBits() {
+    transientbit_size = (((heapmax - heapbase) >> LOG_OBJECT_GRAIN) +
+                         TRANSIENTBITS - 1) / TRANSIENTBITS;
+    transientbits = mmap(0, transientbit_size * sizeof(uintptr_t),
+                         PROT_READ|PROT_WRITE,
+                         MAP_PRIVATE|MAP_ANON|MAP_NORESERVE, -1, 0);
+
+    if(transientbits == MAP_FAILED) {
+        perror("Couldn't allocate the transient bits");
+        exitVM(1);
+    }
+}
+
+/* Bits belonging to different objects share a word, and are
+   updated by threads outside of the heap lock */
+static void setTransientBit(Object *ob, int transient) {
+    uintptr_t *entry = &transientbits[TRANSIENTENTRY(ob)];
+    uintptr_t mask = TRANSIENTMASK(ob);
+    uintptr_t old;
+
+    do {
+        old = *entry;
+    } while(!COMPARE_AND_SWAP(entry, old, transient ? old | mask
+                                                    : old & ~mask));
+}
+
+/* Young objects are always transient.  They are not published
+   but become durable when they are promoted */
+
+int isTransient(Object *ob) {
+    return IN_NURSERY(ob) || (persist_by_reachability &&
+           (transientbits[TRANSIENTENTRY(ob)] & TRANSIENTMASK(ob)));
+}
+
+void makeTransient(Object *ob) {
+    if(persist_by_reachability && !IN_NURSERY(ob))
+        setTransientBit(ob, TRUE);
+}
+
+#define PUBLISH_PUSH(ref) {                                         \
+    Object *_ref = ref;                                             \
+    if(_ref != NULL && !IN_NURSERY(_ref) && isTransient(_ref)) {    \
+        setTransientBit(_ref, FALSE);                               \
+        if(count == size)                                           \
+            stack = sysRealloc(stack, (size += LIST_INCREMENT) *    \
+                                      sizeof(Object*));             \
+        stack[count++] = _ref;                                      \
+    }                                                               \
+}
+
+/* Make ob and the transient objects reachable from it durable.  Their
+   contents were stored without logging, so they are flushed (and the
+   flushes drained) before the caller makes them reachable */
+
+static void publishReachable(Object *ob) {
+    Object **stack = NULL;
+    int count = 0, size = 0;
+
+    PUBLISH_PUSH(ob);
+
+    while(count > 0) {
+        Object *ob = stack[--count];
+        uintptr_t *hdr_addr = HDR_ADDRESS(ob);
+        ClassBlock *cb;
+        int i;
+
+        pmemobj_flush(pop_heap, hdr_addr, HDR_SIZE(*hdr_addr));
+
+        if(ob->class == NULL)
+            continue;
+
+        cb = CLASS_CB(ob->class);
+
+        if(cb->name[0] == '[') {
+            if((cb->name[1] == 'L') || (cb->name[1] == '[')) {
+                Object **body = ARRAY_DATA(ob, Object*);
+                int len = ARRAY_LEN(ob);
+
+                for(i = 0; i < len; i++)
+                    PUBLISH_PUSH(body[i]);
+            }
+        } else {
+            if(IS_REFERENCE(cb))
+                PUBLISH_PUSH(INST_DATA(ob, Object*, ref_referent_offset));
+
+            for(i = 0; i < cb->refs_offsets_size; i++) {
+                int offset = cb->refs_offsets_table[i].start;
+                int end = cb->refs_offsets_table[i].end;
+
+                for(; offset < end; offset += sizeof(Object*))
+                    PUBLISH_PUSH(INST_DATA(ob, Object*, offset));
+            }
+        }
+    }
+
+    sysFree(stack);
+}
+
+void publishObject(Object *ob) {
+    Thread *self = threadSelf();
+
+    /* The GC must not move objects held on the (unscanned)
+       publish stack */
+    disableSuspend(self);
+
+    publishReachable(ob);
+    pmemobj_drain(pop_heap);
+    enableSuspend(self);
+}
+
+/* Store barrier for references stored outside of the interpreter
+   (natives, reflection and JNI).  A NULL holder is a static field */
+
+void publishReference(Object *holder, Object *value) {
+    if(value != NULL && isTransient(value) &&
+                        (holder == NULL || !isTransient(holder)))
+        publishObject(value);
+}
+
+/* Compaction slides objects, leaving the transient bits describing
+   the old layout.  Before compacting every transient object is made
+   durable (the heap is walked as bits may be stale for free chunks).
+   A checkpoint does the same, as the stacks it saves may hold the
+   only references to transient objects */
+
+void publishAllTransient() {
+    char *ptr;
+
+    if(!persist_by_reachability)
+        return;
+
+    for(ptr = heapbase; ptr < heaplimit; ) {
+        uintptr_t hdr = HEADER(ptr);
+        uintptr_t size = HDR_SIZE(hdr);
+        Object *ob = (Object*)(ptr+HEADER_SIZE);
+
+        if(HDR_ALLOCED(hdr) && isTransient(ob))
+            pmemobj_flush(pop_heap, ptr, size);
+
+        ptr += size;
+    }
+
+    pmemobj_drain(pop_heap);
+    memset(transientbits, 0, transientbit_size * sizeof(uintptr_t));
+}
+
+/* ------------------------- YOUNG GENERATION ------------------------- */
+
+/* With -Xnursery objects allocated by the interpreter are bump-allocated
+   in anonymous (DRAM) memory.  They are transient and stores into them
+   bypass libpmemobj altogether.  A reference to a young object may be
+   stored into a durable object, but the young object is not published:
+   promotion is the only point at which objects become durable.
+
+   When it fills up the young generation is collected on its own.  A
+   store barrier records the heap objects holding references to young
+   objects in a remembered set, which is scanned along with the roots
+   instead of the heap.  A full collection collects it with the heap.
+   After marking, every marked young object which is not a conservative
+   root is copied into the heap (within the GC transaction) and a
+   forwarding pointer is left in its lock word.  The transient heap
+   objects it refers to are published.  References to it from the heap
+   (or the remembered set), from surviving young objects and from the
+   VM's tables are then updated.  Conservatively referenced objects
+   can't be moved and stay in the young generation until a later
+   collection.
+
+   The bounds of the young generation are recorded in the pool.  After
+   a crash durable references to objects which were never promoted are
+   dangling, so on restart they are cleared (the stores are lost, as
+   they would be had they been in an uncommitted epoch) */
+
+int nursery_enabled = FALSE;
+
+/* Free chunks of the young generation (in between pinned
+   survivors), and the chunk currently being bump-allocated */
+static Chunk *nursery_freelist;
+static char *nursery_top;
+static char *nursery_end;
+
+/* Larger objects are allocated directly in the heap */
+static int nursery_max_object;
+
+/* Only special objects use the special bit, and they are
+   never young.  In the young generation it marks an object
+   which has been promoted */
+#define FORWARDED_BIT           SPECIAL_BIT
+#define HDR_FORWARDED(hdr)      (hdr & FORWARDED_BIT)
+#define FORWARDEE(ob)           ((Object*)(ob)->lock)
+
+/* Bounds of the young generation of the last run */
+static char *stale_young_base;
+static char *stale_young_limit;
+
+/* The remembered set holds the heap objects which may refer to young
+   objects.  A bit per OBJECT_GRAIN of heap (indexed as the transient
+   bits) records whether an object is in it.  Both are only changed
+   under the remembered lock, or with the world stopped */
+static Object **remembered_list;
+static int remembered_count;
+static int remembered_size;
+static uintptr_t *rememberedbits;
+static VMLock remembered_lock;
+
+#define IS_REMEMBERED(ob) \
+    (rememberedbits[TRANSIENTENTRY(ob)] & TRANSIENTMASK(ob))
+
+/* The young objects left pinned by the last collection */
+static long long young_survivors;
+
+void initialiseNursery(unsigned long size) {
+    Chunk *chunk;
+    uint no_of_bits;
+
+    if(size > 0 && !persist_by_reachability) {
+        jam_fprintf(stderr, "-Xnursery ignored: young objects are transient "
+                            "and need persistence by reachability\n");
+        size = 0;
+    }
+
+    size &= ~(OBJECT_GRAIN-1);
+
+    if(size > 0) {
+        nursery_base = mmap(0, size, PROT_READ|PROT_WRITE,
+                            MAP_PRIVATE|MAP_ANON|MAP_NORESERVE, -1, 0);
+
+        if(nursery_base == MAP_FAILED) {
+            perror("Couldn't allocate the young generation");
+            nursery_base = NULL;
+            size = 0;
+        }
+    }
+
+    /* Record the new bounds.  The references into the old ones
+       have already been cleared (see scrubYoungReferences) */
+    BEGIN_TX("NURSERY")
+    NVML_DIRECT("NURSERY", &pheap->nursery_base, 2 * sizeof(char*))
+    pheap->nursery_base = nursery_base;
+    pheap->nursery_limit = nursery_base + size;
+    END_TX("NURSERY")
+
+    if(size == 0)
+        return;
+
+    nursery_limit = nursery_base + size;
+    nursery_max_object = size / 8;
+
+    no_of_bits = size >> (LOG_BYTESPERMARK-LOG_BITSPERMARK);
+    nursery_markbit_size = (no_of_bits+MARKSIZEBITS-1)>>LOG_MARKSIZEBITS;
+    nursery_markbits = sysMalloc(nursery_markbit_size *
+                                 sizeof(*nursery_markbits));
+
+    /* Like the transient bits, the remembered bits
+       cover the heap's maximum size */
+    rememberedbits = mmap(0, transientbit_size * sizeof(uintptr_t),
+                          PROT_READ|PROT_WRITE,
+                          MAP_PRIVATE|MAP_ANON|MAP_NORESERVE, -1, 0);
+
+    if(rememberedbits == MAP_FAILED) {
+        perror("Couldn't allocate the remembered bits");
+        exitVM(1);
+    }
+
+    initVMLock(remembered_lock);
+
+    /* The young generation is parsable by headers like the heap */
+    chunk = (Chunk*)nursery_base;
+    chunk->header = size;
+    chunk->next = NULL;
+    nursery_freelist = chunk;
+
+    nursery_enabled = TRUE;
+}
+
+/* Give the unused part of the current chunk a header so the
+   collector can walk the young generation */
+static void retireNurseryChunk() {
+    if(nursery_end > nursery_top)
+        HEADER(nursery_top) = nursery_end - nursery_top;
+
+    nursery_top = nursery_end = NULL;
+}
+
+static int nextNurseryChunk() {
+    Chunk *chunk = nursery_freelist;
+
+    retireNurseryChunk();
+
+    if(chunk == NULL)
+        return FALSE;
+
+    nursery_freelist = chunk->next;
+    nursery_top = (char*)chunk;
+    nursery_end = nursery_top + chunk->header;
+
+    return TRUE;
+}
+
+/* First-fit allocation of a heap chunk for a promoted object.
+   Called within the GC transaction, only the free-list metadata
+   is logged (as in ph_malloc) */
+static Chunk **tenure_chunkpp;
+
+static Chunk *tenureChunk(uintptr_t n) {
+    int pass;
+
+    for(pass = 0; pass < 2; pass++) {
+        for(; *tenure_chunkpp; tenure_chunkpp = &(*tenure_chunkpp)->next) {
+            Chunk *found = *tenure_chunkpp;
+            uintptr_t len = found->header;
+
+            if(len < n)
+                continue;
+
+            NVML_DIRECT("TENURE_LINK", tenure_chunkpp, sizeof(Chunk*))
+            NVML_DIRECT("TENURE_FOUND", found, sizeof(Chunk))
+
+            if(len == n)
+                *tenure_chunkpp = found->next;
+            else {
+                Chunk *rem = (Chunk*)((char*)found + n);
+
+                NVML_DIRECT("TENURE_REMAINDER", &rem->header, HEADER_SIZE)
+                rem->header = len - n;
+
+                if(rem->header >= MIN_OBJECT_SIZE) {
+                    NVML_DIRECT("TENURE_REMAINDER_NEXT", &rem->next,
+                                sizeof(Chunk*))
+                    rem->next = found->next;
+                    *tenure_chunkpp = rem;
+                } else
+                    *tenure_chunkpp = found->next;
+            }
+
+            NVML_DIRECT("TENURE_HEAPFREE", &pheap->heapfree,
+                        sizeof(pheap->heapfree))
+            pheap->heapfree -= n;
+
+            return found;
+        }
+
+        tenure_chunkpp = &pheap->freelist;
+    }
+
+    return NULL;
+}
+
+/* Copy a young object into the heap.  The copy is not logged as
+   it's unreachable should the GC transaction roll back, but it is
+   flushed before the transaction commits.  It becomes durable, so
+   the transient heap objects it refers to are published with it */
+static int promoteObject(Object *ob) {
+    uintptr_t *hdr_addr = HDR_ADDRESS(ob);
+    uintptr_t hdr = *hdr_addr;
+    uintptr_t size = HDR_SIZE(hdr);
+    uintptr_t n = HDR_HASHCODE_TAKEN(hdr) ? size + OBJECT_GRAIN : size;
+    Chunk *found = tenureChunk(n);
+    Object *copy;
+
+    if(found == NULL)
+        return FALSE;
+
+    memcpy(found, hdr_addr, size);
+    copy = (Object*)((char*)found + HEADER_SIZE);
+
+    /* As in compactSlideBlock, the hashCode is the
+       original address */
+    if(HDR_HASHCODE_TAKEN(hdr)) {
+        *(uintptr_t*)((char*)found + size) = ADDRESS_HASHCODE(ob);
+        found->header = ((hdr & ~HASHCODE_TAKEN_BIT) | HAS_HASHCODE_BIT)
+                        + OBJECT_GRAIN;
+    }
+
+    SET_MARK(copy, IS_MARKED(ob));
+    setTransientBit(copy, TRUE);
+    publishReachable(copy);
+
+    ob->lock = (uintptr_t)copy;
+    *hdr_addr |= FORWARDED_BIT;
+
+    return TRUE;
+}
+
+/* Update a reference to a promoted object.  References held
+   in the pool are logged, so a rollback of the GC transaction
+   leaves them pointing at the (lost) young object */
+static void forwardReference(Object **ref) {
+    Object *ob = *ref;
+
+    if(IN_NURSERY(ob) && HDR_FORWARDED(HEADER(HDR_ADDRESS(ob)))) {
+        if(pmemobj_pool_by_ptr(ref) == pop_heap)
+            NVML_DIRECT("FORWARD", ref, sizeof(Object*))
+
+        *ref = FORWARDEE(ob);
+    }
+}
+
+/* Hand the references held within an object to threadReference
+   (and so to young_ref_visitor) */
+static void visitChildren(Object *ob) {
+    Class *class = ob->class;
+    ClassBlock *cb;
+    int i;
+
+    if(class == NULL)
+        return;
+
+    cb = CLASS_CB(class);
+
+    if(cb->name[0] == '[') {
+        if((cb->name[1] == 'L') || (cb->name[1] == '[')) {
+            Object **body = ARRAY_DATA(ob, Object*);
+            int len = ARRAY_LEN(ob);
+
+            for(i = 0; i < len; i++, body++)
+                if(*body != NULL)
+                    threadReference(body);
+        }
+        return;
+    }
+
+    if(IS_CLASS_CLASS(cb))
+        threadClassData(ob, ob);
+    else
+        /* The referent is outside of the reference offsets.  Its
+           offset isn't known until java.lang.ref.Reference is linked */
+        if(IS_REFERENCE(cb) && ref_referent_offset != -1) {
+            Object **referent = &INST_DATA(ob, Object*, ref_referent_offset);
+
+            if(*referent != NULL)
+                threadReference(referent);
+        }
+
+    for(i = 0; i < cb->refs_offsets_size; i++) {
+        int offset = cb->refs_offsets_table[i].start;
+        int end = cb->refs_offsets_table[i].end;
+
+        for(; offset < end; offset += sizeof(Object*)) {
+            Object **ref = &INST_DATA(ob, Object*, offset);
+
+            if(*ref != NULL)
+                threadReference(ref);
+        }
+    }
+}
+
+static void addRemembered(Object *ob) {
+    if(IS_REMEMBERED(ob))
+        return;
+
+    if(remembered_count == remembered_size) {
+        remembered_size += LIST_INCREMENT;
+        remembered_list = sysRealloc(remembered_list,
+                                     remembered_size * sizeof(Object*));
+    }
+
+    remembered_list[remembered_count++] = ob;
+    rememberedbits[TRANSIENTENTRY(ob)] |= TRANSIENTMASK(ob);
+}
+
+static void forgetRemembered() {
+    int i;
+
+    for(i = 0; i < remembered_count; i++)
+        rememberedbits[TRANSIENTENTRY(remembered_list[i])] &=
+                                      ~TRANSIENTMASK(remembered_list[i]);
+
+    remembered_count = 0;
+}
+
+static void rememberHolder(Object *holder) {
+    Thread *self = threadSelf();
+
+    disableSuspend(self);
+    lockVMLock(remembered_lock, self);
+    addRemembered(holder);
+    unlockVMLock(remembered_lock, self);
+    enableSuspend(self);
+}
+
+/* Store barrier for references to young objects.  The stores made
+   by the interpreter, natives and JNI into a heap object (or into
+   a static field, the holder being the class) call it after the
+   store, or before it without an intervening safepoint */
+
+void rememberYoungRef(Object *holder, Object *value) {
+    if(holder != NULL && IN_NURSERY(value) && !IN_NURSERY(holder) &&
+                         !IS_REMEMBERED(holder))
+        rememberHolder(holder);
+}
+
+/* The remembered objects are roots of a collection of the young
+   generation, as are the objects referring to them */
+static void scanRemembered(int mark_soft_refs) {
+    int i;
+
+    for(i = 0; i < remembered_count; i++) {
+        markChildren(remembered_list[i], HARD_MARK, mark_soft_refs);
+        markStack(mark_soft_refs);
+    }
+}
+
+/* Visitors rebuilding the remembered set.  The promoted objects are
+   forwarded as they're visited */
+static int young_ref_found;
+
+static void noteYoungRef(Object **ref) {
+    if(IN_NURSERY(*ref))
+        young_ref_found = TRUE;
+}
+
+static void forwardYoungRef(Object **ref) {
+    forwardReference(ref);
+    noteYoungRef(ref);
+}
+
+static void rememberIfYoungRefs(Object *ob) {
+    young_ref_found = FALSE;
+    visitChildren(ob);
+
+    if(young_ref_found)
+        addRemembered(ob);
+}
+
+/* After a collection of the young generation the references to the
+   promoted objects are forwarded in the remembered objects and in the
+   copies.  Those still referring to young (pinned) objects make up the
+   new remembered set.  Called before the young generation is rebuilt,
+   while the forwarding pointers are intact */
+static void rememberPromoted() {
+    Object **holders = remembered_list;
+    int count = remembered_count, i;
+    char *ptr;
+
+    forgetRemembered();
+    remembered_list = NULL;
+    remembered_size = 0;
+
+    young_ref_visitor = forwardYoungRef;
+
+    for(i = 0; i < count; i++)
+        rememberIfYoungRefs(holders[i]);
+
+    for(ptr = nursery_base; ptr < nursery_limit;) {
+        uintptr_t hdr = HEADER(ptr);
+        uintptr_t size = HDR_ALLOCED(hdr) ? HDR_SIZE(hdr) : hdr;
+
+        if(HDR_ALLOCED(hdr) && HDR_FORWARDED(hdr))
+            rememberIfYoungRefs(FORWARDEE((Object*)(ptr+HEADER_SIZE)));
+
+        ptr += size;
+    }
+
+    young_ref_visitor = forwardReference;
+    sysFree(holders);
+}
+
+/* A full collection frees and moves heap objects, so the
+   remembered set is rebuilt from the heap afterwards */
+static void rememberSurvivorRefs() {
+    char *ptr;
+
+    forgetRemembered();
+
+    if(young_survivors == 0)
+        return;
+
+    young_ref_visitor = noteYoungRef;
+
+    for(ptr = heapbase; ptr < heaplimit;) {
+        uintptr_t hdr = HEADER(ptr);
+        uintptr_t size = HDR_ALLOCED(hdr) ? HDR_SIZE(hdr) : hdr;
+
+        if(HDR_ALLOCED(hdr))
+            rememberIfYoungRefs((Object*)(ptr+HEADER_SIZE));
+
+        ptr += size;
+    }
+
+    young_ref_visitor = NULL;
+}
+
+#define IS_YOUNG_SURVIVOR(ptr, hdr) \
+    (HDR_ALLOCED(hdr) && !HDR_FORWARDED(hdr) && \
+     IS_MARKED((Object*)((ptr)+HEADER_SIZE)))
+
+/* Rebuild the young generation's free list.  Everything but
+   the pinned survivors is free */
+static void rebuildNursery() {
+    Chunk newlist, *last = &newlist;
+    Chunk *curr = NULL;
+    char *ptr;
+
+    for(ptr = nursery_base; ptr < nursery_limit;) {
+        uintptr_t hdr = HEADER(ptr);
+        uintptr_t size = HDR_ALLOCED(hdr) ? HDR_SIZE(hdr) : hdr;
+
+        if(IS_YOUNG_SURVIVOR(ptr, hdr)) {
+            if(curr != NULL && curr->header >= MIN_OBJECT_SIZE) {
+                last->next = curr;
+                last = curr;
+            }
+            curr = NULL;
+        } else if(curr == NULL) {
+            curr = (Chunk*)ptr;
+            curr->header = size;
+        } else
+            curr->header += size;
+
+        ptr += size;
+    }
+
+    if(curr != NULL && curr->header >= MIN_OBJECT_SIZE) {
+        last->next = curr;
+        last = curr;
+    }
+
+    last->next = NULL;
+    nursery_freelist = newlist.next;
+}
+
+/* Set by stopTheWorld, while it holds the heap lock */
+static int world_stopped = FALSE;
+
+/* The collection made on shutdown.  The other threads are stopped for
+   good, so the world isn't restarted and the objects their stacks
+   refer to needn't be pinned */
+static int final_collection = FALSE;
+
+/* Called after marking, before the heap is swept or compacted (or
+   on its own when collecting the young generation alone) */
+static void promoteYoung() {
+    long long promoted = 0, pinned = 0;
+    char *ptr;
+
+    addConservativeRoots2Hash();
+    tenure_chunkpp = &pheap->freelist;
+
+    for(ptr = nursery_base; ptr < nursery_limit;) {
+        uintptr_t hdr = HEADER(ptr);
+        uintptr_t size = HDR_ALLOCED(hdr) ? HDR_SIZE(hdr) : hdr;
+        Object *ob = (Object*)(ptr+HEADER_SIZE);
+
+        if(HDR_ALLOCED(hdr) && IS_MARKED(ob)) {
+            if((final_collection || !IS_CONSERVATIVE_ROOT(ob)) &&
+                                    promoteObject(ob))
+                promoted++;
+            else
+                pinned++;
+        }
+
+        ptr += size;
+    }
+
+    gcMemFree(con_roots_hashtable);
+
+    if(promoted) {
+        /* Order the copies before the references to them */
+        pmemobj_drain(pop_heap);
+
+        young_ref_visitor = forwardReference;
+
+        /* Collecting the young generation alone, the references
+           from the heap are in the remembered set */
+        if(minor_collection)
+            rememberPromoted();
+        else
+            for(ptr = heapbase; ptr < heaplimit;) {
+                uintptr_t hdr = HEADER(ptr);
+                uintptr_t size = HDR_ALLOCED(hdr) ? HDR_SIZE(hdr) : hdr;
+                Object *ob = (Object*)(ptr+HEADER_SIZE);
+
+                if(HDR_ALLOCED(hdr) && IS_MARKED(ob))
+                    visitChildren(ob);
+
+                ptr += size;
+            }
+
+        for(ptr = nursery_base; ptr < nursery_limit;) {
+            uintptr_t hdr = HEADER(ptr);
+            uintptr_t size = HDR_ALLOCED(hdr) ? HDR_SIZE(hdr) : hdr;
+
+            if(IS_YOUNG_SURVIVOR(ptr, hdr))
+                visitChildren((Object*)(ptr+HEADER_SIZE));
+
+            ptr += size;
+        }
+
+        threadObjectLists();
+        threadRegisteredReferences();
+        threadMonitorCache();
+        threadInternedStrings();
+
+        young_ref_visitor = NULL;
+    }
+
+    rebuildNursery();
+    young_survivors = pinned;
+
+    if(verbosegc)
+        jam_printf("<GC: Promoted %lld young object(s), %lld pinned>\n",
+                   promoted, pinned);
+}
+
+/* The young survivors' references into the heap are roots
+   of the compaction (the survivors themselves don't move) */
+static void threadYoungSurvivors() {
+    char *ptr;
+
+    for(ptr = nursery_base; ptr < nursery_limit;) {
+        uintptr_t hdr = HEADER(ptr);
+        uintptr_t size = HDR_ALLOCED(hdr) ? HDR_SIZE(hdr) : hdr;
+
+        if(HDR_ALLOCED(hdr)) {
+            Object *ob = (Object*)(ptr+HEADER_SIZE);
+            threadChildren(ob, ob);
+        }
+
+        ptr += size;
+    }
+}
+
+/* Restart fix-ups.  References into the young generation of
+   the last run are cleared, in the heap here and in the VM's
+   persistent tables as they are initialised.  The stores into
+   the heap which are lost are reported */
+
+int isStaleYoungRef(void *ref) {
+    return (char*)ref >= stale_young_base && (char*)ref < stale_young_limit;
+}
+
+/* A checkpoint can't save references to young objects, as
+   the young generation doesn't outlive the VM */
+int isYoungRef(void *ref) {
+    return IN_NURSERY(ref);
+}
+
+static long long scrubbed;
+
+static void scrubReference(Object **ref) {
+    if(isStaleYoungRef(*ref)) {
+        NVML_DIRECT("SCRUB", ref, sizeof(Object*))
+        *ref = NULL;
+        scrubbed++;
+    }
+}
+
+void scrubYoungReferences() {
+    char *ptr;
+
+    if(!persistent || pheap->nursery_base == pheap->nursery_limit)
+        return;
+
+    stale_young_base = pheap->nursery_base;
+    stale_young_limit = pheap->nursery_limit;
+
+    young_ref_visitor = scrubReference;
+
+    for(ptr = heapbase; ptr < heaplimit;) {
+        uintptr_t hdr = HEADER(ptr);
+        uintptr_t size = HDR_ALLOCED(hdr) ? HDR_SIZE(hdr) : hdr;
+
+        if(HDR_ALLOCED(hdr))
+            visitChildren((Object*)(ptr+HEADER_SIZE));
+
+        ptr += size;
+    }
+
+    young_ref_visitor = NULL;
+
+    if(scrubbed != 0)
+        jam_fprintf(stderr, "Cleared %lld reference(s) to young objects "
+                            "lost by the last run\n", scrubbed);
+}
+
+static int nurseryEmpty() {
+    char *ptr;
+
+    retireNurseryChunk();
+
+    for(ptr = nursery_base; ptr < nursery_limit;) {
+        uintptr_t hdr = HEADER(ptr);
+
+        if(HDR_ALLOCED(hdr))
+            return FALSE;
+
+        ptr += hdr;
+    }
+
+    return TRUE;
+}
+
+/* Called on exit, by System.exit or when the last non-daemon
+   thread has finished.  The other threads are stopped for good.
+   If none of them, nor the exiting thread, is within a transaction
+   everything is committed and the heap is marked as shut down
+   cleanly, so the next open skips redoing collections.  The young
+   objects are promoted by a last collection, which leaves the world
+   stopped.  An empty young generation is recorded as such, and as
+   no durable reference can then be into it the restart doesn't
+   scrub the heap either */
+void shutdownPersistentHeap() {
+    static int shut_down = FALSE;
+    Thread *self = threadSelf();
+
+    if(!persistent || shut_down || self == NULL)
+        return;
+
+    shut_down = TRUE;
+
+    epochSafepoint(self);
+
+    if(nursery_enabled) {
+        /* Already held if the world was stopped for a checkpoint */
+        if(!world_stopped) {
+            disableSuspend(self);
+            lockVMLock(heap_lock, self);
+            enableSuspend(self);
+        }
+
+        final_collection = TRUE;
+        gc0_pmem(TRUE, FALSE);
+    } else {
+        disableSuspend(self);
+        suspendAllThreads(self);
+    }
+
+    /* Whatever the outcome, what has been committed is durable */
+    syncLog();
+
+    if(threadsInTransaction() != 0 || getTxState()->depth != 0)
+        return;
+
+    /* Nor may a lock word or monitor be left owned (see resumeHeap) */
+    if(threadsHoldingLocks() != 0 || monitorsInUse())
+        return;
+
+    if(nursery_base == NULL || nurseryEmpty()) {
+        pheap->nursery_limit = pheap->nursery_base;
+        pmemobj_persist(pop_heap, &pheap->nursery_limit, sizeof(char*));
+    }
+
+    persistSnapshotHeap();
+
+    pheap->clean_shutdown = TRUE;
+    pmemobj_persist(pop_heap, &pheap->clean_shutdown, sizeof(int));
+}
+
+/* A checkpoint (see checkpoint.c) stops the other threads as a
+   collection does, so none is left part-way through allocating
+   or collecting.  The caller has suspension disabled */
+
+void stopTheWorld(Thread *self) {
+    lockVMLock(heap_lock, self);
+    suspendAllThreads(self);
+    world_stopped = TRUE;
+}
+
+void restartTheWorld(Thread *self) {
+    world_stopped = FALSE;
+    resumeAllThreads(self);
+    unlockVMLock(heap_lock, self);
+}
+// End of modification
+
+
+/* ------------------------- GARBAGE COLLECT ------------------------- */
+
+static void getTime(struct timeval *tv) {
+    gettimeofday(tv, 0);
+}
+
+static long endTime(struct timeval *start) {
+    struct timeval end;
+    int secs, usecs;
+
+    getTime(&end);
+    usecs = end.tv_usec - start->tv_usec;
+    secs = end.tv_sec - start->tv_sec;
+
+    return secs * 1000000 + usecs;
+}
+
+// JaPHa Modification
+/* The sweep and the compaction rebuild the free list in the
+   volatile copies of the allocator state, while ph_malloc (and
+   promotion) allocate from the pool's */
+static void syncFreeList() {
+	NVML_DIRECT("SYNC_FREELIST", &pheap->freelist, sizeof(Chunk*))
+	NVML_DIRECT("SYNC_CHUNKPP", &pheap->chunkpp, sizeof(Chunk**))
+	NVML_DIRECT("SYNC_HEAPFREE", &pheap->heapfree, sizeof(pheap->heapfree))
+
+	pheap->freelist = freelist;
+	pheap->chunkpp = &pheap->freelist;
+	pheap->heapfree = heapfree;
+}
+
+/* A mark-sweep collection is made restartable rather than undo-logged.
+   The mark bits are made durable and a persistent phase record says a
+   sweep is under way.  Sweeping only merges dead blocks into free
+   chunks and links the chunks, so with the same marks it can be
+   redone from any point: a sweep interrupted by a crash is simply
+   run again on the next open.  The free list head is swung by a
+   plain persisted store, after which the phase record is cleared.
+
+   libpmemobj nests transactions flatly, so should the collecting
+   thread have an open transaction a rollback could resurrect
+   references to swept objects, or the free list links and headers
+   its allocations logged over the rebuilt list.  The same goes for
+   the open epochs and sections of the suspended threads, whose logs
+   may cover fields referring to memory the sweep frees.  Such a
+   collection is still logged as a whole */
+
+static int sweepRestartable() {
+	return getTxState()->depth == 0 && threadsInTransaction() == 0;
+}
+
+static void setGCPhase(int phase) {
+	pheap->gc_phase = phase;
+	pmemobj_persist(pop_heap, &pheap->gc_phase, sizeof(int));
+}
+
+static void publishFreeList() {
+	pheap->freelist = freelist;
+	pheap->chunkpp = &pheap->freelist;
+	pheap->heapfree = heapfree;
+	pmemobj_persist(pop_heap, &pheap->freelist,
+	                offsetof(PHeap, maxHeap) - offsetof(PHeap, freelist));
+	GC_LOG(&pheap->freelist, offsetof(PHeap, maxHeap) - offsetof(PHeap, freelist));
+}
+
+static uintptr_t sweepPersistent(Thread *self) {
+	uintptr_t largest;
+
+	/* Young objects are promoted by a transaction of its
+	   own, committed before the sweep starts */
+	if(nursery_enabled) {
+		BEGIN_TX("GC-PROMOTE")
+		promoteYoung();
+		END_TX("GC-PROMOTE")
+	}
+
+	pmemobj_persist(pop_heap, markbits, markbit_size * sizeof(*markbits));
+	setGCPhase(GC_SWEEPING);
+
+	restartable_sweep = TRUE;
+	largest = doSweep(self);
+	restartable_sweep = FALSE;
+	pmemobj_drain(pop_heap);
+
+	recordBlockHints(FALSE);
+	publishFreeList();
+	setGCPhase(GC_IDLE);
+
+	return largest;
+}
+
+/* Called by initialiseAlloc when opening a pool, before anything is
+   allocated.  Objects are freed as in the interrupted sweep, but the
+   classes, class loaders and threads among them were already dead
+   in the last run, so they are not unloaded again (their metadata
+   may have been freed already, and their native state is gone) */
+static void recoverSweep() {
+	if(pheap->gc_phase != GC_SWEEPING)
+		return;
+
+	if(verbosegc)
+		jam_printf("<GC: Redoing interrupted sweep>\n");
+
+	restartable_sweep = recovering_gc = TRUE;
+	doSweep(NULL);
+	restartable_sweep = recovering_gc = FALSE;
+	pmemobj_drain(pop_heap);
+
+	recordBlockHints(FALSE);
+	publishFreeList();
+	setGCPhase(GC_IDLE);
+}
+
+/* A compaction is made restartable by a persistent forwarding table
+   (see doCompactRestartable).  Each object is written once, at its
+   new address, instead of being logged at both ends of the move.
+   The batches moving the objects must commit as they go, so the
+   collecting thread can't be within a transaction.  Nor can any other
+   thread, as rolling it back would restore addresses from before the
+   move.  Pools created without the table are still compacted under a
+   single log */
+static int compactRestartable() {
+	return getTxState()->depth == 0 && threadsInTransaction() == 0 &&
+	       !OID_IS_NULL(pheap->forwarding);
+}
+
+static uintptr_t compactPersistent(Thread *self) {
+	if(nursery_enabled) {
+		BEGIN_TX("GC-PROMOTE")
+		promoteYoung();
+		END_TX("GC-PROMOTE")
+	}
+
+	pmemobj_persist(pop_heap, markbits, markbit_size * sizeof(*markbits));
+
+	return doCompactRestartable();
+}
+
+/* Called by initialiseAlloc after recoverSweep.  The roots were
+   updated before the compaction was recorded, so only the moving
+   of the objects and the free list are redone */
+static void recoverCompaction() {
+	long long cleared = 0;
+
+	if(pheap->gc_phase != GC_COMPACTING)
+		return;
+
+	if(verbosegc)
+		jam_printf("<GC: Redoing interrupted compaction>\n");
+
+	initForwarding();
+
+	recovering_gc = TRUE;
+	moveObjects(heapbase + pheap->compact_cursor, &cleared);
+	recovering_gc = FALSE;
+	rebuildFreeList();
+
+	recordBlockHints(TRUE);
+	publishFreeList();
+	setGCPhase(GC_IDLE);
+}
+// End of modification
+
+/* JAPHA Change- modified by Taciano on Apr 24th to add transactional GC */
+unsigned long gc0_pmem(int mark_soft_refs, int compact) {
+    Thread *self = threadSelf();
+    uintptr_t largest;
+    int restartable;
+
+    /* Override compact if compaction has been specified
+       on the command line */
+    if(compact_override)
+        compact = compact_value;
+
+    /* Reset flags.  Will be set during GC if a thread needs
+       to be woken up */
+    notify_finaliser_thread = notify_reference_thread = FALSE;
+
+    /* Grab locks associated with the suspension blocked
+       regions.  This ensures all threads have suspended
+       or gone to sleep, and cannot modify a list or obtain
+       a reference after the reference scans */
+
+    /* Potential threads adding a newly created object */
+    lockVMLock(has_fnlzr_lock, self);
+
+    /* Held by the finaliser thread */
+	lockVMWaitLock(run_finaliser_lock, self);
+
+    /* Held by the reference handler thread */
+    lockVMWaitLock(reference_lock, self);
+
+    /* Stop the world */
+    disableSuspend(self);
+    suspendAllThreads(self);
+
+	// JaPHa Modification
+	/* A compaction writes the pool without logging, the
+	   other collections are logged as they go */
+	if(compact)
+		logBarrier();
+
+	/* Sweeping or compacting may reuse or move the memory covered
+	   by a thread's born range or write set, so stores must be
+	   logged again */
+	resetWriteSets();
+	walBeginGC(getTxState());
+
+	if(compact)
+		publishAllTransient();
+
+	retireNurseryChunk();
+	// End of modification
+
+	// JaPHa Modification
+	restartable = compact ? compactRestartable() : sweepRestartable();
+	// End of modification
+
+    if(verbosegc) {
+        struct timeval start;
+        float mark_time;
+        float scan_time;
+
+        getTime(&start);
+		if(restartable) {
+			doMark(self, mark_soft_refs);
+			mark_time = endTime(&start)/1000000.0;
+
+			getTime(&start);
+			largest = compact ? compactPersistent(self) : sweepPersistent(self);
+		} else {
+		BEGIN_TX("GC-VERBOSE");
+        doMark(self, mark_soft_refs);
+        mark_time = endTime(&start)/1000000.0;
+
+        getTime(&start);
+		if(nursery_enabled)
+			promoteYoung();
+        largest = compact ? doCompact() : doSweep(self);
+		if(compact)
+			dropBlockHints();
+		else
+			recordBlockHints(FALSE);
+		syncFreeList();
+		END_TX("GC-VERBOSE");
+		}
+        scan_time = endTime(&start)/1000000.0;
+
+        jam_printf("<GC: Mark took %f seconds, %s took %f seconds>\n",
+                           mark_time, compact ? "compact" : "scan", scan_time);
+    } else if(restartable) {
+        doMark(self, mark_soft_refs);
+        largest = compact ? compactPersistent(self) : sweepPersistent(self);
+    } else {
+		BEGIN_TX("GC");
+        doMark(self, mark_soft_refs);
+		if(nursery_enabled)
+			promoteYoung();
+        largest = compact ? doCompact() : doSweep(self);
+		if(compact)
+			dropBlockHints();
+		else
+			recordBlockHints(FALSE);
+		syncFreeList();
+		END_TX("GC");
+    }
+
+    /* Restart the world */
+    // JaPHa Modification
+    if(nursery_enabled)
+        rememberSurvivorRefs();
+
+    walEndGC(getTxState());
+
+    if(!final_collection) {
+        resumeAllThreads(self);
+        enableSuspend(self);
+    }
+    // End of modification
+
+    /* Notify the finaliser thread if new finalisers
+       need to be ran */
+    if(notify_finaliser_thread)
+        notifyAllVMWaitLock(run_finaliser_lock, self);
+
+    /* Notify the reference thread if new references
+       have been enqueued */
+    if(notify_reference_thread)
+        notifyAllVMWaitLock(reference_lock, self);
+
+    /* Release the locks */
+    unlockVMLock(has_fnlzr_lock, self);
+    unlockVMWaitLock(reference_lock, self);
+    unlockVMWaitLock(run_finaliser_lock, self);
+
+    freeConservativeRoots();
+    freePendingFrees();
+
+    return largest;
+}
+
+// JaPHa Modification
+/* Collect the young generation alone, when it fills up.  The heap
+   isn't marked, swept or compacted: the roots and the remembered set
+   are marked through to the young objects, which are then promoted
+   (or freed) as by a full collection.  Nothing is unloaded, and
+   references are cleared by full collections only */
+static void gcYoung() {
+    Thread *self = threadSelf();
+
+    notify_finaliser_thread = notify_reference_thread = FALSE;
+
+    lockVMLock(has_fnlzr_lock, self);
+    lockVMWaitLock(run_finaliser_lock, self);
+    lockVMWaitLock(reference_lock, self);
+
+    disableSuspend(self);
+    suspendAllThreads(self);
 
-        jam_printf("<GC: Mark took %f seconds, %s took %f seconds>\n",
-                           mark_time, compact ? "compact" : "scan", scan_time);
-    } else {
-		BEGIN_TX("GC");
-        doMark(self, mark_soft_refs);
-        largest = compact ? doCompact() : doSweep(self);
-		END_TX("GC");
-    }
+    resetWriteSets();
+    walBeginGC(getTxState());
+    retireNurseryChunk();
 
-    /* Restart the world */
+    minor_collection = TRUE;
+
+    BEGIN_TX("GC-YOUNG")
+    doMark(self, TRUE);
+    promoteYoung();
+    END_TX("GC-YOUNG")
+
+    minor_collection = FALSE;
+
+    walEndGC(getTxState());
     resumeAllThreads(self);
     enableSuspend(self);
 
-    /* Notify the finaliser thread if new finalisers
-       need to be ran */
     if(notify_finaliser_thread)
         notifyAllVMWaitLock(run_finaliser_lock, self);
 
-    /* Notify the reference thread if new references
-       have been enqueued */
     if(notify_reference_thread)
         notifyAllVMWaitLock(reference_lock, self);
 
-    /* Release the locks */
     unlockVMLock(has_fnlzr_lock, self);
     unlockVMWaitLock(reference_lock, self);
     unlockVMWaitLock(run_finaliser_lock, self);
 
     freeConservativeRoots();
-    freePendingFrees();
-
-    return largest;
 }
+// End of modification
 
 unsigned long gc0(int mark_soft_refs, int compact) {
     Thread *self = threadSelf();
@@ -1867,11 +4650,14 @@ unsigned long gc0(int mark_soft_refs, int compact) {
 }
 void gc1() {
     Thread *self;
+    int in_tx;
     disableSuspend(self = threadSelf());
     lockVMLock(heap_lock, self);
 	// JAPHA modification to add async tx GC
-	if(verbosegc) jam_printf("<GC: Attempting async GC>, tx_count=%u\n", total_tx_count);
-	if (total_tx_count == 0) {		// only perform async GC if there is no ongoing NVML transaction
+	// only perform async GC if no thread is in the middle of an NVML transaction
+	in_tx = persistent ? threadsInTransaction() : 0;
+	if(verbosegc) jam_printf("<GC: Attempting async GC>, threads in tx=%d\n", in_tx);
+	if (in_tx == 0) {
 		if(verbosegc) jam_printf("<GC: Will execute async GC>\n");
 		enableSuspend(self);
 		if (persistent) {
@@ -1947,7 +4733,7 @@ void runFinalizers() {
 void asyncGCThreadLoop(Thread *self) {
     for(;;) {
         threadSleep(self, 1000, 0);
-		if(verbosegc) jam_printf("<GC: Async GC loop has awaken>, tx_count=%u\n", total_tx_count);
+		if(verbosegc) jam_printf("<GC: Async GC loop has awaken>\n");
         if(systemIdle(self))
             gc1();
     }
@@ -2028,6 +4814,17 @@ void set_has_finaliser_list(){
 		has_finaliser_size = ph_values->has_finaliser_size;
 		has_finaliser_list = malloc(has_finaliser_size*sizeof(Object*));
 		memcpy(has_finaliser_list, ph_values->has_finaliser_list, has_finaliser_size*sizeof(Object*));
+
+		/* Drop the objects which were never promoted */
+		{
+			int i, j;
+
+			for(i = 0, j = 0; i < has_finaliser_count; i++)
+				if(!isStaleYoungRef(has_finaliser_list[i]))
+					has_finaliser_list[j++] = has_finaliser_list[i];
+
+			has_finaliser_count = j;
+		}
 		// End of modification
 	}
 }
@@ -2081,7 +4878,6 @@ void *ph_malloc(int len2) {
 	Chunk *found;
 	Thread *self;
 	int err;
-	int have_remaining = FALSE;
 
 	/* See comment below */
 	char *ret_addr;
@@ -2109,6 +4905,16 @@ void *ph_malloc(int len2) {
 		uintptr_t len;
 		while(*(pheap->chunkpp)) {
 			len = (*(pheap->chunkpp))->header;
+
+			/* Only the free-list metadata is undo-logged: the link
+			   being unchained and the header/next of the chunk.  On
+			   rollback the rest of the chunk is free space again, so
+			   the new object's body is never logged (see below) */
+			if(len >= n && nvml_alloc) {
+				NVML_DIRECT("FREELINK", pheap->chunkpp, sizeof(Chunk*))
+				NVML_DIRECT("FOUND", *pheap->chunkpp, sizeof(Chunk))
+			}
+
 			if(len == n) {
 				found = *pheap->chunkpp;
 				*pheap->chunkpp = found->next;
@@ -2119,12 +4925,20 @@ void *ph_malloc(int len2) {
 				Chunk *rem;
 				found = *pheap->chunkpp;
 				rem = (Chunk*)((char*)found + n);
+
+				/* The remainder's header must survive a commit
+				   as the sweep walks the heap by headers */
+				if(nvml_alloc) {
+					NVML_DIRECT("REMAINDER", &rem->header, HEADER_SIZE)
+				}
 				rem->header = len - n;
 
 				/* Chain the remainder onto the freelist only
 				   if it's large enough to hold an object */
 				if(rem->header >= MIN_OBJECT_SIZE) {
-					have_remaining = TRUE;
+					if(nvml_alloc) {
+						NVML_DIRECT("REMAINDER_NEXT", &rem->next, sizeof(Chunk*))
+					}
 					rem->next = found->next;
 					*pheap->chunkpp = rem;
 				} else
@@ -2153,7 +4967,7 @@ void *ph_malloc(int len2) {
 					   rapid gc cycles */
 					largest = gc0_pmem(TRUE, FALSE);
 
-					if(n <= largest && (pheap->heapfree * 4 >= (pheap->heaplimit - pheap->heapbase)))
+					if(n <= largest && (pheap->heapfree * 4 >= heapSize()))
 						break;
 
 					/* We fall through into the next state, but we need to set
@@ -2182,23 +4996,20 @@ void *ph_malloc(int len2) {
 					/* Retry gc, but this time compact the heap rather than just
 					   sweeping it */
 					largest = gc0_pmem(TRUE, TRUE);
-					if(n <= largest && (pheap->heapfree * 4 >= (pheap->heaplimit - pheap->heapbase))) {
+					if(n <= largest && (pheap->heapfree * 4 >= heapSize())) {
 						state = gc;
 						break;
 					}
 
-					// JAPHA: Taciano removed heap expansion for initial version of tx GC on May 5 2016
 					/* Still not freed enough memory so try to expand the heap.
 					   Note we retry allocation even if the heap couldn't be
 					   expanded sufficiently -- there's a chance gc may merge
 					   adjacent blocks together at the top of the heap */
-					   /*
 					if(heaplimit < heapmax) {
 						expandHeap(n);
 						state = gc;
 						break;
 					}
-					*/
 
 					if(verbosegc)
 						jam_printf("<GC: Stack at maximum already."
@@ -2256,17 +5067,6 @@ got_it_pmem:
 
 	pheap->heapfree -= n;
 
-	if(have_remaining) {
-		if(nvml_alloc) {
-			NVML_DIRECT("FOUND", found, HEADER_SIZE * 2 + n)
-		}
-	}
-	else {
-		if(nvml_alloc) {
-			NVML_DIRECT("FOUND2", found, HEADER_SIZE + n)
-		}
-	}
-
 	found->header = n | ALLOC_BIT;
 
 	/* Found is a block pointer - if we unlock now, small window
@@ -2276,10 +5076,83 @@ got_it_pmem:
 
 	ret_addr = ((char*)found)+HEADER_SIZE;
 	memset(ret_addr, 0, n-HEADER_SIZE);
+
+	/* Clear any stale transient bit left by a previous object */
+	if(persist_by_reachability)
+		setTransientBit((Object*)ret_addr, FALSE);
+
+	/* The body is unreachable unless the transaction commits, so
+	   it is not logged but flushed when the transaction commits.
+	   Further stores into it are log-free as well */
+	if(nvml_alloc)
+		recordBornObject((char*)found, n);
+
+	unlockVMLock(heap_lock, self);
+
+	return ret_addr;
+}
+
+/* Allocation in the heap on behalf of the interpreter when the
+   object can't be young.  The interpreter hasn't begun a transaction
+   (see BEGIN_ALLOC) so the allocation is a transaction of its own */
+static void *tenuredMalloc(int len) {
+	void *ret_addr;
+
+	BEGIN_TX("TENURED_ALLOC")
+	nvml_alloc = TRUE;
+	ret_addr = ph_malloc(len);
+	nvml_alloc = FALSE;
+	END_TX("TENURED_ALLOC")
+
+	if(ret_addr != NULL)
+		makeTransient(ret_addr);
+
+	return ret_addr;
+}
+
+/* Bump-pointer allocation in the young generation.  The heap lock
+   keeps the young generation parsable by the collector */
+static void *youngMalloc(int len) {
+	int n = (len+HEADER_SIZE+OBJECT_GRAIN-1)&~(OBJECT_GRAIN-1);
+	int collected = FALSE;
+	Thread *self;
+	Chunk *found;
+	char *ret_addr;
+
+	if(n > nursery_max_object)
+		return tenuredMalloc(len);
+
+	self = threadSelf();
+	if(!tryLockVMLock(heap_lock, self)) {
+		disableSuspend(self);
+		lockVMLock(heap_lock, self);
+		enableSuspend(self);
+	}
+
+	while(nursery_end - nursery_top < n)
+		if(!nextNurseryChunk()) {
+			/* Full even after a collection (pinned survivors) */
+			if(collected) {
+				unlockVMLock(heap_lock, self);
+				return tenuredMalloc(len);
+			}
+
+			gcYoung();
+			collected = TRUE;
+		}
+
+	found = (Chunk*)nursery_top;
+	nursery_top += n;
+	found->header = n | ALLOC_BIT;
+
+	ret_addr = ((char*)found)+HEADER_SIZE;
+	memset(ret_addr, 0, n-HEADER_SIZE);
+
 	unlockVMLock(heap_lock, self);
 
 	return ret_addr;
 }
+
 // End of modification
 
 void *gcMalloc(int len) {
@@ -2364,7 +5237,7 @@ void *gcMalloc(int len) {
                    rapid gc cycles */
                 largest = gc0(TRUE, FALSE);
 
-                if(n <= largest && (heapfree * 4 >= (heaplimit - heapbase)))
+                if(n <= largest && (heapfree * 4 >= heapSize()))
                     break;
 
                 /* We fall through into the next state, but we need to set
@@ -2393,7 +5266,7 @@ void *gcMalloc(int len) {
                 /* Retry gc, but this time compact the heap rather than just
                    sweeping it */
                 largest = gc0(TRUE, TRUE);
-                if(n <= largest && (heapfree * 4 >= (heaplimit - heapbase))) {
+                if(n <= largest && (heapfree * 4 >= heapSize())) {
                     state = gc;
                     break;
                 }
@@ -2500,9 +5373,29 @@ got_it:
     enableSuspend(self);                                                      \
 }
 
+// JaPHa Modification
+/* The allocation functions with a 0 suffix take whether the object
+   goes to the young generation.  Only the interpreter's allocations
+   do (see BEGIN_ALLOC), allocations made on their behalf, such as
+   class loading, go to the persistent heap */
 Object *allocObject(Class *class) {
+    return allocObject0(class, FALSE);
+}
+// End of modification
+
+Object *allocObject0(Class *class, int young) {
     ClassBlock *cb = CLASS_CB(class);
-    Object *ob = gcMalloc(cb->object_size);
+    Object *ob;
+
+    // JaPHa Modification
+    /* Special objects are handled by the sweep when they
+       die, so they are never young */
+    if(young && nursery_enabled)
+        ob = IS_SPECIAL(cb) ? tenuredMalloc(cb->object_size)
+                            : youngMalloc(cb->object_size);
+    else
+        ob = gcMalloc(cb->object_size);
+    // End of modification
 
     if(ob != NULL) {
         ob->class = class;
@@ -2525,7 +5418,13 @@ Object *allocObject(Class *class) {
     return ob;
 }
     
+// JaPHa Modification
 Object *allocArray(Class *class, int size, int el_size) {
+    return allocArray0(class, size, el_size, FALSE);
+}
+// End of modification
+
+Object *allocArray0(Class *class, int size, int el_size, int young) {
     Object *ob;
 
     /* Special check to protect against integer overflow */
@@ -2534,7 +5433,12 @@ Object *allocArray(Class *class, int size, int el_size) {
         return NULL;
     }
 
-    ob = gcMalloc(size * el_size + sizeof(uintptr_t) + sizeof(Object));
+    // JaPHa Modification
+    if(young && nursery_enabled)
+        ob = youngMalloc(size * el_size + sizeof(uintptr_t) + sizeof(Object));
+    else
+        ob = gcMalloc(size * el_size + sizeof(uintptr_t) + sizeof(Object));
+    // End of modification
 
     if(ob != NULL) {
         ob->class = class;
@@ -2546,7 +5450,13 @@ Object *allocArray(Class *class, int size, int el_size) {
     return ob;
 }
 
+// JaPHa Modification
 Object *allocTypeArray(int type, int size) {
+    return allocTypeArray0(type, size, FALSE);
+}
+// End of modification
+
+Object *allocTypeArray0(int type, int size, int young) {
     static char *array_names[] = {"[Z", "[C", "[F", "[D", "[B",
                                   "[S", "[I", "[J"};
     static int element_sizes[] = {1, 2, 4, 8, 1, 2, 4, 8};
@@ -2568,10 +5478,17 @@ Object *allocTypeArray(int type, int size) {
         registerStaticClassRefLocked(&array_classes[idx], class);
     }
 
-    return allocArray(array_classes[idx], size, element_sizes[idx]);
+    return allocArray0(array_classes[idx], size, element_sizes[idx], young);
 }
 
+// JaPHa Modification
 Object *allocMultiArray(Class *array_class, int dim, intptr_t *count) {
+    return allocMultiArray0(array_class, dim, count, FALSE);
+}
+// End of modification
+
+Object *allocMultiArray0(Class *array_class, int dim, intptr_t *count,
+                         int young) {
     int i;
     Object *array;
     char *element_name = CLASS_CB(array_class)->name + 1;
@@ -2580,7 +5497,7 @@ Object *allocMultiArray(Class *array_class, int dim, intptr_t *count) {
         Class *aclass = findArrayClassFromClass(element_name, array_class);
         Object **body;
 
-        array = allocArray(array_class, *count, sizeof(Object*));
+        array = allocArray0(array_class, *count, sizeof(Object*), young);
 
         if(array == NULL)
             return NULL;
@@ -2588,11 +5505,12 @@ Object *allocMultiArray(Class *array_class, int dim, intptr_t *count) {
         body = ARRAY_DATA(array, Object*);
 
         for(i = 0; i < *count; i++)
-            if((*body++ = allocMultiArray(aclass, dim - 1, count + 1)) == NULL)
+            if((*body++ = allocMultiArray0(aclass, dim - 1, count + 1,
+                                           young)) == NULL)
                 return NULL;
     } else
-        array = allocArray(array_class, *count,
-                           sigElement2Size(*element_name));
+        array = allocArray0(array_class, *count,
+                            sigElement2Size(*element_name), young);
 
     return array;
 }
@@ -2626,6 +5544,20 @@ Object *cloneObject(Object *ob) {
         /* We will also have copied the objects lock word */
         clone->lock = 0;
 
+        // JaPHa Modification
+        /* The copied references may be to transient objects, so
+           the clone starts out transient like any new object */
+        makeTransient(clone);
+
+        /* Or to young objects */
+        if(nursery_enabled && !IN_NURSERY(clone)) {
+            char *name = CLASS_CB(clone->class)->name;
+
+            if(name[0] != '[' || name[1] == 'L' || name[1] == '[')
+                rememberHolder(clone);
+        }
+        // End of modification
+
         if(IS_FINALIZED(CLASS_CB(clone->class)))
             ADD_FINALIZED_OBJECT(clone);
 
@@ -2644,6 +5576,13 @@ Object *cloneObject(Object *ob) {
     return clone;
 }
 
+// JaPHa Modification
+char *getObjectEnd(Object *ob) {
+    uintptr_t *hdr_addr = HDR_ADDRESS(ob);
+    return (char*)hdr_addr + HDR_SIZE(*hdr_addr);
+}
+// End of modification
+
 uintptr_t getObjectHashcode(Object *ob) {
     uintptr_t *hdr_addr = HDR_ADDRESS(ob);
 
@@ -2659,7 +5598,9 @@ uintptr_t getObjectHashcode(Object *ob) {
     /* Mark that the hashCode has been taken, in case
        compaction later moves it */
     *hdr_addr |= HASHCODE_TAKEN_BIT;
-    return (uintptr_t) ob;
+    // JaPHa Modification
+    return ADDRESS_HASHCODE(ob);
+    // End of modification
 }
 
 
@@ -2670,11 +5611,11 @@ unsigned long freeHeapMem() {
 }
 
 unsigned long totalHeapMem() {
-    return heaplimit-heapbase;
+    return heapSize();
 }
 
 unsigned long maxHeapMem() {
-    return heapmax-heapbase;
+    return heapmax-heapbase-bridgedBelow(heapmax);
 }
 
 
@@ -2807,191 +5748,508 @@ void freePendingFrees() {
 /* ------ Allocation from system heap ------- */
 
 
-/* MREMAP MAYMOVE ISSUE */
 // JaPHa Modification
-void expandNVM(){
-	printf("Expanding NVM metadata region");
-	unsigned int oldSize = pheap->nvmCurrentSize;
-	nvmChunk *new;
-	nvmChunk *chunk;
-
-	pheap->nvmCurrentSize = pheap->nvmCurrentSize + INCREASE_VALUE;
-	pheap->nvm_limit = (unsigned long) pheap->nvm + pheap->nvmCurrentSize;
-
-	memset((pheap->nvm+oldSize), 0, INCREASE_VALUE);
-
-	/* goto last chunk */
-	for (chunk = pheap->nvmfreelist; chunk->next !=NULL; chunk = chunk->next);
-
-	/* if isnt allocated attach new offset */
-	if (!chunk->allocBit){
-		chunk->chunkSize = chunk->chunkSize + INCREASE_VALUE;
-		pheap->nvmFreeSpace = pheap->nvmFreeSpace + INCREASE_VALUE;
-	}else {
-	/* create new chunk and add to the list
-							 ptr + header + chunk len 	*/
-		// JAPHA: modified by Taciano on April 28 2016 to avoid compilation warning
-		//new = ((unsigned int)new + nvmHeaderSize + new->chunkSize);
-		new = (nvmChunk*)(((void*)new) + nvmHeaderSize + new->chunkSize);
-		new->allocBit = 0;
-		new->chunkSize = INCREASE_VALUE;
-		new->next = NULL;
-		chunk->next = new;
-		pheap->nvmFreeSpace = pheap->nvmFreeSpace + INCREASE_VALUE - nvmHeaderSize;
+/* The NVM metadata region (class blocks, constant pools, method
+   tables, code, resized hash tables...) is a chain of segments split
+   into pages.  The first segments are within the pheap, more are
+   allocated from the pool as needed (see expandNVM).  A page is
+   either part of a run, which holds one large allocation, or a slab
+   of slots of one size class.  The allocator's persistent state is
+   per segment a bitmap of the pages in use, and for each page its
+   kind and, for a slab, a bitmap of the slots in use.  Allocating or
+   freeing a slot logs a single bitmap word.  Freed runs coalesce by
+   themselves as their bits are cleared.  Within a transaction a free
+   only takes effect at its commit.
+
+   The slabs with free slots are kept in volatile per-class lists,
+   rebuilt from the bitmaps when the pool is opened.  A slab which
+   fills up leaves its list, one which empties is returned to the
+   page bitmap.  Pages are identified across segments by segment
+   index * NVM_SEGMENT_PAGES + page index */
+
+#define NVM_WORD_BITS (sizeof(uintptr_t) * 8)
+#define NVM_MAX_PAGES (NVM_MAX_SEGMENTS * NVM_SEGMENT_PAGES)
+
+static int nvm_class_sizes[NVM_CLASSES] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+};
+
+/* Size class of each multiple of the grain up to the largest class */
+static unsigned char nvm_size_class[NVM_SLAB_MAX / NVM_SLAB_GRAIN + 1];
+
+/* The segments, in chain order */
+static NVMSegment *nvm_segments[NVM_MAX_SEGMENTS];
+static int nvm_segment_count;
+
+/* Slabs with free slots, by class, linked by page */
+static int nvm_partial[NVM_CLASSES];
+static int nvm_next[NVM_MAX_PAGES];
+static int nvm_prev[NVM_MAX_PAGES];
+static int nvm_free_slots[NVM_MAX_PAGES];
+
+/* No free page below this one, by segment */
+static int nvm_page_hint[NVM_MAX_SEGMENTS];
+
+#define PAGE_SEGMENT(page) nvm_segments[(page) / NVM_SEGMENT_PAGES]
+#define PAGE_INDEX(page) ((page) % NVM_SEGMENT_PAGES)
+#define PAGE_DESC(page) (&PAGE_SEGMENT(page)->pages[PAGE_INDEX(page)])
+#define PAGE_ADDR(page) (PAGE_SEGMENT(page)->mem + PAGE_INDEX(page) * NVM_PAGE_SIZE)
+
+#define SEGMENT_PAGE_USED(seg, index) \
+	((seg)->pagemap[(index) / NVM_WORD_BITS] & \
+	 ((uintptr_t)1 << ((index) % NVM_WORD_BITS)))
+
+#define NVM_SLOTS(class) (NVM_PAGE_SIZE / nvm_class_sizes[class])
+
+/* The page holding an address, or -1 if it
+   isn't within the region */
+static int addrPage(void *addr) {
+	int i;
+
+	for(i = 0; i < nvm_segment_count; i++) {
+		char *mem = nvm_segments[i]->mem;
+
+		if((char*)addr >= mem && (char*)addr < mem + NVM_SEGMENT_SIZE)
+			return i * NVM_SEGMENT_PAGES + ((char*)addr - mem) / NVM_PAGE_SIZE;
 	}
+
+	return -1;
 }
-// End of modification
 
-/* XXX NVM CHANGE 004.001 - SysMalloc */
-// JaPHa Modification
-void *sysMalloc_persistent(unsigned int size){
-	if (persistent){
-		uint n = size < sizeof(void*) ? sizeof(void*) : size;
-		uint have_remaining = FALSE;
-		void *ret_addr = NULL;
-		nvmChunk *rem = NULL;
-		nvmChunk *found = NULL;
-		int err;
-		int shift = 0;
-
-		unsigned int len = 0;
-		if(nvml_alloc) {
-			NVML_DIRECT("NVMCHUNKPP", &pheap->nvmChunkpp, sizeof(nvmChunk*))
-		}
-		while (*(pheap->nvmChunkpp)){
+/* Whether an address is within the NVM metadata region, whichever
+   segment it is in */
+int inNVMRegion(void *addr) {
+	return addrPage(addr) != -1;
+}
 
-			/*	search unallocated chunk		*/
-			if ((*(pheap->nvmChunkpp))->allocBit == 1) {
-				pheap->nvmChunkpp = &(*(pheap->nvmChunkpp))->next;
-				continue;
-			}
-			len = (*(pheap->nvmChunkpp))->chunkSize;
+static void partialPush(int class, int page) {
+	nvm_prev[page] = -1;
+	nvm_next[page] = nvm_partial[class];
+	if(nvm_partial[class] != -1)
+		nvm_prev[nvm_partial[class]] = page;
+	nvm_partial[class] = page;
+}
 
-			if(len > n) {
-				found = *(pheap->nvmChunkpp);
-				/*	check if remaining space can hold a chunk		*/
-				if((int)(len - (nvmHeaderSize + n)) >= minSize) {
-					/*	ptr +	header	+ content = OK	*/
-					// JAPHA: modified by Taciano on April 28 2016 to avoid compilation warning
-					//rem = ((char*)found + nvmHeaderSize + n);
-					rem = (nvmChunk*)((char*)found + nvmHeaderSize + n);
-
-					have_remaining = TRUE;
-					if (shift = (unsigned int)rem & 0x3){
-						shift = (0x4 - shift);
-						memset(rem, 0 , shift);
-						rem = ((char*)rem + shift);
-					}
-					rem->allocBit = 0;
-					rem->chunkSize = len - (shift + nvmHeaderSize + n);
-					rem->next = found->next;
-				}
-				ret_addr = ((void*)found + nvmHeaderSize);
-				break;
-			}
+static void partialRemove(int class, int page) {
+	if(nvm_prev[page] != -1)
+		nvm_next[nvm_prev[page]] = nvm_next[page];
+	else
+		nvm_partial[class] = nvm_next[page];
+	if(nvm_next[page] != -1)
+		nvm_prev[nvm_next[page]] = nvm_prev[page];
+}
 
-			if(len == n) {
-				found = *(pheap->nvmChunkpp);
-				ret_addr = ((void*)found + nvmHeaderSize);
-				break;
-			}
-			pheap->nvmChunkpp = &(*(pheap->nvmChunkpp))->next;
-		}
+/* Sets or clears the bits of pages [first, first + count) of a
+   segment in its page bitmap, logging each word touched */
+static void markPages(NVMSegment *seg, int first, int count, int used) {
+	int index = first, end = first + count;
+
+	while(index < end) {
+		int word = index / NVM_WORD_BITS;
+		int bit = index % NVM_WORD_BITS;
+		int bits = NVM_WORD_BITS - bit < end - index ? NVM_WORD_BITS - bit : end - index;
+		uintptr_t mask = (bits == NVM_WORD_BITS ? ~(uintptr_t)0 :
+		                  (((uintptr_t)1 << bits) - 1)) << bit;
+
+		NVML_DIRECT("NVMPAGEMAP", &seg->pagemap[word], sizeof(uintptr_t))
+		if(used)
+			seg->pagemap[word] |= mask;
+		else
+			seg->pagemap[word] &= ~mask;
 
-		if (found == NULL) {
-			// we couldn't find any chunk with the desired size
-			// since we don't have GC yet, we'll have to exit the JVM
-			jam_fprintf(stderr, "We're out of chunks and don't have GC for sysMalloc_persistent, so goodbye!\n");
-			exitVM(1);
-		}
+		index += bits;
+	}
+}
 
-		if(have_remaining) {
-			if(nvml_alloc) {
-				NVML_DIRECT("FOUND3", found, nvmHeaderSize * 2  + n)
-			}
-		}
-		else {
-			if(nvml_alloc) {
-				NVML_DIRECT("FOUND4", found, nvmHeaderSize + n)
-			}
+/* First fit over a segment's page bitmap, whole
+   words in use are skipped */
+static int allocSegmentPages(int segment, int count) {
+	NVMSegment *seg = nvm_segments[segment];
+	int index = nvm_page_hint[segment], run = 0;
+
+	while(index < NVM_SEGMENT_PAGES) {
+		if(index % NVM_WORD_BITS == 0 && run == 0 &&
+		   seg->pagemap[index / NVM_WORD_BITS] == ~(uintptr_t)0) {
+			index += NVM_WORD_BITS;
+			continue;
 		}
 
-		found->allocBit = 1;
-		found->chunkSize = n;
+		if(SEGMENT_PAGE_USED(seg, index))
+			run = 0;
+		else if(++run == count) {
+			int first = index - count + 1;
 
-		if(have_remaining)
-			found->next = rem;
+			if(first == nvm_page_hint[segment])
+				nvm_page_hint[segment] = index + 1;
 
-		if(nvml_alloc) {
-			NVML_DIRECT("NVMFREESPACE", &(pheap->nvmFreeSpace), sizeof(pheap->nvmFreeSpace))
+			markPages(seg, first, count, TRUE);
+			return segment * NVM_SEGMENT_PAGES + first;
 		}
+		index++;
+	}
 
-		if(have_remaining)
-			pheap->nvmFreeSpace = pheap->nvmFreeSpace - nvmHeaderSize - shift - sizeof(nvmChunk);
-		else
-			pheap->nvmFreeSpace = pheap->nvmFreeSpace - found->chunkSize - sizeof(nvmChunk);
+	return -1;
+}
 
-		if (nvml_alloc)	{
-			if ((void*)found >= (void*)(pheap->nvm + pheap->nvmCurrentSize)) {
-				printf("NVM_LIMIT exceeded %p >= %p\n", (void*)found, (void*)pheap->nvm_limit);
-			}
-		}
+static void registerSegment(NVMSegment *seg) {
+	nvm_page_hint[nvm_segment_count] = 0;
+	nvm_segments[nvm_segment_count++] = seg;
+}
+
+/* Segments are allocated with the atomic API directly into the
+   previous segment's link, so a segment is never leaked nor left
+   half-linked.  The constructor clears the bitmaps and page
+   descriptors, the pages themselves are zeroed on allocation */
+static int initSegment(PMEMobjpool *pop, void *ptr, void *arg) {
+	memset(ptr, 0, offsetof(NVMSegment, mem));
+	pmemobj_persist(pop, ptr, offsetof(NVMSegment, mem));
+	return 0;
+}
+
+static int expandNVM() {
+	NVMSegment *last = nvm_segments[nvm_segment_count - 1];
+
+	if(nvm_segment_count == NVM_MAX_SEGMENTS)
+		return FALSE;
+
+	/* The segment is allocated and linked in without logging */
+	logBarrier();
+
+	if(pmemobj_alloc(pop_heap, &last->next, sizeof(NVMSegment), 0,
+	                 initSegment, NULL) != 0)
+		return FALSE;
+
+	registerSegment(pmemobj_direct(last->next));
+
+	if(verbosegc)
+		jam_printf("<GC: Grown NVM metadata region to %d segments (%dM)>\n",
+		           nvm_segment_count, nvm_segment_count * NVM_SEGMENT_SIZE / MB);
+
+	return TRUE;
+}
+
+/* The parts of the pool in use, for snapshots (see snapshot.c): the
+   pheap, which holds the first segments and the initial hash tables,
+   the heap's extents up to its limit, the parts of the mark bits and forwarding
+   table covering it, and the segments allocated since.  Hash tables
+   resized out of the pheap are within the segments.  Called with the
+   world stopped.  Returns the number of ranges */
+static PoolRange *usedRange(PoolRange *range, void *start, unsigned long size) {
+	range->start = start;
+	range->end = (char*)start + size;
+	return range + 1;
+}
+
+int poolRanges(PoolRange *ranges) {
+	int regions = (heaplimit - heapbase + FWD_REGION_SIZE - 1) / FWD_REGION_SIZE;
+	int all = (heapmax - heapbase + FWD_REGION_SIZE - 1) / FWD_REGION_SIZE;
+	PoolRange *range = ranges;
+	char *mem;
+	int i;
+
+	range = usedRange(range, pheap, sizeof(PHeap));
+	mem = pheap->heapMem;
+	for(i = 0; i < extent_count && bridges[i] < heaplimit; i++) {
+		range = usedRange(range, mem, bridges[i] + BRIDGE_SIZE - mem);
+		mem = pmemobj_direct(pheap->heap_extents[i]);
+	}
+	range = usedRange(range, mem, heaplimit - mem);
+	range = usedRange(range, markbits, markbit_size * sizeof(*markbits));
+
+	if(!OID_IS_NULL(pheap->forwarding)) {
+		uintptr_t *fwd = pmemobj_direct(pheap->forwarding);
+
+		for(i = 0; i < 3; i++)
+			range = usedRange(range, fwd + i * all, regions * sizeof(uintptr_t));
+	}
+
+	for(i = NVM_INIT_SEGMENTS; i < nvm_segment_count; i++)
+		range = usedRange(range, nvm_segments[i], sizeof(NVMSegment));
+
+	return range - ranges;
+}
+
+static int allocPages(int count) {
+	int i, page;
+
+	if(count > NVM_SEGMENT_PAGES)
+		return -1;
+
+	for(;;) {
+		for(i = 0; i < nvm_segment_count; i++)
+			if((page = allocSegmentPages(i, count)) != -1)
+				return page;
+
+		if(!expandNVM())
+			return -1;
+	}
+}
+
+static void freePages(int first, int count) {
+	int segment = first / NVM_SEGMENT_PAGES;
+
+	markPages(nvm_segments[segment], PAGE_INDEX(first), count, FALSE);
+
+	if(PAGE_INDEX(first) < nvm_page_hint[segment])
+		nvm_page_hint[segment] = PAGE_INDEX(first);
+}
+
+static void nvmOutOfMemory(unsigned int size) {
+	jam_fprintf(stderr, "NVM metadata region exhausted allocating %u bytes"
+	                    " - aborting VM...\n", size);
+	exitVM(1);
+}
+
+static void *allocRun(unsigned int size) {
+	int count = (size + NVM_PAGE_SIZE - 1) / NVM_PAGE_SIZE;
+	int page = allocPages(count);
+	NVMPage *desc;
+
+	if(page == -1)
+		nvmOutOfMemory(size);
+
+	desc = PAGE_DESC(page);
+	NVML_DIRECT("NVMPAGE", desc, sizeof(NVMPage))
+	desc->kind = NVM_PAGE_RUN;
+	desc->run = count;
+
+	return PAGE_ADDR(page);
+}
+
+static void *allocSlot(int class) {
+	int page = nvm_partial[class];
+	int slots = NVM_SLOTS(class);
+	NVMPage *desc;
+	int word;
+
+	if(page == -1) {
+		if((page = allocPages(1)) == -1)
+			nvmOutOfMemory(nvm_class_sizes[class]);
+
+		desc = PAGE_DESC(page);
+		NVML_DIRECT("NVMPAGE", desc, sizeof(NVMPage))
+		memset(desc, 0, sizeof(NVMPage));
+		desc->kind = NVM_PAGE_SLAB;
+		desc->size_class = class;
+
+		nvm_free_slots[page] = slots;
+		partialPush(class, page);
+	}
+
+	desc = PAGE_DESC(page);
+
+	for(word = 0; word * NVM_WORD_BITS < slots; word++) {
+		uintptr_t free = ~desc->bitmap[word];
+		int slot;
+
+		if(free == 0)
+			continue;
+
+		slot = word * NVM_WORD_BITS + __builtin_ctzl(free);
+		if(slot >= slots)
+			break;
+
+		NVML_DIRECT("NVMSLAB", &desc->bitmap[word], sizeof(uintptr_t))
+		desc->bitmap[word] |= (uintptr_t)1 << (slot % NVM_WORD_BITS);
+
+		if(--nvm_free_slots[page] == 0)
+			partialRemove(class, page);
+
+		return PAGE_ADDR(page) + slot * nvm_class_sizes[class];
+	}
+
+	/* The count was stale, drop the slab and try again */
+	nvm_free_slots[page] = 0;
+	partialRemove(class, page);
+	return allocSlot(class);
+}
 
+static void freeSlot(NVMPage *desc, int page, char *addr) {
+	int class = desc->size_class;
+	int slot = (addr - PAGE_ADDR(page)) / nvm_class_sizes[class];
+	int word = slot / NVM_WORD_BITS;
 
-		/* clear chunk */
-		memset(ret_addr, 0, found->chunkSize);
+	NVML_DIRECT("NVMSLAB", &desc->bitmap[word], sizeof(uintptr_t))
+	desc->bitmap[word] &= ~((uintptr_t)1 << (slot % NVM_WORD_BITS));
+
+	if(nvm_free_slots[page]++ == 0)
+		partialPush(class, page);
+
+	if(nvm_free_slots[page] == NVM_SLOTS(class)) {
+		partialRemove(class, page);
+		freePages(page, 1);
+	}
+}
+
+/* Size of an allocation, from its page */
+static unsigned int nvmAllocSize(int page) {
+	NVMPage *desc = PAGE_DESC(page);
+
+	return desc->kind == NVM_PAGE_SLAB ? nvm_class_sizes[desc->size_class]
+	                                   : desc->run * NVM_PAGE_SIZE;
+}
+
+static void scanSegment(int segment) {
+	NVMSegment *seg = nvm_segments[segment];
+	int index, hint = -1;
+
+	for(index = 0; index < NVM_SEGMENT_PAGES; ) {
+		NVMPage *desc = &seg->pages[index];
+		int page = segment * NVM_SEGMENT_PAGES + index;
+
+		if(!SEGMENT_PAGE_USED(seg, index)) {
+			if(hint == -1)
+				hint = index;
+			index++;
+		} else if(desc->kind == NVM_PAGE_SLAB) {
+			int slots = NVM_SLOTS(desc->size_class);
+			int word, used = 0;
+
+			for(word = 0; word * NVM_WORD_BITS < slots; word++)
+				used += __builtin_popcountl(desc->bitmap[word]);
+
+			if((nvm_free_slots[page] = slots - used) > 0)
+				partialPush(desc->size_class, page);
+			index++;
+		} else
+			index += desc->run;
+	}
+
+	nvm_page_hint[segment] = hint == -1 ? NVM_SEGMENT_PAGES : hint;
+}
+
+/* Called when a transaction aborts.  The page and slot bitmaps are
+   rolled back but the volatile lists and hints are not, so a slab
+   could stay on its list once its page is free, and be handed out
+   as a page again.  They are rebuilt from the bitmaps */
+void rebuildNVMLists() {
+	int class, i;
+
+	for(class = 0; class < NVM_CLASSES; class++)
+		nvm_partial[class] = -1;
+
+	for(i = 0; i < nvm_segment_count; i++)
+		scanSegment(i);
+}
+
+/* Called by initialiseAlloc.  The segments within the pheap are
+   zeroed in a new pool, so all their pages are free */
+void initialiseNVM(int create) {
+	NVMSegment *seg;
+	int class, size, i;
+
+	for(class = 0, size = 0; size <= NVM_SLAB_MAX; size += NVM_SLAB_GRAIN) {
+		while(nvm_class_sizes[class] < size)
+			class++;
+		nvm_size_class[size / NVM_SLAB_GRAIN] = class;
+	}
+
+	for(class = 0; class < NVM_CLASSES; class++)
+		nvm_partial[class] = -1;
+
+	nvm_segment_count = 0;
+	for(i = 0; i < NVM_INIT_SEGMENTS; i++)
+		registerSegment(&pheap->nvm[i]);
+
+	for(seg = pmemobj_direct(pheap->nvm[NVM_INIT_SEGMENTS - 1].next); seg != NULL;
+	                                             seg = pmemobj_direct(seg->next))
+		registerSegment(seg);
+
+	if(!create)
+		for(i = 0; i < nvm_segment_count; i++)
+			scanSegment(i);
+}
+
+/* XXX NVM CHANGE 004.001 - SysMalloc */
+void *sysMalloc_persistent(unsigned int size){
+	if (persistent){
+		unsigned int n = size == 0 ? 1 : size;
+		void *ret_addr;
+
+		if(n <= NVM_SLAB_MAX)
+			ret_addr = allocSlot(nvm_size_class[(n + NVM_SLAB_GRAIN - 1) / NVM_SLAB_GRAIN]);
+		else
+			ret_addr = allocRun(n);
+
+		/* The contents need no undo log, should the transaction
+		   abort the allocation itself is rolled back.  They are
+		   flushed when it commits */
+		n = nvmAllocSize(addrPage(ret_addr));
+		memset(ret_addr, 0, n);
+		recordBornObject(ret_addr, n);
 
 		return ret_addr;
 	}else
 		return sysMalloc(size);
 }
-// End of modification
+
+static void freeNVM(int page, void *addr) {
+	NVMPage *desc = PAGE_DESC(page);
+
+	if(desc->kind == NVM_PAGE_SLAB)
+		freeSlot(desc, page, addr);
+	else
+		freePages(page, desc->run);
+}
+
+/* Called at the outermost commit, within the transaction.  The frees
+   deferred by sysFree_persistent are made, and logged, before it ends */
+void commitNVMFrees(TxState *tx_state) {
+	int i, count = tx_state->nvm_free_count;
+
+	tx_state->nvm_free_count = 0;
+
+	for(i = 0; i < count; i++)
+		freeNVM(addrPage(tx_state->nvm_frees[i]), tx_state->nvm_frees[i]);
+}
 
 /* XXX NVM CHANGE 004.003 - SysFree */
-// JaPHa Modification
+/* Within a transaction a free is deferred to the commit.  Were the
+   memory handed out again by the same transaction its new contents,
+   which are never logged, would be left in place by an abort that
+   marks it in use once more.  An abort drops the deferred frees */
 void sysFree_persistent(void* addr) {
-    if(persistent) {
-        int err;
-        unsigned long ptr = (unsigned long) addr;
-        /*	chunk = ptr - header */
-        nvmChunk *toFree = (nvmChunk*)(ptr-nvmHeaderSize);
-        if(nvml_alloc) {
-            NVML_DIRECT("NVMFREESPACE", &(pheap->nvmFreeSpace), sizeof(pheap->nvmFreeSpace))
-        }
-        pheap->nvmFreeSpace = pheap->nvmFreeSpace + toFree->chunkSize;
-        if(nvml_alloc) {
-            NVML_DIRECT("TOFREE", toFree, toFree->chunkSize + nvmHeaderSize)
-        }
-        toFree->allocBit = 0;
-		// JAPHA: modified by Taciano on April 28 2016 to avoid compilation warning
-        //memset(ptr, 0, toFree->chunkSize);
-		memset((void*)ptr, 0, toFree->chunkSize);
-    } else {
-        sysFree(addr);
-    }
+	int page;
+
+	if(persistent && (page = addrPage(addr)) != -1) {
+		TxState *tx_state = getTxState();
+
+		if(snapshot_mode || tx_state->stage != TX_STAGE_WORK) {
+			freeNVM(page, addr);
+			return;
+		}
+
+		if(tx_state->nvm_free_count == tx_state->nvm_free_size) {
+			tx_state->nvm_free_size = tx_state->nvm_free_size ?
+			                          tx_state->nvm_free_size * 2 : 64;
+			tx_state->nvm_frees = sysRealloc(tx_state->nvm_frees,
+			                                 tx_state->nvm_free_size * sizeof(void*));
+		}
+
+		tx_state->nvm_frees[tx_state->nvm_free_count++] = addr;
+	} else {
+		sysFree(addr);
+	}
 }
-// End of modification
 
 /* XXX NVM CHANGE 004.002 - SysRealloc */
 void *sysRealloc_persistent(void *addr, unsigned int size) {
-    void *mem;
-    if (persistent) {
-        /*	chunk = ptr - header */
-        nvmChunk *toRealloc = (addr-nvmHeaderSize);
-        mem = sysMalloc_persistent(size);
-    if (addr != NULL) {
-        if ((toRealloc->chunkSize <= size)) {
-            memcpy(mem, ((void*)toRealloc+nvmHeaderSize), toRealloc->chunkSize);
-        } else {
-            memcpy(mem, ((void*)toRealloc+nvmHeaderSize), size);
-        }
-        sysFree_persistent(addr);
-    }
-    return mem;
-    } else {
-        return sysRealloc(addr, size);
-    }
+	void *mem;
+
+	if(persistent) {
+		mem = sysMalloc_persistent(size);
+		if(addr != NULL) {
+			unsigned int old_size = nvmAllocSize(addrPage(addr));
+
+			memcpy(mem, addr, old_size < size ? old_size : size);
+			sysFree_persistent(addr);
+		}
+		return mem;
+	} else {
+		return sysRealloc(addr, size);
+	}
 }
+// End of modification
 
 void *sysMalloc(unsigned int size) {
     unsigned int n = size < sizeof(void*) ? sizeof(void*) : size;
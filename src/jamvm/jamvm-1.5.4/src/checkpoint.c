@@ -0,0 +1,498 @@
+/*
+ * Copyright (C) 2003, 2004, 2005, 2006, 2007, 2008, 2009
+ * Robert Lougher <rob@jamvm.org.uk>.
+ *
+ * This file is part of JamVM.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+// JaPHa Modification
+/* Checkpoints of the running program.
+
+   On SIGUSR2 the program's threads are brought to a safepoint, their
+   Java stacks are saved into the pool and the VM exits.  On the next
+   start the saved threads are started again, each carrying on from
+   where it was stopped, instead of main being run from the beginning.
+
+   A thread is saved while it is running its root method (Thread.run,
+   or main) within a single activation of the interpreter -- there is
+   no native code on its stack that would have to be re-entered.  It
+   must be stopped in one of two places:
+
+   - at an invoke, where the persistent interpreter polls for a pending
+     checkpoint.  The thread must hold no monitors, so it isn't inside
+     a failure-atomic section whose stores would be rolled back.
+
+   - blocked in a native (Object.wait, Thread.sleep, LockSupport.park)
+     with no wake-up pending.  The only monitor it may hold is the one
+     it is waiting on, which is re-entered on resume.
+
+   Either way the innermost frame is saved with the invoke as its pc,
+   and on resume the invoke is run again.  To the program a blocked
+   call which is made again looks like a spurious wake-up.
+
+   Frames are saved as the method and the offset of the invoke within
+   its prepared code, which is persistent and linked again on restart.
+   The slots are saved as they are and are scanned conservatively by
+   the GC until the threads have been resumed.  References to young
+   objects can't be saved, and refuse the checkpoint.  Should a thread
+   not reach a safepoint within the timeout the checkpoint is refused
+   and the program carries on. */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "jam.h"
+#include "thread.h"
+#include "lock.h"
+#include "frame.h"
+#include "excep.h"
+
+/* Trace checkpoints */
+#ifdef TRACECHECKPOINT
+#define TRACE_CHECKPOINT(fmt, ...) jam_printf(fmt, ## __VA_ARGS__)
+#else
+#define TRACE_CHECKPOINT(fmt, ...)
+#endif
+
+/* How long the threads are given to reach a safepoint,
+   and how often they're checked, in milliseconds */
+#define CHECKPOINT_TIMEOUT  5000
+#define CHECKPOINT_INTERVAL 10
+
+/* saveThreads results other than a size */
+#define NOT_STOPPED -1
+#define YOUNG_REF   -2
+
+volatile int checkpoint_requested = FALSE;
+
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t checkpoint_cv = PTHREAD_COND_INITIALIZER;
+
+/* The image being resumed, and the number of its threads
+   which have yet to rebuild their stacks */
+static SavedThread *resuming;
+static int resume_pending;
+
+/* Whether the Java frames from frame down belong to a single
+   activation of the interpreter, started by the VM on the
+   thread's bottom frame */
+
+static int singleActivation(Frame *frame) {
+    while(frame->mb != NULL && frame->prev != NULL)
+        frame = frame->prev;
+
+    return frame->mb == NULL && frame->prev->prev == NULL;
+}
+
+/* Called by the persistent interpreter at an invoke while a checkpoint
+   is pending.  A thread which can be saved waits here until the
+   checkpoint is refused (if it's taken, the VM exits).  Any other
+   thread carries on and is checked again at its next invoke */
+
+void checkpointSafepoint(ExecEnv *ee, uintptr_t *top) {
+    Thread *self = threadSelf();
+
+    if(self->root_state != ROOT_RUNNING || self->locks_held != 0 ||
+                  ee->fase_depth != 0 || !singleActivation(ee->last_frame))
+        return;
+
+    /* Stores made before the safepoint are part of the checkpoint */
+    epochSafepoint(self);
+
+    disableSuspend(self);
+    pthread_mutex_lock(&checkpoint_lock);
+
+    self->safepoint_sp = top;
+
+    while(checkpoint_requested)
+        pthread_cond_wait(&checkpoint_cv, &checkpoint_lock);
+
+    self->safepoint_sp = NULL;
+
+    pthread_mutex_unlock(&checkpoint_lock);
+    enableSuspend(self);
+}
+
+/* Finds where a thread is stopped: its innermost Java frame, and
+   the top of that frame's operand stack.  NULL if it isn't stopped
+   where it can be saved */
+
+static Frame *stoppedFrame(Thread *thread, uintptr_t **top,
+                           Object **lock_obj, int *lock_count) {
+    ExecEnv *ee = thread->ee;
+    Frame *last = ee->last_frame;
+    Monitor *mon = thread->wait_mon;
+
+    *lock_obj = NULL;
+    *lock_count = 0;
+
+    if(thread->safepoint_sp != NULL) {
+        *top = thread->safepoint_sp;
+        return last;
+    }
+
+    if(thread->root_state != ROOT_RUNNING ||
+          (thread->state != WAITING && thread->state != TIMED_WAITING))
+        return NULL;
+
+    /* A thread which has been notified, interrupted or unparked
+       would lose the wake-up */
+    if(!(mon != NULL && thread->wait_next != NULL) &&
+                        thread->park_state != PARK_BLOCKED)
+        return NULL;
+
+    if(last->mb == NULL || !(last->mb->access_flags & ACC_NATIVE) ||
+           last->prev->mb == NULL || !singleActivation(last->prev))
+        return NULL;
+
+    /* Thread.sleep waits on a monitor which isn't an object's */
+    if(mon != NULL && mon->obj != NULL) {
+        *lock_obj = mon->obj;
+        *lock_count = thread->wait_lock_count;
+    }
+
+    if(thread->locks_held != *lock_count || ee->fase_depth != *lock_count)
+        return NULL;
+
+    /* The native's arguments are the top of its caller's stack */
+    *top = last->lvars + last->mb->args_count;
+    return last->prev;
+}
+
+static int youngSlots(uintptr_t *slot, int count) {
+    for(; count > 0; count--, slot++)
+        if(isYoungRef((void*)*slot))
+            return TRUE;
+
+    return FALSE;
+}
+
+/* Walks the threads to be saved, saving them into the image if one
+   is given.  Returns the size of the image, or NOT_STOPPED if a thread
+   isn't stopped where it can be saved (it may get there yet) or
+   YOUNG_REF if one refers to a young object (the object will stay
+   young, as the stack is a conservative root) */
+
+static int saveThreads(Thread *self, char *image, int *count) {
+    SavedThread *saved = NULL;
+    Thread *thread;
+    int size = 0;
+
+    *count = 0;
+
+    for(thread = mainThread(); thread != NULL; thread = thread->next) {
+        int frames = 0, slots = 0, lock_count;
+        uintptr_t *top, *slot;
+        Object *lock_obj;
+        Frame *frame, *last;
+        SavedFrame *sf;
+
+        if(thread == self || thread->root_state == ROOT_NONE ||
+                             thread->root_state == ROOT_DONE)
+            continue;
+
+        if((frame = stoppedFrame(thread, &top, &lock_obj,
+                                 &lock_count)) == NULL)
+            return NOT_STOPPED;
+
+        if(isYoungRef(thread->ee->thread) || isYoungRef(lock_obj))
+            return YOUNG_REF;
+
+        /* Each frame's operand stack ends where its callee's locals
+           begin, the arguments being saved as the callee's locals */
+        for(last = frame, slot = top; last->mb != NULL;
+                          slot = last->lvars, last = last->prev) {
+            int depth = slot - last->ostack;
+
+            if(youngSlots(last->lvars, last->mb->max_locals) ||
+                      youngSlots(last->ostack, depth))
+                return YOUNG_REF;
+
+            slots += last->mb->max_locals + depth;
+            frames++;
+        }
+
+        if(image != NULL) {
+            if(saved != NULL)
+                saved->next = (SavedThread*)(image + size);
+
+            saved = (SavedThread*)(image + size);
+            saved->thread = thread->ee->thread;
+            saved->lock_obj = lock_obj;
+            saved->lock_count = lock_count;
+            saved->stack_size = thread->ee->stack_size;
+            saved->frames = frames;
+            saved->slots = slots;
+            saved->next = NULL;
+
+            /* The frames are walked innermost first, so
+               the image is filled in from the end */
+            sf = &saved->frame[frames];
+            slot = (uintptr_t*)sf + slots;
+
+            for(last = frame; last->mb != NULL;
+                              top = last->lvars, last = last->prev) {
+                MethodBlock *mb = last->mb;
+                int depth = top - last->ostack;
+
+                sf--;
+                sf->mb = mb;
+                sf->pc = last->last_pc - (CodePntr)mb->code;
+                sf->depth = depth;
+
+                slot -= depth;
+                memcpy(slot, last->ostack, depth * sizeof(uintptr_t));
+                slot -= mb->max_locals;
+                memcpy(slot, last->lvars, mb->max_locals * sizeof(uintptr_t));
+            }
+        }
+
+        size += sizeof(SavedThread) + frames * sizeof(SavedFrame) +
+                slots * sizeof(uintptr_t);
+        (*count)++;
+    }
+
+    return size;
+}
+
+static void refuseCheckpoint(char *reason) {
+    jam_printf("<Checkpoint refused: %s>\n", reason);
+
+    pthread_mutex_lock(&checkpoint_lock);
+    checkpoint_requested = FALSE;
+    pthread_cond_broadcast(&checkpoint_cv);
+    pthread_mutex_unlock(&checkpoint_lock);
+}
+
+/* Run by the signal handler thread.  The world is stopped as for a
+   collection each time the threads are checked, and stays stopped
+   from when they are found stopped until the VM exits */
+
+void checkpointVM(Thread *self) {
+    int waited, size, count;
+    char *image;
+
+    if(!persistent) {
+        jam_printf("<Checkpoint refused: the heap isn't persistent>\n");
+        return;
+    }
+
+    checkpoint_requested = TRUE;
+
+    for(waited = 0; ; waited += CHECKPOINT_INTERVAL) {
+        stopTheWorld(self);
+
+        if((size = saveThreads(self, NULL, &count)) != NOT_STOPPED)
+            break;
+
+        restartTheWorld(self);
+
+        if(waited >= CHECKPOINT_TIMEOUT) {
+            refuseCheckpoint("threads didn't reach a safepoint");
+            return;
+        }
+
+        threadSleep(self, CHECKPOINT_INTERVAL, 0);
+    }
+
+    if(size == YOUNG_REF || count == 0) {
+        restartTheWorld(self);
+        refuseCheckpoint(count ? "a stack refers to a young object"
+                               : "no threads to save");
+        return;
+    }
+
+    TRACE_CHECKPOINT("<Checkpoint: saving %d thread(s), %d bytes>\n",
+                     count, size);
+
+    publishAllTransient();
+
+    BEGIN_TX("CHECKPOINT")
+
+    image = sysMalloc_persistent(size);
+    saveThreads(self, image, &count);
+
+    NVML_DIRECT("CHECKPOINT", &pheap->checkpoint, sizeof(SavedThread*))
+    pheap->checkpoint = (SavedThread*)image;
+
+    END_TX("CHECKPOINT")
+
+    /* In snapshot mode the image is only durable once the pool is,
+       which the shutdown may not do if a thread is waiting */
+    persistSnapshotHeap();
+
+    jam_printf("<Checkpoint: saved %d thread(s)>\n", count);
+
+    /* The other threads are left stopped */
+    shutdownPersistentHeap();
+    jamvm_exit(0);
+}
+
+/* The saved slots are roots until every thread has rebuilt its stack */
+
+void scanCheckpoint() {
+    SavedThread *saved;
+    int i;
+
+    if(!persistent)
+        return;
+
+    saved = resuming != NULL ? resuming : pheap->checkpoint;
+
+    for(; saved != NULL; saved = saved->next) {
+        uintptr_t *slots = (uintptr_t*)&saved->frame[saved->frames];
+
+        markConservativeRoot(saved->thread);
+        markConservativeRoot(saved->lock_obj);
+
+        for(i = 0; i < saved->frames; i++)
+            markConservativeRoot((Object*)saved->frame[i].mb->class);
+
+        markSavedSlots(slots, slots + saved->slots);
+    }
+}
+
+static void resumeDone() {
+    pthread_mutex_lock(&checkpoint_lock);
+
+    if(--resume_pending == 0) {
+        SavedThread *image = resuming;
+
+        resuming = NULL;
+
+        BEGIN_TX("CHECKPOINT")
+        sysFree_persistent(image);
+        END_TX("CHECKPOINT")
+
+        TRACE_CHECKPOINT("<Checkpoint: all threads resumed>\n");
+    }
+
+    pthread_mutex_unlock(&checkpoint_lock);
+}
+
+/* Called on the main thread in place of running main.  The image is
+   detached before any thread runs, so a crash while resuming doesn't
+   resume it a second time over a heap which has moved on */
+
+int resumeCheckpoint() {
+    SavedThread *saved;
+
+    if(!persistent || pheap->checkpoint == NULL)
+        return FALSE;
+
+    resuming = pheap->checkpoint;
+
+    BEGIN_TX("CHECKPOINT")
+    NVML_DIRECT("CHECKPOINT", &pheap->checkpoint, sizeof(SavedThread*))
+    pheap->checkpoint = NULL;
+    END_TX("CHECKPOINT")
+
+    for(saved = resuming; saved != NULL; saved = saved->next)
+        resume_pending++;
+
+    jam_printf("<Checkpoint: resuming %d thread(s)>\n", resume_pending);
+
+    for(saved = resuming; saved != NULL; saved = saved->next) {
+        resumeJavaThread(saved);
+
+        /* The thread didn't start.  The others are resumed anyway */
+        if(exceptionOccurred()) {
+            printException();
+            resumeDone();
+        }
+    }
+
+    return TRUE;
+}
+
+/* Runs on a thread started by resumeCheckpoint.  The saved frames are
+   rebuilt above a dummy frame, as executeMethod builds the root frame,
+   and the interpreter carries on with the innermost one */
+
+void resumeJavaStack(SavedThread *saved) {
+    ExecEnv *ee = getExecEnv();
+    Frame *last = ee->last_frame;
+    Frame *dummy = (Frame *)(last->ostack + last->mb->max_stack);
+    uintptr_t *slot = (uintptr_t*)&saved->frame[saved->frames];
+    uintptr_t *sp = (uintptr_t*)(dummy + 1);
+    MethodBlock *root = saved->frame[0].mb;
+    Object *lock_obj = saved->lock_obj;
+    int lock_count = saved->lock_count;
+    Object *sync_ob;
+    Frame *frame;
+    int i;
+
+    dummy->mb = NULL;
+    dummy->ostack = sp;
+    dummy->prev = last;
+
+    for(frame = dummy, i = 0; i < saved->frames; i++) {
+        SavedFrame *sf = &saved->frame[i];
+        MethodBlock *mb = sf->mb;
+        Frame *new_frame = (Frame *)(sp + mb->max_locals);
+        uintptr_t *ostack = ALIGN_OSTACK(new_frame + 1);
+
+        if((char*)(ostack + mb->max_stack) > ee->stack_end) {
+            resumeDone();
+            signalException(java_lang_StackOverflowError, NULL);
+            return;
+        }
+
+        memcpy(sp, slot, mb->max_locals * sizeof(uintptr_t));
+        slot += mb->max_locals;
+        memcpy(ostack, slot, sf->depth * sizeof(uintptr_t));
+        slot += sf->depth;
+
+        new_frame->mb = mb;
+        new_frame->lvars = sp;
+        new_frame->ostack = ostack;
+        new_frame->prev = frame;
+
+        /* Made a pointer once the method is linked (see executeJava) */
+        new_frame->last_pc = (CodePntr)sf->pc;
+
+        frame = new_frame;
+        sp = ostack + sf->depth;
+    }
+
+    /* The root frame's locals start just above the dummy frame */
+    sync_ob = root->access_flags & ACC_STATIC ? (Object*)root->class
+                                              : (Object*)*(uintptr_t*)(dummy + 1);
+
+    ee->resume_ostack = sp;
+    ee->last_frame = frame;
+    ee->resume = NULL;
+
+    resumeDone();
+
+    TRACE_CHECKPOINT("<Checkpoint: resuming %s.%s>\n",
+                     CLASS_CB(frame->mb->class)->name, frame->mb->name);
+
+    /* Take back the monitor the thread was waiting on */
+    for(i = 0; i < lock_count; i++)
+        faseLock(lock_obj);
+
+    EXECUTE_JAVA();
+
+    /* As executeMethod does for the root method */
+    if(root->access_flags & ACC_SYNCHRONIZED)
+        faseUnlock(sync_ob);
+
+    POP_TOP_FRAME(ee);
+}
+// End of modification
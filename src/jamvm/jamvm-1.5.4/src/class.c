@@ -1770,8 +1770,23 @@ void freeClassData(Class *class) {
 #endif
             gcPendingFree(mb->code);
         } else
-            if(!(mb->access_flags & ACC_ABSTRACT))
+            // JaPHa Modification
+            /* Or prepared by a previous run (see unlinkClassCode) */
+            if(!(mb->access_flags & ACC_ABSTRACT) || mb->code_ops != NULL)
+            // End of modification
                 gcPendingFree((void*)((uintptr_t)mb->code & ~3));
+
+        // JaPHa Modification
+        gcPendingFree(mb->code_ops);
+#ifdef INLINING
+        while(mb->wrapped != NULL) {
+            PrepareInfo *info = mb->wrapped;
+
+            mb->wrapped = info->next;
+            gcPendingFree(info);
+        }
+#endif
+        // End of modification
 #else
         if(!(mb->access_flags & ACC_ABSTRACT))
             gcPendingFree(mb->code);
@@ -2107,6 +2122,20 @@ void initialiseClass(InitArgs *args) {
     }
     ldr_data_tbl_offset = hashtable->u.offset;
 
+    // JaPHa Modification
+    /* The class table is held in a long field, which relocation
+       finds from these (see relocateObject) */
+    if(persistent) {
+        OPC *ph_value = get_opc_ptr();
+
+        NVML_DIRECT("PHVALUES", &ph_value->loader_data_class,
+                    sizeof(Class*))
+        ph_value->loader_data_class = loader_data_class;
+        NVML_DIRECT("PHVALUES", &ph_value->ldr_data_tbl_offset, sizeof(int))
+        ph_value->ldr_data_tbl_offset = ldr_data_tbl_offset;
+    }
+    // End of modification
+
     vm_loader_class = findSystemClass0(SYMBOL(java_lang_VMClassLoader));
     if(vm_loader_class != NULL)
        vm_loader_create_package =
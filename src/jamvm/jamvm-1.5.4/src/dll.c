@@ -481,6 +481,12 @@ uintptr_t *callJNIWrapper(Class *class, MethodBlock *mb, uintptr_t *ostack) {
     if(!initJNILrefs())
         return NULL;
 
+    // JaPHa Modification
+    /* The native may block indefinitely (e.g. in I/O) */
+    if(epoch_limit)
+        commitEpoch(getExecEnv());
+    // End of modification
+
     return callJNIMethod(&env, (mb->access_flags & ACC_STATIC) ? class : NULL,
                          mb->type, mb->native_extra_arg, ostack, mb->code,
                          mb->args_count);
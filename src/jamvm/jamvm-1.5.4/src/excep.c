@@ -208,7 +208,7 @@ CodePntr findCatchBlock(Class *exception) {
         if(frame->mb->access_flags & ACC_SYNCHRONIZED) {
             Object *sync_ob = frame->mb->access_flags & ACC_STATIC ?
                     (Object*)frame->mb->class : (Object*)frame->lvars[0];
-            objectUnlock(sync_ob);
+            faseUnlock(sync_ob);
         }
         frame = frame->prev;
     }
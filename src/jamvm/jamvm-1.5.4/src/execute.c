@@ -121,15 +121,15 @@ void *executeMethodVaList(Object *ob, Class *class, MethodBlock *mb,
     SCAN_SIG(sig, VA_DOUBLE(jargs, sp), VA_SINGLE(jargs, sp))
 
     if(mb->access_flags & ACC_SYNCHRONIZED)
-        objectLock(ob ? ob : mb->class);
+        faseLock(ob ? ob : mb->class);
 
     if(mb->access_flags & ACC_NATIVE)
         (*mb->native_invoker)(class, mb, ret);
     else
-        executeJava();
+        EXECUTE_JAVA();
 
     if(mb->access_flags & ACC_SYNCHRONIZED)
-        objectUnlock(ob ? ob : mb->class);
+        faseUnlock(ob ? ob : mb->class);
 
     POP_TOP_FRAME(ee);
 
@@ -153,15 +153,15 @@ void *executeMethodList(Object *ob, Class *class, MethodBlock *mb, u8 *jargs) {
     SCAN_SIG(sig, JA_DOUBLE(jargs, sp), JA_SINGLE(jargs, sp))
 
     if(mb->access_flags & ACC_SYNCHRONIZED)
-        objectLock(ob ? ob : mb->class);
+        faseLock(ob ? ob : mb->class);
 
     if(mb->access_flags & ACC_NATIVE)
         (*mb->native_invoker)(class, mb, ret);
     else
-        executeJava();
+        EXECUTE_JAVA();
 
     if(mb->access_flags & ACC_SYNCHRONIZED)
-        objectUnlock(ob ? ob : mb->class);
+        faseUnlock(ob ? ob : mb->class);
 
     POP_TOP_FRAME(ee);
 
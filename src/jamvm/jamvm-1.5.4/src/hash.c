@@ -21,6 +21,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include "jam.h"
 #include "hash.h"
 
@@ -38,22 +39,14 @@ void unlockHashTable0(HashTable *table, Thread *self) {
     unlockVMLock(table->lock, self);
 }
 
-/* XXX NVM CHANGE 006.002 - Resize Hash */
-void resizeHash(HashTable *table, int new_size, char* name , int create_file) {
-	// FIXME: resize implementation is messed up --- need to rethink and refactor it
-//	if (strcmp(HT_NAME_ZIP, name) != 0) {
-		printf("WARNING: resizeHash on %s being invoked, if this is a persistent HT, there is trouble ahead.\n", name);
-//	}
-    /* XXX NVM CHANGE 005.001.011 - Resize Hash*/
-    HashEntry *new_table = (HashEntry*)gcMemMalloc(sizeof(HashEntry)*new_size, name, create_file);
+static void rehash(HashEntry *old_table, int old_size,
+                   HashEntry *new_table, int new_size) {
     int i;
 
-    memset(new_table, 0, sizeof(HashEntry)*new_size);
-
-    for(i = table->hash_size-1; i >= 0; i--) {
-        void *ptr = table->hash_table[i].data;
+    for(i = old_size-1; i >= 0; i--) {
+        void *ptr = old_table[i].data;
         if(ptr != NULL) {
-            int hash = table->hash_table[i].hash;
+            int hash = old_table[i].hash;
             int new_index = hash & (new_size - 1);
 
             while(new_table[new_index].data != NULL)
@@ -63,6 +56,104 @@ void resizeHash(HashTable *table, int new_size, char* name , int create_file) {
             new_table[new_index].data = ptr;
         }
     }
+}
+
+// JaPHa Modification
+/* The persistent tables start out in fixed arrays within the pheap
+   (see gcMemMalloc).  Once resized their entries live in the NVM
+   region, and the table's descriptor in the pheap records where.
+   Class loader tables have no descriptor -- the HashTable itself is
+   allocated in the NVM region */
+static char *desc_names[HT_DESC_COUNT] = {
+    HT_NAME_UTF8, HT_NAME_BOOT, HT_NAME_BOOTPKG, HT_NAME_STRING, HT_NAME_MONITOR
+};
+
+PHashDesc *persistentHashDesc(char *name) {
+    int i;
+
+    for(i = 0; i < HT_DESC_COUNT; i++)
+        if(strcmp(name, desc_names[i]) == 0)
+            return &pheap->ht_descs[i];
+
+    return NULL;
+}
+
+/* Within the pheap, or a segment the NVM region has grown by */
+#define IN_PHEAP(addr) (((char*)(addr) >= (char*)pheap && \
+                         (char*)(addr) < (char*)(pheap + 1)) || \
+                        inNVMRegion(addr))
+
+#define IS_INITIAL_ARRAY(addr) ((char*)(addr) >= (char*)pheap->utf8_ht && \
+                                (char*)(addr) < (char*)pheap->nvm)
+
+/* Called by initHashTable, after the table has been given its
+   initial array */
+void restoreHashTable(HashTable *table, char *name) {
+    PHashDesc *desc;
+
+    if(persistent && (desc = persistentHashDesc(name)) != NULL &&
+                     desc->entries != NULL) {
+        table->hash_table = desc->entries;
+        table->hash_size = desc->size;
+    }
+}
+
+/* Persistent tables are resized double-buffered.  The entries are
+   rehashed into a new array which is made durable before the table
+   is swung over to it.  The allocation, the swing and the freeing of
+   the old array are one transaction, so after a crash the table is
+   either wholly the old or wholly the new one */
+static void resizePersistentHash(HashTable *table, int new_size, char *name) {
+    PHashDesc *desc = persistentHashDesc(name);
+    HashEntry *old_table = table->hash_table;
+    HashEntry *new_table;
+    int was_nvml_alloc = nvml_alloc;
+
+    BEGIN_TX("RESIZEHASH")
+    nvml_alloc = TRUE;
+
+    /* The new array is zeroed by sysMalloc_persistent */
+    new_table = sysMalloc_persistent(sizeof(HashEntry)*new_size);
+    rehash(old_table, table->hash_size, new_table, new_size);
+    pmemobj_persist(pop_heap, new_table, sizeof(HashEntry)*new_size);
+
+    if(desc != NULL) {
+        NVML_DIRECT("HASHDESC", desc, sizeof(PHashDesc))
+        desc->entries = new_table;
+        desc->size = new_size;
+    }
+
+    /* Only the entries and size, the lock is volatile */
+    if(IN_PHEAP(table))
+        NVML_DIRECT("HASHTABLE", table, offsetof(HashTable, hash_count))
+
+    table->hash_table = new_table;
+    table->hash_size = new_size;
+
+    if(!IS_INITIAL_ARRAY(old_table))
+        sysFree_persistent(old_table);
+
+    nvml_alloc = was_nvml_alloc;
+    END_TX("RESIZEHASH")
+}
+// End of modification
+
+/* XXX NVM CHANGE 006.002 - Resize Hash */
+void resizeHash(HashTable *table, int new_size, char* name , int create_file) {
+    HashEntry *new_table;
+
+    // JaPHa Modification
+    if(persistent && create_file) {
+        resizePersistentHash(table, new_size, name);
+        return;
+    }
+    // End of modification
+
+    /* XXX NVM CHANGE 005.001.011 - Resize Hash*/
+    new_table = (HashEntry*)gcMemMalloc(sizeof(HashEntry)*new_size, name, create_file);
+    memset(new_table, 0, sizeof(HashEntry)*new_size);
+
+    rehash(table->hash_table, table->hash_size, new_table, new_size);
 
     gcMemFree(table->hash_table);
     table->hash_table = new_table;
@@ -36,6 +36,8 @@ typedef struct hash_table {
  * Changed functions args
  */
 extern void resizeHash(HashTable *table, int new_size, char* name, int create_file);
+extern void restoreHashTable(HashTable *table, char *name);
+extern PHashDesc *persistentHashDesc(char *name);
 extern void lockHashTable0(HashTable *table, Thread *self);
 extern void unlockHashTable0(HashTable *table, Thread *self);
 
@@ -48,6 +50,8 @@ extern void unlockHashTable0(HashTable *table, Thread *self);
     table.hash_table = (HashEntry*)gcMemMalloc(sizeof(HashEntry)*initial_size, name, create_file);    \
     table.hash_size = initial_size;                                                \
     table.hash_count = 0;                                                          \
+    if(create_file)                                                                \
+        restoreHashTable(&table, name);                                            \
     if(create_lock)                                                                \
         initVMLock(table.lock);                                                    \
 }
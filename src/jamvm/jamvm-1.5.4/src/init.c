@@ -49,6 +49,18 @@ void setDefaultInitArgs(InitArgs *args) {
 
     args->props_count = 0;
 
+    // JaPHa Modification
+    args->epoch_stores = 0;
+    args->epoch_time   = 100;
+    args->persist_reachable = TRUE;
+    args->nursery_size = 0;
+    args->prefault = PREFAULT_NONE;
+    args->snapshot_interval = 0;
+    args->wal_interval = 0;
+    args->nvm_write_latency = args->nvm_write_bandwidth = 0;
+    args->nvm_read_latency = args->nvm_read_bandwidth = 0;
+    // End of modification
+
     args->vfprintf = vfprintf;
     args->abort    = abort;
     args->exit     = exit;
@@ -84,11 +96,15 @@ void initVM(InitArgs *args) {
 
     initialiseHooks(args);
     initialiseProperties(args);
+    initialiseNVMEmulation(args);
     initialiseAlloc(args);
     initialiseUtf8(args);
     initialiseThreadStage1(args);
     initialiseSymbol();
     initialiseClass(args);
+    // JaPHa Modification
+    scrubYoungReferences();
+    // End of modification
     initialiseMonitor(args);
     initialiseString(args);
     initialiseException();
@@ -101,6 +117,8 @@ void initVM(InitArgs *args) {
 
     END_TX("INITVM")
     nvml_alloc = VM_initing = FALSE;
+
+    initialisePersistence(args);
     // End of modification
 }
 
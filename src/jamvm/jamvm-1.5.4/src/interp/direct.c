@@ -55,6 +55,11 @@
 #define UNPREPARED 1
 #define PREPARING  2
 
+// JaPHa Modification
+/* Prepared by a previous run of the VM (see unlinkClassCode) */
+#define UNLINKED   3
+// End of modification
+
 /* Global lock for method preparation */
 static VMWaitLock prepare_lock;
 
@@ -71,6 +76,289 @@ void initialiseDirect(InitArgs *args) {
     initVMWaitLock(prepare_lock);
 }
 
+// JaPHa Modification
+/* Prepared code is kept in the persistent heap, but its handler
+   addresses are only valid for the run which wrote them.  With each
+   instruction the index of its handler is kept (mb->code_ops), and
+   updated as the instruction is quickened, so on reopening the pool
+   the code is relinked to the handlers of the current run rather
+   than prepared again.  The operands, including the quickened
+   resolution state, are persistent as they are.
+
+   The inlined blocks and the profiling state are volatile.  An
+   instruction wrapped by the inline rewriter has its operand kept
+   on a persistent list until it is unwrapped, so relinking unwraps
+   it and the method runs direct-threaded from its quickened code.
+   The basic blocks are marked in the handler indices, and are set
+   up for the rewriter again as prepare would, so the method is
+   profiled and inlined as before */
+
+#ifdef INLINING
+/* Instructions which are rewritten when first run */
+static int unquickened(int opcode) {
+    switch(opcode) {
+        case OPC_LDC: case OPC_GETSTATIC: case OPC_PUTSTATIC:
+        case OPC_GETFIELD: case OPC_PUTFIELD: case OPC_INVOKEVIRTUAL:
+        case OPC_INVOKESPECIAL: case OPC_INVOKESTATIC:
+        case OPC_INVOKEINTERFACE: case OPC_CHECKCAST: case OPC_INSTANCEOF:
+        case OPC_NEW: case OPC_ANEWARRAY: case OPC_MULTIANEWARRAY:
+            return TRUE;
+
+        default:
+            return FALSE;
+    }
+}
+
+/* A block ending in an instruction still to be quickened is inlined
+   once it is, any other is wrapped by the inline rewriter.  The entry
+   is durable before the operand is overwritten */
+static void relinkBlock(MethodBlock *mb, Instruction *code, BasicBlock *block,
+                        int ins_start, int ins_end, const void ***handlers) {
+    int index = mb->code_ops[ins_end];
+    int i;
+
+    block->u.profile.profiled = NULL;
+    block->u.profile.quickened = FALSE;
+    block->length = ins_end - ins_start + 1;
+    block->start = &code[ins_start];
+    block->opcodes = sysMalloc(block->length * sizeof(OpcodeInfo));
+
+    for(i = 0; i < block->length; i++) {
+        int ins_index = mb->code_ops[ins_start + i];
+
+        block->opcodes[i].opcode = INDEX_OPCODE(ins_index);
+        block->opcodes[i].cache_depth = INDEX_CACHE(ins_index);
+
+        if(unquickened(INDEX_OPCODE(ins_index)))
+            block->u.profile.quickened = TRUE;
+    }
+
+    if(unquickened(INDEX_OPCODE(index))) {
+        QuickPrepareInfo *prepare_info = sysMalloc(sizeof(QuickPrepareInfo));
+
+        prepare_info->quickened = &code[ins_end];
+        prepare_info->block = block;
+        prepare_info->next = mb->quick_prepare_info;
+        mb->quick_prepare_info = prepare_info;
+    } else {
+        PrepareInfo *prepare_info = sysMalloc_persistent(sizeof(PrepareInfo));
+
+        prepare_info->block = block;
+        prepare_info->operand = code[ins_end].operand;
+        prepare_info->ins = &code[ins_end];
+        prepare_info->next = mb->wrapped;
+        pmemobj_persist(pop_heap, prepare_info, sizeof(PrepareInfo));
+
+        mb->wrapped = prepare_info;
+        pmemobj_persist(pop_heap, &mb->wrapped, sizeof(PrepareInfo*));
+
+        code[ins_end].operand.pntr = prepare_info;
+        code[ins_end].handler = handlers[INDEX_CACHE(index)]
+                                        [OPC_INLINE_REWRITER];
+    }
+}
+#endif
+
+static void relinkMethod(MethodBlock *mb, Instruction *code,
+                         const void ***handlers) {
+#ifdef INLINING
+    BasicBlock *block = NULL, *last_block = NULL;
+    int ins_start = 0;
+#endif
+    int i;
+
+    for(i = 0; i < mb->code_size; i++) {
+        int index = mb->code_ops[i];
+        code[i].handler = handlers[INDEX_CACHE(index)][INDEX_OPCODE(index)];
+    }
+
+#ifdef INLINING
+    /* Each operand is durable before its entry is dropped, so
+       an interrupted relink is simply done again */
+    while(mb->wrapped != NULL) {
+        PrepareInfo *info = mb->wrapped;
+
+        info->ins->operand = info->operand;
+        pmemobj_persist(pop_heap, &info->ins->operand, sizeof(Operand));
+
+        mb->wrapped = info->next;
+        pmemobj_persist(pop_heap, &mb->wrapped, sizeof(PrepareInfo*));
+        sysFree_persistent(info);
+    }
+
+    mb->quick_prepare_info = NULL;
+    mb->profile_info = NULL;
+
+    if(!inlining_enabled || mb->name == SYMBOL(class_init))
+        return;
+
+    for(i = 0; i < mb->code_size; i++) {
+        int index = mb->code_ops[i];
+
+        if(index & INDEX_BLOCK_START) {
+            block = sysMalloc(sizeof(BasicBlock));
+            block->next = NULL;
+
+            if((block->prev = index & INDEX_BLOCK_JOIN ? last_block
+                                                        : NULL) != NULL)
+                last_block->next = block;
+
+            ins_start = i;
+        }
+
+        if(block != NULL && index & INDEX_BLOCK_END) {
+            relinkBlock(mb, code, block, ins_start, i, handlers);
+            last_block = block;
+            block = NULL;
+        }
+    }
+#endif
+}
+
+/* Called for each class in the heap when a pool is reopened.  The
+   methods are relinked lazily, by prepare, as they are first run */
+void unlinkClassCode(Class *class) {
+    ClassBlock *cb = CLASS_CB(class);
+    int i;
+
+    for(i = 0; i < cb->methods_count; i++) {
+        MethodBlock *mb = &cb->methods[i];
+
+        if(mb->code_ops != NULL && ((uintptr_t)mb->code & 0x3) == PREPARED)
+            mb->code = (char*)mb->code + UNLINKED;
+    }
+}
+
+/* Relocates the pointers within a method's prepared code as the pool
+   is opened at a new address (see relocateHeap).  Whether an operand
+   is a pointer is told by its instruction's handler index.  A wrapped
+   instruction's operand is written back from its entry as the method
+   is relinked, so only the entry's copy is relocated */
+static void relocateOperand(int index, Operand *operand,
+                            void (*relocate)(void *slot)) {
+    int opcode = INDEX_OPCODE(index);
+    int i;
+
+    switch(opcode) {
+        case OPC_TABLESWITCH: {
+            SwitchTable *table;
+
+            (*relocate)(&operand->pntr);
+            table = operand->pntr;
+            (*relocate)(&table->deflt);
+            (*relocate)(&table->entries);
+
+            for(i = 0; i <= table->high - table->low; i++)
+                (*relocate)(&table->entries[i]);
+            break;
+        }
+
+        case OPC_LOOKUPSWITCH: {
+            LookupTable *table;
+
+            (*relocate)(&operand->pntr);
+            table = operand->pntr;
+            (*relocate)(&table->deflt);
+            (*relocate)(&table->entries);
+
+            for(i = 0; i < table->num_entries; i++)
+                (*relocate)(&table->entries[i].handler);
+            break;
+        }
+
+        case OPC_GOTO: case OPC_JSR: case OPC_GOTO_W: case OPC_JSR_W:
+        case OPC_IFNULL: case OPC_IFNONNULL:
+        case OPC_GETSTATIC_QUICK: case OPC_GETSTATIC2_QUICK:
+        case OPC_GETSTATIC_QUICK_REF: case OPC_PUTSTATIC_QUICK:
+        case OPC_PUTSTATIC2_QUICK: case OPC_PUTSTATIC_QUICK_REF:
+        case OPC_INVOKENONVIRTUAL_QUICK: case OPC_INVOKESTATIC_QUICK:
+            (*relocate)(&operand->pntr);
+            break;
+
+        default:
+            if(opcode >= OPC_IFEQ && opcode <= OPC_IF_ACMPNE)
+                (*relocate)(&operand->pntr);
+            break;
+    }
+}
+
+void relocateMethodCode(MethodBlock *mb, void (*relocate)(void *slot)) {
+    uintptr_t state = (uintptr_t)mb->code & 0x3;
+    Instruction *code = (Instruction*)((uintptr_t)mb->code & ~0x3);
+    char *wrapped = NULL;
+    int i;
+
+    (*relocate)(&mb->code_ops);
+
+    if(mb->code_ops == NULL || (state != PREPARED && state != UNLINKED))
+        return;
+
+#ifdef INLINING
+    (*relocate)(&mb->wrapped);
+
+    if(mb->wrapped != NULL) {
+        PrepareInfo *info;
+
+        wrapped = sysMalloc(mb->code_size);
+        memset(wrapped, 0, mb->code_size);
+
+        for(info = mb->wrapped; info != NULL; info = info->next) {
+            int ins;
+
+            (*relocate)(&info->ins);
+            (*relocate)(&info->next);
+
+            ins = info->ins - code;
+            relocateOperand(mb->code_ops[ins], &info->operand, relocate);
+            wrapped[ins] = TRUE;
+        }
+    }
+#endif
+
+    for(i = 0; i < mb->code_size; i++)
+        if(wrapped == NULL || !wrapped[i])
+            relocateOperand(mb->code_ops[i], &code[i].operand, relocate);
+
+    sysFree(wrapped);
+}
+
+#ifdef INLINING
+/* Called by the inline rewriter as it unwraps an instruction, once
+   the operand is restored but before the instruction can run.  Left
+   on the list, relinking would write the operand back over the one
+   it may be quickened to.  The operand is durable before the entry
+   is dropped.  The caller frees the entry when done with it */
+void unwrapPersistent(MethodBlock *mb, PrepareInfo *info) {
+    PrepareInfo **link;
+
+    pmemobj_persist(pop_heap, &info->ins->operand, sizeof(Operand));
+
+    for(link = &mb->wrapped; *link != NULL; link = &(*link)->next)
+        if(*link == info) {
+            *link = info->next;
+            pmemobj_persist(pop_heap, link, sizeof(PrepareInfo*));
+            break;
+        }
+}
+#endif
+
+/* Quickening by the persistent interpreter.  The operand and the
+   handler index are updated atomically, so after a crash the code
+   is relinked to either the original or the quickened instruction */
+void rewritePersistent(MethodBlock *mb, Instruction *pc, int cache,
+                       int opcode, Operand operand) {
+
+    u2 *index = &mb->code_ops[pc - (Instruction*)mb->code];
+
+    BEGIN_TX("REWRITE")
+    NVML_DIRECT("REWRITE_OPERAND", &pc->operand, sizeof(Operand))
+    NVML_DIRECT("REWRITE_INDEX", index, sizeof(u2))
+    pc->operand = operand;
+    *index = HANDLER_INDEX(cache, opcode) | (*index & INDEX_BLOCK_BITS);
+    END_TX("REWRITE")
+}
+// End of modification
+
 void prepare(MethodBlock *mb, const void ***handlers) {
     int code_len = mb->code_size;
 #ifdef USE_CACHE
@@ -83,6 +371,9 @@ void prepare(MethodBlock *mb, const void ***handlers) {
     char info[code_len + 1];
 #endif
     Instruction *new_code = NULL;
+    // JaPHa Modification
+    u2 *code_ops = NULL;
+    // End of modification
     unsigned char *code;
     short map[code_len];
     int ins_count = 0;
@@ -118,6 +409,22 @@ retry:
         case PREPARING:
             waitVMWaitLock(prepare_lock, self);
             goto retry;
+
+        // JaPHa Modification
+        case UNLINKED:
+            mb->code = (void*)PREPARING;
+            unlockVMWaitLock(prepare_lock, self);
+
+            code -= UNLINKED;
+            relinkMethod(mb, (Instruction*)code, handlers);
+
+            lockVMWaitLock(prepare_lock, self);
+            mb->code = code;
+            notifyAllVMWaitLock(prepare_lock, self);
+            unlockVMWaitLock(prepare_lock, self);
+            enableSuspend(self);
+            return;
+        // End of modification
     }
 
     unlockVMWaitLock(prepare_lock, self);
@@ -154,10 +461,16 @@ retry:
         int cache = 0;
         int pc;
 
-        if(pass == 1)
+        if(pass == 1) {
             /* XXX NVM CHANGE 004.001.027 */
             new_code = sysMalloc_persistent((ins_count + 1) * sizeof(Instruction));
 
+            // JaPHa Modification
+            if(persistent)
+                code_ops = sysMalloc_persistent((ins_count + 1) * sizeof(u2));
+            // End of modification
+        }
+
         for(ins_count = 0, pc = 0; pc < code_len; ins_count++) {
             int quickened = FALSE;
             Operand operand;
@@ -837,6 +1150,10 @@ retry:
                 if(pass == 1) {
                     new_code[ins_count].handler = handlers[ins_cache][opcode];
                     new_code[ins_count].operand = operand;
+                    // JaPHa Modification
+                    if(code_ops != NULL)
+                        code_ops[ins_count] = HANDLER_INDEX(ins_cache, opcode);
+                    // End of modification
 		}
 #ifdef INLINING
                 opcodes[ins_count].opcode = opcode;
@@ -855,6 +1172,11 @@ retry:
                 opcodes[ins_count].cache_depth = ins_cache;
 #endif
             } else {
+                // JaPHa Modification
+                /* Before the inline rewriter may wrap it */
+                if(code_ops != NULL)
+                    code_ops[ins_count] = HANDLER_INDEX(ins_cache, opcode);
+                // End of modification
 #ifdef INLINING
                 block_quickened = block_quickened || quickened;
 
@@ -880,6 +1202,14 @@ retry:
                         } else {
                             PrepareInfo *prepare_info;
 
+                            // JaPHa Modification
+                            if(code_ops != NULL) {
+                                prepare_info = sysMalloc_persistent(sizeof(PrepareInfo));
+                                prepare_info->ins = &new_code[ins_count];
+                                prepare_info->next = mb->wrapped;
+                                mb->wrapped = prepare_info;
+                            } else
+                            // End of modification
                             prepare_info = sysMalloc(sizeof(PrepareInfo));
                             prepare_info->operand = operand;
                             operand.pntr = prepare_info;
@@ -894,6 +1224,14 @@ retry:
                         } else
                             block->prev = NULL;
 
+                        // JaPHa Modification
+                        if(code_ops != NULL) {
+                            code_ops[ins_start] |= INDEX_BLOCK_START |
+                                        (block->prev ? INDEX_BLOCK_JOIN : 0);
+                            code_ops[ins_count] |= INDEX_BLOCK_END;
+                        }
+                        // End of modification
+
                         block->next = NULL;
                         block->u.profile.profiled = NULL;
 
@@ -916,6 +1254,37 @@ retry:
         }
     }
 
+    // JaPHa Modification
+    /* The code can be relinked from the index once published.  The
+       index and the wrapped operands are made durable first, then
+       the tables are remapped, the code and its size published and
+       the old bytecode freed in a transaction, so after a crash the
+       method is either still unprepared or prepared with everything
+       it is relinked from */
+    if(code_ops != NULL) {
+#ifdef INLINING
+        PrepareInfo *wrapped;
+
+        for(wrapped = mb->wrapped; wrapped != NULL; wrapped = wrapped->next)
+            pmemobj_persist(pop_heap, wrapped, sizeof(PrepareInfo));
+        pmemobj_persist(pop_heap, &mb->wrapped, sizeof(PrepareInfo*));
+#endif
+        pmemobj_persist(pop_heap, new_code, ins_count * sizeof(Instruction));
+        pmemobj_persist(pop_heap, code_ops, ins_count * sizeof(u2));
+        mb->code_ops = code_ops;
+        pmemobj_persist(pop_heap, &mb->code_ops, sizeof(u2*));
+
+        BEGIN_TX("PREPARE")
+
+        if(mb->line_no_table_size > 0)
+            NVML_DIRECT("PREPARE", mb->line_no_table,
+                        mb->line_no_table_size * sizeof(LineNoTableEntry))
+        if(mb->exception_table_size > 0)
+            NVML_DIRECT("PREPARE", mb->exception_table,
+                        mb->exception_table_size * sizeof(ExceptionTableEntry))
+    }
+    // End of modification
+
     /* Update the method's line number and exception tables
       with the new instruction offsets */
 
@@ -935,6 +1304,11 @@ retry:
        also marks the method as being prepared. */
 
     lockVMWaitLock(prepare_lock, self);
+    // JaPHa Modification
+    if(code_ops != NULL)
+        NVML_DIRECT("PREPARE", &mb->code, offsetof(MethodBlock, code_size) +
+                    sizeof(int) - offsetof(MethodBlock, code))
+    // End of modification
     mb->code = new_code;
     mb->code_size = ins_count;
     notifyAllVMWaitLock(prepare_lock, self);
@@ -945,5 +1319,10 @@ retry:
     if(!(mb->access_flags & ACC_ABSTRACT))
         /* XXX NVM CHANGE 004.003.001  */
         sysFree_persistent(code);
+
+    // JaPHa Modification
+    if(code_ops != NULL)
+        END_TX("PREPARE")
+    // End of modification
 }
 #endif
@@ -43,20 +43,17 @@ char *value2Str(int value, char *buff) {
     }
 }
   
-int writeIncludeFile() {
+// JaPHa Modification
+/* A table is written for each of the volatile and the persistent
+   interpreter (see interp-persist.c) */
+void writeTable(FILE *fd, char *variant, int persistent_handlers) {
     char buff[256];
-    FILE *fd;
     int i, j;
 
-    fd = fopen("relocatability.inc", "w");
-
-    if(fd == NULL) {
-        printf("ERROR : cannot write relocatability.inc (check permissions).\n");
-        return 1;
-    }
+    goto_len = calculateRelocatability(persistent_handlers, handler_sizes);
 
-    fprintf(fd, "static int goto_len = %s;\n", value2Str(goto_len, buff));
-    fprintf(fd, "static int handler_sizes[%d][%d] = {\n", HANDLERS, LABELS_SIZE);
+    fprintf(fd, "static int %s_goto_len = %s;\n", variant, value2Str(goto_len, buff));
+    fprintf(fd, "static int %s_handler_sizes[%d][%d] = {\n", variant, HANDLERS, LABELS_SIZE);
 
     for(i = 0; i < HANDLERS; i++) {
         if(i > 0)
@@ -70,32 +67,47 @@ int writeIncludeFile() {
     }
 
     fprintf(fd, "\n};\n");
+}
+
+int writeIncludeFile() {
+    FILE *fd;
+
+    fd = fopen("relocatability.inc", "w");
+
+    if(fd == NULL) {
+        printf("ERROR : cannot write relocatability.inc (check permissions).\n");
+        return 1;
+    }
+
+    writeTable(fd, "volatile", FALSE);
+    writeTable(fd, "persistent", TRUE);
     fclose(fd);
 
     return 0;
 }
 
 int main() {
-    goto_len = calculateRelocatability(handler_sizes);
     return writeIncludeFile();
 }
+// End of modification
 
 
 /* Stubs for functions called from executeJava */
 
-Object *allocObject(Class *class) {
+Object *allocObject0(Class *class, int young) {
     return NULL;
 }
 
-Object *allocArray(Class *class, int size, int el_size) {
+Object *allocArray0(Class *class, int size, int el_size, int young) {
     return NULL;
 }
 
-Object *allocTypeArray(int type, int size) {
+Object *allocTypeArray0(int type, int size, int young) {
     return NULL;
 }
 
-Object *allocMultiArray(Class *array_class, int dim, intptr_t *count) {
+Object *allocMultiArray0(Class *array_class, int dim, intptr_t *count,
+                         int young) {
     return NULL;
 }
 
@@ -152,6 +164,47 @@ ExecEnv *getExecEnv() {
 // JaPHa Modification
 void flushPHValues() {
 }
+
+int epoch_limit = 0;
+volatile unsigned int durable_epoch = 0;
+int nursery_enabled = FALSE;
+
+void renewEpoch(ExecEnv *ee) {
+}
+
+void commitEpoch(ExecEnv *ee) {
+}
+
+void resetWriteSet(TxState *tx_state) {
+}
+
+void txAborted(TxState *tx_state) {
+}
+
+void commitNVMFrees(TxState *tx_state) {
+}
+
+int isTransient(Object *ob) {
+    return FALSE;
+}
+
+void makeTransient(Object *ob) {
+}
+
+void publishObject(Object *ob) {
+}
+
+void rememberYoungRef(Object *holder, Object *value) {
+}
+
+void logStore(TxState *tx_state, char *type, Object *ob,
+              void *addr, int size) {
+}
+
+TxState *getTxState() {
+    static TxState tx_state;
+    return &tx_state;
+}
 // End of modification
 
 void exitVM(int status) {
@@ -172,6 +225,45 @@ void objectLock(Object *ob) {
 void objectUnlock(Object *ob) {
 }
 
+// JaPHa Modification
+void faseLock(Object *ob) {
+}
+
+void faseUnlock(Object *ob) {
+}
+
+void rewritePersistent(MethodBlock *mb, Instruction *pc, int cache,
+                       int opcode, Operand operand) {
+}
+
+volatile int checkpoint_requested = 0;
+int snapshot_mode = 0;
+int wal_mode = 0;
+
+void checkpointSafepoint(ExecEnv *ee, uintptr_t *top) {
+}
+
+void walRange(TxState *tx_state, char *addr, int size) {
+}
+
+void walCommit(TxState *tx_state) {
+}
+
+int nvm_emulation = 0;
+
+void nvmWrite(unsigned long bytes, int fences) {
+}
+
+void nvmRead(void *addr, int size) {
+}
+
+void nvmTxAdd(TxState *tx_state, int size) {
+}
+
+void nvmTxCommit(TxState *tx_state) {
+}
+// End of modification
+
 void inlineBlockWrappedOpcode(Instruction *pc) {
 }
 
@@ -201,7 +201,11 @@ d##X: {                \
 {                                                          \
     pc->handler = &&rewrite_lock;                          \
     MBARRIER();                                            \
-    pc->operand = new_operand;                             \
+    if(PERSISTENT_STORES && mb->code_ops != NULL)          \
+        rewritePersistent(mb, pc, cache, opcode,           \
+                          new_operand);                    \
+    else                                                   \
+        pc->operand = new_operand;                         \
     MBARRIER();                                            \
     pc->handler = handlers[cache][opcode];                 \
                                                            \
@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2003, 2004, 2005, 2006, 2007, 2008
+ * Robert Lougher <rob@jamvm.org.uk>.
+ *
+ * This file is part of JamVM.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+// JaPHa Modification
+/* The persistent interpreter.  The handlers are generated from the
+   same opcode definitions as the volatile interpreter in interp.c,
+   but with the store barriers, allocation brackets and failure-atomic
+   sections unconditionally compiled in */
+
+#include "config.h"
+
+#define PERSISTENT_STORES TRUE
+#define executeJava() executeJavaPersistent()
+
+#include "interp.c"
+// End of modification
@@ -26,6 +26,16 @@
 #include <string.h>
 #include <math.h>
 
+// JaPHa Modification
+/* This is the volatile interpreter.  The persistent one is built
+   from the same source with PERSISTENT_STORES defined (see
+   interp-persist.c), so every barrier is resolved at compile
+   time and is dead code in the other variant */
+#ifndef PERSISTENT_STORES
+#define PERSISTENT_STORES FALSE
+#endif
+// End of modification
+
 #include "jam.h"
 #include "thread.h"
 #include "lock.h"
@@ -35,6 +45,12 @@
 
 #include "interp.h"
 
+// JaPHa Modification
+/* Only the persistent interpreter opens failure-atomic sections */
+#define MONITOR_ENTER(ob) (PERSISTENT_STORES ? faseLock(ob) : objectLock(ob))
+#define MONITOR_EXIT(ob) (PERSISTENT_STORES ? faseUnlock(ob) : objectUnlock(ob))
+// End of modification
+
 uintptr_t *executeJava() {
 
     /* Definitions specific to the particular
@@ -72,6 +88,36 @@ uintptr_t *executeJava() {
     PREPARE_MB(mb);
     pc = (CodePntr)mb->code;
 
+    // JaPHa Modification
+    /* A stack rebuilt from a checkpoint (see checkpoint.c).  Its frames
+       hold the offset of their invoke until the method is linked.  The
+       innermost frame runs its invoke again, from the uncached entry as
+       the operands are all on the stack */
+    if(PERSISTENT_STORES && ee->resume_ostack != NULL) {
+        Frame *last;
+
+        for(last = frame; last->mb != NULL; last = last->prev) {
+            PREPARE_MB(last->mb);
+            last->last_pc = (CodePntr)last->mb->code +
+                            (uintptr_t)last->last_pc;
+        }
+
+        pc = frame->last_pc;
+        ostack = ee->resume_ostack;
+        ee->resume_ostack = NULL;
+
+#ifdef DIRECT
+        if(mb->code_ops != NULL) {
+            int index = mb->code_ops[pc - (CodePntr)mb->code];
+#if defined(PREFETCH) && !defined(INLINING)
+            next_handler = pc[1].handler;
+#endif
+            goto *handlers[0][INDEX_OPCODE(index)];
+        }
+#endif
+    }
+    // End of modification
+
     /* The initial dispatch code - this is specific to
        the interpreter variant */
     INTERPRETER_PROLOGUE
@@ -329,6 +375,18 @@ uintptr_t *executeJava() {
     MULTI_LEVEL_FIELD_ACCESS(level)
 
 // JaPHa Modification
+/* Only reference stores publish the stored value */
+#define PUBLISH_STORE(value)
+#define PUBLISH_STORE_REF(value) PUBLISH(value)
+
+/* Nor do other stores remember their holder */
+#define REMEMBER_STORE(holder, value)
+#define REMEMBER_STORE_REF(holder, value) REMEMBER(holder, value)
+
+#define STORE_VALUE_0 ostack[-1]
+#define STORE_VALUE_1 cache.i.v1
+#define STORE_VALUE_2 cache.i.v2
+
 #define FIELD_ACCESS_OPCODES(level, type, suffix)          \
                                                            \
     DEF_OPC(OPC_GETSTATIC_QUICK##suffix, level,            \
@@ -337,17 +395,23 @@ uintptr_t *executeJava() {
     )                                                      \
                                                            \
     DEF_OPC(OPC_PUTSTATIC_QUICK##suffix, level,            \
-        if(persistent) {				                   \
-           BEGIN_TX("PUTSTATIC_QUICK")                     \
+        if(PERSISTENT_STORES) {			                   \
+           BEGIN_STORE("PUTSTATIC_QUICK")                 \
+           PUBLISH_STORE##suffix(STORE_VALUE_##level)       \
            NVML_DIRECT("PUTSTATICQUICK",                   \
            RESOLVED_FIELD(pc), sizeof(FieldBlock));        \
-           END_TX("PUTSTATIC_QUICK")                       \
+           END_STORE("PUTSTATIC_QUICK")                   \
         }						                           \
+        REMEMBER_STORE##suffix(RESOLVED_FIELD(pc)->class,    \
+                               STORE_VALUE_##level)        \
         POP_##level(*(type*)                               \
            (RESOLVED_FIELD(pc)->u.static_value.data), 3);  \
     )                                                      \
                                                            \
     DEF_OPC(OPC_GETFIELD_THIS##suffix, level,              \
+        NVM_READ(&INST_DATA(this, type,                    \
+                            GETFIELD_THIS_OFFSET(pc)),     \
+                 sizeof(type))                             \
         PUSH_##level(INST_DATA(this, type,                 \
                            GETFIELD_THIS_OFFSET(pc)), 4);  \
     )                                                      \
@@ -435,10 +499,12 @@ uintptr_t *executeJava() {
     *lvars++ = cache.i.v2;                                 \
     goto methodReturn;
 
+// JaPHa Modification
 #define GETFIELD_QUICK_0(offset, type)                     \
 {                                                          \
     Object *obj = (Object *)*--ostack;                     \
     NULL_POINTER_CHECK(obj);                               \
+    NVM_READ(&INST_DATA(obj, type, offset), sizeof(type))  \
     PUSH_0(INST_DATA(obj, type, offset), 3);               \
 }
 
@@ -446,6 +512,7 @@ uintptr_t *executeJava() {
 {                                                          \
     Object *obj = (Object *)cache.i.v1;                    \
     NULL_POINTER_CHECK(obj);                               \
+    NVM_READ(&INST_DATA(obj, type, offset), sizeof(type))  \
     PUSH_0(INST_DATA(obj, type, offset), 3);               \
 }
 
@@ -453,8 +520,10 @@ uintptr_t *executeJava() {
 {                                                          \
     Object *obj = (Object *)cache.i.v2;                    \
     NULL_POINTER_CHECK(obj);                               \
+    NVM_READ(&INST_DATA(obj, type, offset), sizeof(type))  \
     PUSH_1(INST_DATA(obj, type, offset), 3);               \
 }
+// End of modification
 
 #define UNARY_MINUS_0                                      \
     PUSH_0(-STACK_POP(int), 1);
@@ -644,6 +713,7 @@ uintptr_t *executeJava() {
 #define ARRAY_LOAD_ARY *--ostack
 #endif
 
+// JaPHa Modification
 #define ARRAY_LOAD(TYPE)                       \
 {                                              \
     int idx = ARRAY_LOAD_IDX;                  \
@@ -651,8 +721,11 @@ uintptr_t *executeJava() {
                                                \
     NULL_POINTER_CHECK(array);                 \
     ARRAY_BOUNDS_CHECK(array, idx);            \
+    NVM_READ(&ARRAY_DATA(array, TYPE)[idx],    \
+             sizeof(TYPE))                     \
     PUSH_0(ARRAY_DATA(array, TYPE)[idx], 1);   \
 }
+// End of modification
 
     DEF_OPC_012_2(
             OPC_IALOAD,
@@ -684,6 +757,9 @@ uintptr_t *executeJava() {
 
         NULL_POINTER_CHECK(array);
         ARRAY_BOUNDS_CHECK(array, idx);
+        // JaPHa Modification
+        NVM_READ(&ARRAY_DATA(array, u8)[idx], sizeof(u8))
+        // End of modification
         PUSH_LONG(ARRAY_DATA(array, u8)[idx], 1);
     })
 
@@ -698,23 +774,22 @@ uintptr_t *executeJava() {
 // JaPHa Modification
 #define ARRAY_STORE(TYPE)                     \
 {                                             \
-    if(persistent) {                          \
-            BEGIN_TX("ARRAY_STORE")           \
-    }                                         \
     int val = ARRAY_STORE_VAL;                \
     int idx = ARRAY_STORE_IDX;                \
     Object *array = (Object *)*--ostack;      \
+    int durable;                              \
                                               \
     NULL_POINTER_CHECK(array);                \
     ARRAY_BOUNDS_CHECK(array, idx);           \
-    if(persistent) {                          \
-            NVML_DIRECT("ARRAY_STORE",        \
+    if((durable = DURABLE_STORE(array))) {    \
+            BEGIN_STORE("ARRAY_STORE")       \
+            NVML_STORE("ARRAY_STORE", array,  \
             &(ARRAY_DATA(array, TYPE)[idx]),  \
             sizeof(val))                      \
     }                                         \
     ARRAY_DATA(array, TYPE)[idx] = val;       \
-    if(persistent) {                          \
-            END_TX("ARRAY_STORE")             \
+    if(durable) {                             \
+            END_STORE("ARRAY_STORE")         \
     }                                         \
     DISPATCH(0, 1);                           \
 }
@@ -738,12 +813,10 @@ uintptr_t *executeJava() {
 
     // JaPHa Modification
     DEF_OPC_012(OPC_AASTORE, { 
-        if(persistent) {
-            BEGIN_TX("AASTORE")
-        }
         Object *obj = (Object*)ARRAY_STORE_VAL;
         int idx = ARRAY_STORE_IDX;
         Object *array = (Object *)*--ostack;
+        int durable;
 
         NULL_POINTER_CHECK(array);
         ARRAY_BOUNDS_CHECK(array, idx);
@@ -751,13 +824,16 @@ uintptr_t *executeJava() {
         if((obj != NULL) && !arrayStoreCheck(array->class, obj->class))
             THROW_EXCEPTION(java_lang_ArrayStoreException, NULL);
 
-        if(persistent) {
-            NVML_DIRECT("AASTORE", &(ARRAY_DATA(array, Object*)[idx]), sizeof(obj))
+        if((durable = DURABLE_STORE(array))) {
+            BEGIN_STORE("AASTORE")
+            PUBLISH(obj)
+            NVML_STORE("AASTORE", array, &(ARRAY_DATA(array, Object*)[idx]), sizeof(obj))
         }
         ARRAY_DATA(array, Object*)[idx] = obj;
-        if(persistent) {
-            END_TX("AASTORE")
+        if(durable) {
+            END_STORE("AASTORE")
         }
+        REMEMBER(array, obj)
         DISPATCH(0, 1);
     })
     // End of modification
@@ -782,22 +858,22 @@ uintptr_t *executeJava() {
     DEF_OPC_012_2(
             OPC_LASTORE,
             OPC_DASTORE, {
-        if(persistent) {
-            BEGIN_TX("LASTORE - DASTORE")
-        }
         int idx = ostack[-3];
         Object *array = (Object *)ostack[-4];
+        int durable;
 
-        if(persistent) {
-            NVML_DIRECT("L&D ASTORE", &(ARRAY_DATA(array, u8)[idx]), sizeof(u8))
-        }
         ostack -= 4;
         NULL_POINTER_CHECK(array);
         ARRAY_BOUNDS_CHECK(array, idx);
 
+        if((durable = DURABLE_STORE(array))) {
+            BEGIN_STORE("LASTORE - DASTORE")
+            NVML_STORE("L&D ASTORE", array, &(ARRAY_DATA(array, u8)[idx]), sizeof(u8))
+        }
+
         ARRAY_DATA(array, u8)[idx] = *(u8*)&ostack[2];
-        if(persistent) {
-            END_TX("LASTORE - DASTORE")
+        if(durable) {
+            END_STORE("LASTORE - DASTORE")
         }
         DISPATCH(0, 1);
     })
@@ -1245,22 +1321,16 @@ uintptr_t *executeJava() {
 
     // JaPHa Modification
     DEF_OPC_210(OPC_NEWARRAY, {
-        if(persistent) {
-            BEGIN_TX("NEWARRAY")
-            nvml_alloc = TRUE;
-        }
+        BEGIN_ALLOC("NEWARRAY")
         int type = ARRAY_TYPE(pc);
         int count = *--ostack;
         Object *obj;
 
         frame->last_pc = pc;
-        if((obj = allocTypeArray(type, count)) == NULL)
+        if((obj = allocTypeArray0(type, count, YOUNG_ALLOC)) == NULL)
             goto throwException;
 
-        if(persistent) {
-            END_TX("NEWARRAY")
-            nvml_alloc = FALSE;
-        }
+        END_ALLOC("NEWARRAY", obj)
         PUSH_0((uintptr_t)obj, 2);
     })
     // End of modification
@@ -1269,11 +1339,7 @@ uintptr_t *executeJava() {
     DEF_OPC_210(OPC_MONITORENTER, {
         Object *obj = (Object *)*--ostack;
         NULL_POINTER_CHECK(obj);
-        if(persistent) {
-			BEGIN_TX("MONITORENTER")
-            NVML_DIRECT("ENTEROBJ", obj, sizeof(Object));
-        }
-        objectLock(obj);
+        MONITOR_ENTER(obj);
         DISPATCH(0, 1);
     })
     // End of modification
@@ -1282,10 +1348,7 @@ uintptr_t *executeJava() {
     DEF_OPC_210(OPC_MONITOREXIT, {
         Object *obj = (Object *)*--ostack;
         NULL_POINTER_CHECK(obj);
-        objectUnlock(obj);
-        if(persistent) {
-			END_TX("MONITOREXIT")
-        }
+        MONITOR_EXIT(obj);
         DISPATCH(0, 1);
     })
     // End of modification
@@ -1772,9 +1835,12 @@ uintptr_t *executeJava() {
 
             NULL_POINTER_CHECK(obj);
 
-            if(*fb->type == 'L' || *fb->type == '[')
+            if(*fb->type == 'L' || *fb->type == '[') {
                 INST_DATA(obj, uintptr_t, fb->u.offset) = cache.i.v2;
-            else
+                // JaPHa Modification
+                REMEMBER(obj, cache.i.v2)
+                // End of modification
+            } else
                 INST_DATA(obj, u4, fb->u.offset) = cache.i.v2;
         }
         DISPATCH(0, 3);
@@ -1795,9 +1861,12 @@ uintptr_t *executeJava() {
             ostack -= 2;
             NULL_POINTER_CHECK(obj);
 
-            if(*fb->type == 'L' || *fb->type == '[')
+            if(*fb->type == 'L' || *fb->type == '[') {
                 INST_DATA(obj, uintptr_t, fb->u.offset) = ostack[1];
-            else
+                // JaPHa Modification
+                REMEMBER(obj, ostack[1])
+                // End of modification
+            } else
                 INST_DATA(obj, u4, fb->u.offset) = ostack[1];
         }
         DISPATCH(0, 3);
@@ -1987,13 +2056,13 @@ uintptr_t *executeJava() {
 
     // JaPHa Modification
     DEF_OPC_012(OPC_PUTSTATIC2_QUICK, {
-        if(persistent) {
-            BEGIN_TX("PUTSTATIC2_QUICK")
+        if(PERSISTENT_STORES) {
+            BEGIN_STORE("PUTSTATIC2_QUICK")
         }
         FieldBlock *fb = RESOLVED_FIELD(pc);
-        if(persistent) {
+        if(PERSISTENT_STORES) {
             NVML_DIRECT("PUTSTATIC2_QUICK", fb, sizeof(FieldBlock))
-            END_TX("PUTSTATIC2_QUICK")
+            END_STORE("PUTSTATIC2_QUICK")
         }
         POP_LONG(fb->u.static_value.l, 3);
     })
@@ -2003,6 +2072,9 @@ uintptr_t *executeJava() {
         Object *obj = (Object *)*--ostack;
         NULL_POINTER_CHECK(obj);
                 
+        // JaPHa Modification
+        NVM_READ(&INST_DATA(obj, u8, SINGLE_INDEX(pc)), sizeof(u8))
+        // End of modification
         PUSH_LONG(INST_DATA(obj, u8, SINGLE_INDEX(pc)), 3);
     })
 
@@ -2026,19 +2098,18 @@ uintptr_t *executeJava() {
 #else
     // JaPHa Modification
     DEF_OPC_012(OPC_PUTFIELD2_QUICK, {
-        if(persistent) {
-            BEGIN_TX("PUTFIELD2_QUICK")
-        }
         Object *obj = (Object *)ostack[-3];
+        int durable;
 
         ostack -= 3;
         NULL_POINTER_CHECK(obj);
-        if(persistent) {
-            NVML_DIRECT("PUTFIELD2_QUICK",&(INST_DATA(obj, u8, SINGLE_INDEX(pc))),sizeof(u8))
+        if((durable = DURABLE_STORE(obj))) {
+            BEGIN_STORE("PUTFIELD2_QUICK")
+            NVML_STORE("PUTFIELD2_QUICK", obj, &(INST_DATA(obj, u8, SINGLE_INDEX(pc))),sizeof(u8))
         }
         INST_DATA(obj, u8, SINGLE_INDEX(pc)) = *(u8*)&ostack[1];
-        if(persistent) {
-            END_TX("PUTFIELD2_QUICK")
+        if(durable) {
+            END_STORE("PUTFIELD2_QUICK")
         }
         DISPATCH(0, 3);
     })
@@ -2047,21 +2118,23 @@ uintptr_t *executeJava() {
 // JaPHa Modification
 #define PUTFIELD_QUICK(type, suffix)                        \
     DEF_OPC_012(OPC_PUTFIELD_QUICK##suffix, {               \
-        if(persistent) {                                    \
-            BEGIN_TX("PUTFIELD_QUICK")                      \
-        }                                                   \
         Object *obj = (Object *)ostack[-2];                 \
+        int durable;                                        \
                                                             \
         ostack -= 2;                                        \
         NULL_POINTER_CHECK(obj);                            \
-        if(persistent) {                                    \
-            NVML_DIRECT("PUTFIELD_QUICK",&(INST_DATA(obj,   \
-            type, SINGLE_INDEX(pc))),sizeof(type))          \
+        if((durable = DURABLE_STORE(obj))) {                \
+            BEGIN_STORE("PUTFIELD_QUICK")                  \
+            PUBLISH_STORE##suffix(ostack[1])                \
+            NVML_STORE("PUTFIELD_QUICK", obj,               \
+            &(INST_DATA(obj, type, SINGLE_INDEX(pc))),      \
+            sizeof(type))                                   \
         }                                                   \
         INST_DATA(obj, type, SINGLE_INDEX(pc)) = ostack[1]; \
-        if(persistent) {                                    \
-            END_TX("PUTFIELD_QUICK")                        \
+        if(durable) {                                       \
+            END_STORE("PUTFIELD_QUICK")                    \
         }                                                   \
+        REMEMBER_STORE##suffix(obj, ostack[1])              \
         DISPATCH(0, 3);                                     \
     })
 // End of modification
@@ -2124,31 +2197,22 @@ uintptr_t *executeJava() {
 
     // JaPHa Modification
     DEF_OPC_210(OPC_NEW_QUICK, {
-        if(persistent) {
-            BEGIN_TX("NEW_QUICK")
-            nvml_alloc = TRUE;
-        }
+        BEGIN_ALLOC("NEW_QUICK")
         Class *class = RESOLVED_CLASS(pc);
         Object *obj;
 
         frame->last_pc = pc;
-        if((obj = allocObject(class)) == NULL)
+        if((obj = allocObject0(class, YOUNG_ALLOC)) == NULL)
             goto throwException;
 
-        if(persistent) {
-            END_TX("NEW_QUICK")
-            nvml_alloc = FALSE;
-        }
+        END_ALLOC("NEW_QUICK", obj)
         PUSH_0((uintptr_t)obj, 3);
     })
     // End of modification
  
     // JaPHa Modification
     DEF_OPC_210(OPC_ANEWARRAY_QUICK, {
-        if(persistent) {
-            BEGIN_TX("ANEWARRAY_QUICK")
-            nvml_alloc = TRUE;
-        }
+        BEGIN_ALLOC("ANEWARRAY_QUICK")
         Class *class = RESOLVED_CLASS(pc);
         char *name = CLASS_CB(class)->name;
         int count = *--ostack;
@@ -2176,13 +2240,11 @@ uintptr_t *executeJava() {
         if(exceptionOccurred0(ee))
             goto throwException;
 
-        if((obj = allocArray(array_class, count, sizeof(Object*))) == NULL)
+        if((obj = allocArray0(array_class, count, sizeof(Object*),
+                               YOUNG_ALLOC)) == NULL)
             goto throwException;
 
-        if(persistent) {
-            END_TX("ANEWARRAY_QUICK")
-            nvml_alloc = FALSE;
-        }
+        END_ALLOC("ANEWARRAY_QUICK", obj)
         PUSH_0((uintptr_t)obj, 3);
     })
     // End of modification
@@ -2210,10 +2272,7 @@ uintptr_t *executeJava() {
 
     // JaPHa Modification
     DEF_OPC_210(OPC_MULTIANEWARRAY_QUICK, ({
-        if(persistent) {
-            BEGIN_TX("MULTIANEWARRAY_QUICK")
-            nvml_alloc = TRUE;
-        }
+        BEGIN_ALLOC("MULTIANEWARRAY_QUICK")
         Class *class = RESOLVED_CLASS(pc);
         int i, dim = MULTI_ARRAY_DIM(pc);
         Object *obj;
@@ -2227,13 +2286,11 @@ uintptr_t *executeJava() {
                 goto throwException;
             }
 
-        if((obj = allocMultiArray(class, dim, (intptr_t *)ostack)) == NULL)
+        if((obj = allocMultiArray0(class, dim, (intptr_t *)ostack,
+                                    YOUNG_ALLOC)) == NULL)
             goto throwException;
 
-        if(persistent) {
-            END_TX("MULTIANEWARRAY_QUICK")
-            nvml_alloc = FALSE;
-        }
+        END_ALLOC("MULTIANEWARRAY_QUICK", obj)
         PUSH_0((uintptr_t)obj, 4);
     });)
     // End of modification
@@ -2286,6 +2343,19 @@ invokeMethod:
     Object *sync_ob = NULL;
 
     frame->last_pc = pc;
+
+    // JaPHa Modification
+    /* Safepoint for a checkpoint.  The frame is complete in memory,
+       its operand stack ending with the callee's arguments */
+    if(PERSISTENT_STORES && checkpoint_requested)
+        checkpointSafepoint(ee, arg1 + new_mb->args_count);
+
+    /* Safepoint for a stale durability epoch, so a thread which
+       has stopped storing doesn't keep its stores volatile */
+    if(PERSISTENT_STORES && ee->epoch_open && ee->epoch != durable_epoch)
+        commitEpoch(ee);
+    // End of modification
+
     ostack = ALIGN_OSTACK(new_frame + 1);
 
     if((char*)(ostack + new_mb->max_stack) > ee->stack_end) {
@@ -2310,14 +2380,14 @@ invokeMethod:
     if(new_mb->access_flags & ACC_SYNCHRONIZED) {
         sync_ob = new_mb->access_flags & ACC_STATIC ? (Object*)new_mb->class
                                                     : (Object*)*arg1;
-        objectLock(sync_ob);
+        MONITOR_ENTER(sync_ob);
     }
 
     if(new_mb->access_flags & ACC_NATIVE) {
         ostack = (*new_mb->native_invoker)(new_mb->class, new_mb, arg1);
 
         if(sync_ob)
-            objectUnlock(sync_ob);
+            MONITOR_EXIT(sync_ob);
 
         ee->last_frame = frame;
 
@@ -2351,7 +2421,7 @@ methodReturn:
     if(mb->access_flags & ACC_SYNCHRONIZED) {
         Object *sync_ob = mb->access_flags & ACC_STATIC ? (Object*)mb->class
                                                         : this;
-        objectUnlock(sync_ob);
+        MONITOR_EXIT(sync_ob);
     }
 
     mb = frame->mb;
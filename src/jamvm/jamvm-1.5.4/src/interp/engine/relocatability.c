@@ -46,9 +46,16 @@ char *findNextLabel(char **pntrs, char *pntr) {
     return NULL;
 }
 
-int calculateRelocatability(int handler_sizes[HANDLERS][LABELS_SIZE]) {
-    char ***handlers1 = (char ***)executeJava();
-    char ***handlers2 = (char ***)executeJava2();
+// JaPHa Modification
+/* The persistent and volatile interpreters are checked separately */
+int calculateRelocatability(int persistent_handlers,
+                            int handler_sizes[HANDLERS][LABELS_SIZE]) {
+
+    char ***handlers1 = (char ***)(persistent_handlers ?
+                          executeJavaPersistent() : executeJava());
+    char ***handlers2 = (char ***)(persistent_handlers ?
+                          executeJavaPersistent2() : executeJava2());
+    // End of modification
     char *sorted_ends[LABELS_SIZE];
     char *goto_start;
     int goto_len;
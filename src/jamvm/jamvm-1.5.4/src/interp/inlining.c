@@ -41,6 +41,12 @@ static int handler_sizes[HANDLERS][LABELS_SIZE];
 static int goto_len;
 #else
 #include "relocatability.inc"
+
+// JaPHa Modification
+/* The sizes of the interpreter variant in use (see selectHandlers) */
+static int (*handler_sizes)[LABELS_SIZE] = volatile_handler_sizes;
+static int goto_len;
+// End of modification
 #endif
 
 #ifdef TRACEINLINING
@@ -128,12 +134,32 @@ char *reason(int reason) {
     return "unknown reason";
 }
 
+// JaPHa Modification
+/* Blocks are built by copying the handlers of the interpreter which
+   will execute them, i.e. the persistent or the volatile one */
+static char ***selectHandlers() {
+#ifdef RUNTIME_RELOC_CHECKS
+    goto_len = calculateRelocatability(persistent, handler_sizes);
+#else
+    if(persistent) {
+        goto_len = persistent_goto_len;
+        handler_sizes = persistent_handler_sizes;
+    } else {
+        goto_len = volatile_goto_len;
+        handler_sizes = volatile_handler_sizes;
+    }
+#endif
+
+    return (char ***)EXECUTE_JAVA();
+}
+// End of modification
+
 void showRelocatability() {
     int i;
 
-#ifdef RUNTIME_RELOC_CHECKS
-    goto_len = calculateRelocatability(handler_sizes);
-#endif
+    // JaPHa Modification
+    selectHandlers();
+    // End of modification
 
     if(goto_len >= 0)
         printf("Dispatch sequence is relocatable\n");
@@ -157,13 +183,11 @@ void showRelocatability() {
 }
 
 int checkRelocatability() {
-    char ***handlers = (char ***)executeJava();
+    // JaPHa Modification
+    char ***handlers = selectHandlers();
+    // End of modification
     int i;
 
-#ifdef RUNTIME_RELOC_CHECKS
-    goto_len = calculateRelocatability(handler_sizes);
-#endif
-
     /* Check relocatability of the indirect goto.  This is copied onto the
        end of each super-instruction.  If this is un-relocatable, inlining
        is disabled. */
@@ -320,6 +344,12 @@ void freeMethodInlinedInfo(MethodBlock *mb) {
 
                 gcPendingFree(info->block->opcodes);
                 gcPendingFree(info->block);
+
+                // JaPHa Modification
+                /* Persistent ones are freed with the method's
+                   list (see freeClassData) */
+                if(mb->code_ops == NULL)
+                // End of modification
                 gcPendingFree(info);
             }
 
@@ -870,12 +900,23 @@ void removeFromProfile(MethodBlock *mb, BasicBlock *block) {
 
         /* Unwrap the original handler's operand */
         ins->operand = prepare_info->operand;
+
+        // JaPHa Modification
+        if(mb->code_ops != NULL)
+            unwrapPersistent(mb, prepare_info);
+        // End of modification
+
         MBARRIER();
 
         /* Unwrap the original handler */
         ins->handler = handler_entry_points[opcode_info->cache_depth]
                                            [opcode_info->opcode];
 
+        // JaPHa Modification
+        if(mb->code_ops != NULL)
+            sysFree_persistent(prepare_info);
+        else
+        // End of modification
         sysFree(prepare_info);
         return;
     }
@@ -1004,11 +1045,22 @@ void inlineBlockWrappedOpcode(MethodBlock *mb, Instruction *pc) {
     /* Unwrap the original handler's operand */
     pc->operand = prepare_info->operand;
 
+    // JaPHa Modification
+    if(mb->code_ops != NULL)
+        unwrapPersistent(mb, prepare_info);
+    // End of modification
+
     /* Unwrap the original handler */
     info = &prepare_info->block->opcodes[prepare_info->block->length-1];
     pc->handler = handler_entry_points[info->cache_depth][info->opcode];
 
     prepareBlock(mb, prepare_info->block, self);
+
+    // JaPHa Modification
+    if(mb->code_ops != NULL)
+        sysFree_persistent(prepare_info);
+    else
+    // End of modification
     sysFree(prepare_info);
 }
 
@@ -51,5 +51,9 @@
 
 #ifdef INLINING
 extern uintptr_t *executeJava2();
-extern int calculateRelocatability(int handler_sizes[HANDLERS][LABELS_SIZE]);
+// JaPHa Modification
+extern uintptr_t *executeJavaPersistent2();
+extern int calculateRelocatability(int persistent_handlers,
+                                   int handler_sizes[HANDLERS][LABELS_SIZE]);
+// End of modification
 #endif
@@ -25,6 +25,7 @@
 #include <stdarg.h>
 
 #include "jam.h"
+#include "thread.h"
 #include "class.h"
 #include "symbol.h"
 #include "excep.h"
@@ -58,6 +59,35 @@ void showNonStandardOptions() {
     printf("\t\t   <value> copy when usage reaches threshold value\n");
     printf("  -Xcodemem:[unlimited|<size>] (default maximum heapsize/4)\n");
 #endif
+    printf("  -persistentheap:<file>\n");
+    printf("\t\t   keep the heap in the persistent pool <file>, created with\n"
+           "\t\t   a capacity of the maximum heap size if it doesn't exist\n"
+           "\t\t   (default file %s)\n", DEFAULT_POOL_PATH);
+    printf("  -Xepoch:[none|<value>]\n");
+    printf("\t\t   none : one persistent transaction per store (default)\n");
+    printf("\t\t   <value> group-commit durability epochs of up to value stores\n");
+    printf("  -Xepochtime:<ms>  maximum length of a durability epoch "
+           "(default 100ms, 0 = no limit)\n");
+    printf("  -Xpersistall\t   make every object persistent, not only those\n"
+           "\t\t   reachable from static fields\n");
+    printf("  -Xnursery:<size>  allocate new objects in a volatile young\n"
+           "\t\t   generation, promoted to the persistent heap by GC\n");
+    printf("  -Xprefault:[none|willneed|touch]\n");
+    printf("\t\t   bring the heap of an existing pool in when opening it,\n"
+           "\t\t   by advising the kernel or by touching it in parallel\n"
+           "\t\t   (default none, pages are faulted in on first use)\n");
+    printf("  -Xsnapshot:<ms>   run the heap without transactions, snapshotting\n"
+           "\t\t   the pool every ms milliseconds instead.  A crash loses\n"
+           "\t\t   the stores since the last snapshot\n");
+    printf("  -Xwal:<ms>\t   with -Xsnapshot, also keep a redo log of the\n"
+           "\t\t   transactions since the last snapshot, written out\n"
+           "\t\t   every ms milliseconds.  A crash loses at most the\n"
+           "\t\t   transactions of the last ms milliseconds\n");
+    printf("  -Xnvmwrite:<ns>[,<MB/s>]\n");
+    printf("  -Xnvmread:<ns>[,<MB/s>]\n");
+    printf("\t\t   emulate the write or read latency and bandwidth of\n"
+           "\t\t   NVM by delaying the flushes, commits and (if built\n"
+           "\t\t   with NVMEMU_HEAP) loads of the persistent heap\n");
     printf("  -Xms<size>\t   set the initial size of the heap "
            "(default = %dM)\n", DEFAULT_MIN_HEAP/MB);
     printf("  -Xmx<size>\t   set the maximum size of the heap "
@@ -135,11 +165,29 @@ void showFullVersion() {
     printf("java full version \"jamvm-%s\"\n", JAVA_COMPAT_VERSION);
 }
 
+// JaPHa Modification
+/* <latency>[,<bandwidth>] of -Xnvmwrite and -Xnvmread */
+void parseNVMEmulation(char *value, int *latency, int *bandwidth) {
+    char *end;
+
+    *latency = strtol(value, &end, 0);
+
+    if(*end == ',')
+        *bandwidth = strtol(end + 1, &end, 0);
+
+    if(*end != '\0' || *latency < 0 || *bandwidth < 0) {
+        printf("Invalid NVM emulation \"%s\"\n", value);
+        exit(1);
+    }
+}
+// End of modification
+
 int parseCommandLine(int argc, char *argv[], InitArgs *args) {
     int is_jar = FALSE;
     int status = 1;
     int i;
     args->persistent_heap = FALSE;
+    args->heap_file = NULL;
 
     Property props[argc-1];
     int props_count = 0;
@@ -245,6 +293,48 @@ int parseCommandLine(int argc, char *argv[], InitArgs *args) {
                   args->persistent_heap = TRUE;
                   args->heap_file = argv[i] + 16;
                   persistent = TRUE;
+
+            // JaPHa Modification
+            } else if(strncmp(argv[i], "-Xepoch:", 8) == 0) {
+                char *pntr = argv[i] + 8;
+
+                args->epoch_stores = strcmp(pntr, "none") == 0 ?
+                    0 : strtol(pntr, NULL, 0);
+
+            } else if(strncmp(argv[i], "-Xepochtime:", 12) == 0) {
+                args->epoch_time = strtol(argv[i] + 12, NULL, 0);
+
+            } else if(strcmp(argv[i], "-Xpersistall") == 0) {
+                args->persist_reachable = FALSE;
+
+            } else if(strncmp(argv[i], "-Xnursery:", 10) == 0) {
+                args->nursery_size = parseMemValue(argv[i] + 10);
+
+            } else if(strncmp(argv[i], "-Xprefault:", 11) == 0) {
+                char *mode = argv[i] + 11;
+
+                if(strcmp(mode, "none") == 0)
+                    args->prefault = PREFAULT_NONE;
+                else if(strcmp(mode, "willneed") == 0)
+                    args->prefault = PREFAULT_WILLNEED;
+                else if(strcmp(mode, "touch") == 0)
+                    args->prefault = PREFAULT_TOUCH;
+                else {
+                    printf("Invalid prefault mode \"%s\"\n", mode);
+                    exit(1);
+                }
+
+            } else if(strncmp(argv[i], "-Xsnapshot:", 11) == 0) {
+                args->snapshot_interval = strtol(argv[i] + 11, NULL, 0);
+            } else if(strncmp(argv[i], "-Xwal:", 6) == 0) {
+                args->wal_interval = strtol(argv[i] + 6, NULL, 0);
+            } else if(strncmp(argv[i], "-Xnvmwrite:", 11) == 0) {
+                parseNVMEmulation(argv[i] + 11, &args->nvm_write_latency,
+                                  &args->nvm_write_bandwidth);
+            } else if(strncmp(argv[i], "-Xnvmread:", 10) == 0) {
+                parseNVMEmulation(argv[i] + 10, &args->nvm_read_latency,
+                                  &args->nvm_read_bandwidth);
+            // End of modification
             } else if(strncmp(argv[i], "-D", 2) == 0) {
             char *key = strcpy(sysMalloc(strlen(argv[i] + 2) + 1), argv[i] + 2);
             char *pntr;
@@ -401,13 +491,9 @@ int main(int argc, char *argv[]) {
     printf("Initialising JVM\n");
 
     // JaPHa Modification
+    /* first_ex is set once the pool has been located (see initialiseRoot) */
     nvml_alloc = persistent = FALSE;
     first_ex = TRUE;
-	total_tx_count = 0;
-
-    if(access(PATH, F_OK) != -1) {
-        first_ex = FALSE;
-    }
     // End of modification
 
     Class *array_class, *main_class;
@@ -441,6 +527,13 @@ int main(int argc, char *argv[]) {
     // JaPHa Modification
 	resumeAllListeners(system_loader);
     // end of JaPHa Modification
+
+    // JaPHa Modification
+    /* Carry on with the threads saved by a checkpoint rather
+       than running main again (see checkpoint.c) */
+    if(resumeCheckpoint())
+        goto error;
+    // End of modification
 	
     for(cpntr = argv[class_arg]; *cpntr; cpntr++)
         if(*cpntr == '.')
@@ -476,8 +569,13 @@ int main(int argc, char *argv[]) {
         printf("Entering Java Main\n");
 
         /* Call the main method */
-        if(i == argc)
+        if(i == argc) {
+            // JaPHa Modification
+            threadSelf()->root_state = ROOT_RUNNING;
             executeStaticMethod(main_class, mb, array);
+            threadSelf()->root_state = ROOT_OUTSIDE;
+            // End of modification
+        }
             
         // End of modification
     }
@@ -24,6 +24,7 @@
 #include <limits.h>
 #include <stdio.h>
 #include <time.h>
+#include <stddef.h>
 
 /* Configure options */
 #include "config.h"
@@ -477,6 +478,10 @@ typedef struct quick_prepare_info {
 typedef struct prepare_info {
     BasicBlock *block;
     Operand operand;
+    // JaPHa Modification
+    Instruction *ins;           /* the wrapped instruction, and the */
+    struct prepare_info *next;  /* method's list (see relinkMethod) */
+    // End of modification
 } PrepareInfo;
 
 struct profile_info {
@@ -489,6 +494,21 @@ struct profile_info {
 #endif
 
 typedef Instruction *CodePntr;
+
+// JaPHa Modification
+/* The persistent form of an instruction's handler: its index
+   in the interpreter's handler tables (see interp/direct.c).  The
+   top bits mark the basic blocks found by the inline rewriter */
+#define HANDLER_INDEX(cache, opcode) ((cache) << 8 | (opcode))
+#define INDEX_CACHE(index)           (((index) >> 8) & 0xf)
+#define INDEX_OPCODE(index)          ((index) & 0xff)
+
+#define INDEX_BLOCK_START 0x1000
+#define INDEX_BLOCK_JOIN  0x2000    /* falls through from the previous */
+#define INDEX_BLOCK_END   0x4000
+#define INDEX_BLOCK_BITS  (INDEX_BLOCK_START | INDEX_BLOCK_JOIN | \
+                           INDEX_BLOCK_END)
+// End of modification
 #else
 typedef unsigned char *CodePntr;
 #endif
@@ -533,6 +553,14 @@ struct methodblock {
    QuickPrepareInfo *quick_prepare_info;
    ProfileInfo *profile_info;
 #endif
+   // JaPHa Modification
+#ifdef DIRECT
+   u2 *code_ops;            /* handler index of each prepared instruction */
+#ifdef INLINING
+   PrepareInfo *wrapped;    /* operands wrapped by the inline rewriter */
+#endif
+#endif
+   // End of modification
 };
 
 typedef struct fieldblock {
@@ -621,6 +649,49 @@ typedef struct jni_frame {
    struct frame *prev;
 } JNIFrame;
 
+// JaPHa Modification
+/* Per-thread persistent transaction state.  libpmemobj transactions
+   are thread-local, so the nesting depth and a cache of the current
+   transaction stage live with the thread rather than in a global */
+#define WS_LINE_SIZE 64
+#define WS_SIZE      256
+
+typedef struct wal_range {
+    char *addr;
+    int size;
+} WalRange;
+
+typedef struct tx_state {
+    int depth;
+    int stage;
+    /* memory allocated by the outermost transaction -- stores into
+       it need no undo-logging, it is flushed at commit instead */
+    char *born_start;
+    char *born_end;
+    /* write set: open-addressed set of the parts of cache lines
+       already snapshotted by the outermost transaction, keyed by
+       where the part starts (see logStore) */
+    uintptr_t ws_lines[WS_SIZE];
+    unsigned char ws_used[WS_SIZE];
+    int ws_count;
+    /* number of object stores logged by the outermost transaction */
+    int stores;
+    /* in log mode, the ranges stored into by the outermost
+       bracket, copied to the redo log at commit (see wal.c) */
+    WalRange *wal_ranges;
+    int wal_count;
+    int wal_size;
+    /* bytes undo-logged by the outermost transaction,
+       flushed at commit under NVM emulation (see nvmemu.c) */
+    unsigned long nvm_bytes;
+    /* NVM metadata freed within the outermost transaction,
+       only made free at commit (see sysFree_persistent) */
+    void **nvm_frees;
+    int nvm_free_count;
+    int nvm_free_size;
+} TxState;
+// End of modification
+
 typedef struct exec_env {
     Object *exception;
     char *stack;
@@ -629,6 +700,20 @@ typedef struct exec_env {
     Frame *last_frame;
     Object *thread;
     char overflow;
+    // JaPHa Modification
+    TxState tx;
+    /* durability epoch state (see persist.c) */
+    char epoch_open;
+    int epoch_stores;
+    unsigned int epoch;
+    int fase_depth;
+    /* the saved stack the thread is started with, and where
+       its innermost frame is continued (see checkpoint.c) */
+    struct saved_thread *resume;
+    uintptr_t *resume_ostack;
+    /* emulated NVM delay owed by the thread, in ns (see nvmemu.c) */
+    long nvm_debt;
+    // End of modification
 } ExecEnv;
 
 typedef struct prop {
@@ -658,6 +743,25 @@ typedef struct InitArgs {
     int persistent_heap;
     char *heap_file;
 
+    // JaPHa Modification
+    int epoch_stores;   /* stores per durability epoch, 0 = one tx per store */
+    int epoch_time;     /* maximum epoch length in ms, 0 = no timer */
+    int persist_reachable; /* only objects reachable from durable roots
+                              are persistent (see alloc.c) */
+    unsigned long nursery_size; /* size of the DRAM young generation,
+                                   0 = allocate directly in the NVM heap */
+    int prefault;       /* bring the heap in when opening a pool, one of
+                           PREFAULT_NONE, PREFAULT_WILLNEED or PREFAULT_TOUCH */
+    int snapshot_interval; /* ms between heap snapshots, 0 = persistent
+                              transactions (see snapshot.c) */
+    int wal_interval;   /* ms between redo log group commits in snapshot
+                           mode, 0 = no log (see wal.c) */
+    int nvm_write_latency;   /* emulated NVM latencies in ns and */
+    int nvm_write_bandwidth; /* bandwidths in MB/s, 0 = none or */
+    int nvm_read_latency;    /* unlimited (see nvmemu.c) */
+    int nvm_read_bandwidth;
+    // End of modification
+
     Property *commandline_props;
     int props_count;
 
@@ -700,6 +804,14 @@ typedef struct opc {
 	Object **has_finaliser_list;
 	int has_finaliser_count;
 	int has_finaliser_size;
+	int ref_referent_offset;
+	int ref_queue_offset;
+	// JaPHa Modification
+	/* VMClassLoaderData, and its field holding the loader's
+	   class table (see relocateObject) */
+	Class *loader_data_class;
+	int ldr_data_tbl_offset;
+	// End of modification
 } OPC;
 
 #define CLASS_CB(classRef)           ((ClassBlock*)(classRef+1))
@@ -790,12 +902,24 @@ typedef struct opc {
 /* Alloc */
 
 // JAPHA modifications
-#define PATH "/mnt/pmfs/HEAP_POOL"	// FIXME: this needs to be dynamically configured via -persistentheap:<FILE_NAME>
-//#define HEAP_SIZE 3000000
-#define HEAP_SIZE 8192L*MB		// 8GB
-#define PHEAP_SIZE sizeof(PHeap)*4	// size of NVML pool, need extra space for overhead
-
-#define NVM_INIT_SIZE 	2500000*8
+#define DEFAULT_POOL_PATH "/mnt/pmfs/HEAP_POOL"	// used when -persistentheap: is given no file
+#define NVM_RESERVE_SIZE ((NVM_MAX_SEGMENTS - NVM_INIT_SEGMENTS) * sizeof(NVMSegment))
+#define MARKBITS_SIZE(capacity) ((capacity)/32)	// 2 mark bits per 8 byte grain
+#define FORWARDING_SIZE(capacity) (3*((capacity)/64 + sizeof(uintptr_t)))	// compaction forwarding table, see alloc.c
+#define HEAP_GROWTH_FACTOR 16	// the heap may grow to this many times its capacity at creation
+#define HEAP_MAX_EXTENTS 8	// extents it may grow by (see growHeap in alloc.c)
+#define HEAP_ROOM(capacity) ((capacity) * HEAP_GROWTH_FACTOR)
+#define POOL_SIZE(capacity) (sizeof(PHeap) + HEAP_ROOM(capacity) + \
+                             2 * (MARKBITS_SIZE(HEAP_ROOM(capacity)) + FORWARDING_SIZE(HEAP_ROOM(capacity))) + \
+                             NVM_RESERVE_SIZE + \
+                             (sizeof(PHeap) + HEAP_ROOM(capacity) + NVM_RESERVE_SIZE)/64 + \
+                             PMEMOBJ_MIN_POOL)	// size of NVML pool, with space for its overhead and for
+                                               	// the heap and metadata region to grow (the file is sparse)
+
+/* Prefaulting of the heap when an existing pool is opened */
+#define PREFAULT_NONE     0
+#define PREFAULT_WILLNEED 1
+#define PREFAULT_TOUCH    2
 
 /* Hashtable name constants */
 /* persistent HTs */
@@ -832,15 +956,92 @@ typedef struct chunk {
 	struct chunk *next;
 } Chunk;
 
-typedef struct nvmChunk {
-	int allocBit;
-	unsigned int chunkSize;
-	struct nvmChunk *next;
-} nvmChunk;
-
+/* Pages of the NVM metadata region (see sysMalloc_persistent).  The
+   region is a chain of segments, the first ones within the pheap and
+   the rest allocated from the pool as the region grows */
+#define NVM_PAGE_SIZE	4096
+#define NVM_SEGMENT_PAGES	2048
+#define NVM_SEGMENT_SIZE	(NVM_SEGMENT_PAGES * NVM_PAGE_SIZE)
+#define NVM_INIT_SEGMENTS	3	// 24M
+#define NVM_MAX_SEGMENTS	32	// 256M
+#define NVM_SLAB_GRAIN	16	// smallest size class
+#define NVM_SLAB_MAX	2048	// largest size class, larger allocations are runs of pages
+#define NVM_CLASSES	14
+
+#define NVM_PAGE_SLAB	1
+#define NVM_PAGE_RUN	2
+
+typedef struct nvm_page {
+	unsigned short kind;	/* NVM_PAGE_SLAB or NVM_PAGE_RUN, if in use */
+	unsigned short size_class;	/* of a slab */
+	unsigned int run;	/* pages in the run, on its first page */
+	uintptr_t bitmap[NVM_PAGE_SIZE / NVM_SLAB_GRAIN / (sizeof(uintptr_t) * 8)];	/* slots in use */
+} NVMPage;
+
+typedef struct nvm_segment {
+	PMEMoid next;	/* following segment, once the region has grown past the pheap */
+	uintptr_t pagemap[NVM_SEGMENT_PAGES / (sizeof(uintptr_t) * 8)];	/* pages in use */
+	NVMPage pages[NVM_SEGMENT_PAGES];
+	char mem[NVM_SEGMENT_SIZE];
+} NVMSegment;
+
+
+/* Where the entries of a persistent hash table are once it has been
+   resized out of its initial array in the pheap (see hash.c) */
+typedef struct phash_desc {
+	void *entries;
+	int size;
+} PHashDesc;
+
+#define HT_DESC_COUNT 5	// utf8, boot classes, boot packages, strings and monitors
+
+/* Phases of a restartable collection */
+#define GC_IDLE       0
+#define GC_SWEEPING   1
+#define GC_COMPACTING 2
+
+/* Maximum number of mapping addresses an interrupted
+   relocation may leave pointers relative to (see alloc.c) */
+#define RELOC_MAX_BASES 4
+
+/* Number of block starts recorded by a collection to
+   split the heap on at the next open (see alloc.c) */
+#define BLOCK_HINTS 15
+
+/* A part of the pool in use (see poolRanges) */
+typedef struct pool_range {
+	char *start;
+	char *end;
+} PoolRange;
+
+#define POOL_RANGES (NVM_MAX_SEGMENTS + HEAP_MAX_EXTENTS + 3)
+
+/* The stack of a thread saved by a checkpoint (see checkpoint.c).
+   The frames are saved outermost first, followed by their slots:
+   each frame's locals and then its operand stack */
+typedef struct saved_frame {
+	MethodBlock *mb;
+	uintptr_t pc;	/* offset of the invoke the frame was stopped at */
+	int depth;	/* operand stack depth, not counting the callee's arguments */
+} SavedFrame;
+
+typedef struct saved_thread {
+	Object *thread;	/* the java.lang.Thread */
+	Object *lock_obj;	/* monitor the thread was waiting on, re-entered on resume */
+	int lock_count;
+	int stack_size;
+	int frames;
+	int slots;
+	struct saved_thread *next;
+	SavedFrame frame[0];
+} SavedThread;
 
 typedef struct pheap {
 	void *base_address;
+	void *hash_base;	/* address the pool was created at, object hash codes are relative to it */
+	void *reloc_bases[RELOC_MAX_BASES];	/* targets of interrupted relocations */
+	int reloc_count;
+	unsigned long pool_size;
 	Chunk *freelist;
 	Chunk **chunkpp;
 	unsigned long heapfree;
@@ -848,11 +1049,21 @@ typedef struct pheap {
 	char *heapbase;
 	char *heapmax;
 	char *heaplimit;
-	nvmChunk *nvmfreelist;
-	nvmChunk **nvmChunkpp;
-	unsigned int nvmFreeSpace;
-	unsigned int nvmCurrentSize;
-	unsigned long nvm_limit;
+	char *nursery_base;	/* young generation of the last run, references */
+	char *nursery_limit;	/* into it are cleared on restart (see alloc.c) */
+	PHashDesc ht_descs[HT_DESC_COUNT];
+	PMEMoid markbits;	/* mark bits of the last collection */
+	PMEMoid forwarding;	/* forwarding table of the last compaction */
+	PMEMoid heap_extents[HEAP_MAX_EXTENTS];	/* extents the heap has grown by past heapMem */
+	unsigned long heap_bridges[HEAP_MAX_EXTENTS];	/* heap offsets of the ends of the extents before them */
+	int heap_extent_count;	/* extents the heap spans (see alloc.c) */
+	unsigned long compact_cursor;	/* heap offset objects have been moved up to */
+	int gc_phase;	/* GC_IDLE, GC_SWEEPING or GC_COMPACTING, see alloc.c */
+	int clean_shutdown;	/* set by a clean shutdown, cleared on open (see alloc.c) */
+	unsigned long block_hints[BLOCK_HINTS];	/* heap offsets of blocks live after the last collection */
+	int block_hint_count;
+	SavedThread *checkpoint;	/* threads saved by the last checkpoint */
+	unsigned long wal_generation;	/* first redo log to replay over the pool (see wal.c) */
 	OPC opc;
 	char* utf8_ht[UTF8_HT_SIZE];
 	char* bootCl_ht[BOOTCL_HT_SIZE];
@@ -861,8 +1072,8 @@ typedef struct pheap {
 	char* classes_ht[CLASSES_HT_SIZE];
 	char* monitor_ht[MONITOR_HT_SIZE];
 	char* zip_ht[ZIP_HT_SIZE];
-	char nvm[NVM_INIT_SIZE];
-	char heapMem[HEAP_SIZE];// heap contents
+	NVMSegment nvm[NVM_INIT_SEGMENTS];
+	char *heapMem;	// heap contents, maxHeap bytes allocated separately
 } PHeap;
 
 extern void* ph_malloc(int len);
@@ -876,8 +1087,34 @@ extern Object *allocObject(Class *class);
 extern Object *allocTypeArray(int type, int size);
 extern Object *allocArray(Class *class, int size, int el_size);
 extern Object *allocMultiArray(Class *array_class, int dim, intptr_t *count);
+// JaPHa Modification
+extern Object *allocObject0(Class *class, int young);
+extern Object *allocTypeArray0(int type, int size, int young);
+extern Object *allocArray0(Class *class, int size, int el_size, int young);
+extern Object *allocMultiArray0(Class *array_class, int dim, intptr_t *count,
+                                int young);
+// End of modification
 extern Object *cloneObject(Object *ob);
 extern uintptr_t getObjectHashcode(Object *ob);
+extern char *getObjectEnd(Object *ob);
+
+// JaPHa Modification
+extern int persist_by_reachability;
+extern int isTransient(Object *ob);
+extern void makeTransient(Object *ob);
+extern void publishObject(Object *ob);
+extern void publishReference(Object *holder, Object *value);
+extern void rememberYoungRef(Object *holder, Object *value);
+extern int nursery_enabled;
+extern void initialiseNursery(unsigned long size);
+extern int isStaleYoungRef(void *ref);
+extern void scrubYoungReferences();
+extern void shutdownPersistentHeap();
+extern int clean_restart;
+extern void publishAllTransient();
+extern int isYoungRef(void *ref);
+extern void markSavedSlots(uintptr_t *slot, uintptr_t *end);
+// End of modification
 
 extern void gc1();
 extern void runFinalizers();
@@ -895,6 +1132,11 @@ extern void *sysRealloc(void *ptr, unsigned int n);
  */
 extern void *sysMalloc_persistent(unsigned int n);
 extern void sysFree_persistent(void *addr);
+extern void initialiseNVM(int create);
+extern void rebuildNVMLists();
+extern void commitNVMFrees(TxState *tx_state);
+extern int inNVMRegion(void *addr);
+extern int poolRanges(PoolRange *ranges);
 extern void *sysRealloc_persistent(void *ptr, unsigned int n);
 
 /*	XXX NVM CHANGE 009.000.001	*/
@@ -907,6 +1149,8 @@ extern unsigned int get_heapfree();
 extern unsigned int get_nvmFreeSpace();
 extern int get_ldr_vmdata_offset();
 extern void set_ldr_vmdata_offset(int ldr);
+extern int ref_referent_offset;
+extern int ref_queue_offset;
 extern Class ** get_prim_classes();
 extern void set_prim_classes();
 extern void set_has_finaliser_list();
@@ -1070,9 +1314,29 @@ extern void initialiseException();
 /* interp */
 
 extern uintptr_t *executeJava();
+// JaPHa Modification
+extern uintptr_t *executeJavaPersistent();
+
+/* The interpreter is compiled twice, with and without the persistence
+   barriers.  The variant is fixed by the command line, so methods are
+   only ever prepared against one set of handlers */
+#define EXECUTE_JAVA() (persistent ? executeJavaPersistent() : executeJava())
+// End of modification
 extern void shutdownInterpreter();
 extern void initialiseInterpreter(InitArgs *args);
 
+// JaPHa Modification
+#ifdef DIRECT
+extern void rewritePersistent(MethodBlock *mb, Instruction *pc, int cache,
+                              int opcode, Operand operand);
+extern void unlinkClassCode(Class *class);
+extern void relocateMethodCode(MethodBlock *mb, void (*relocate)(void *slot));
+#ifdef INLINING
+extern void unwrapPersistent(MethodBlock *mb, PrepareInfo *info);
+#endif
+#endif
+// End of modification
+
 /* String */
 
 extern Object *findInternedString(Object *string);
@@ -1143,7 +1407,12 @@ extern void initialiseThreadStage1(InitArgs *args);
 extern void initialiseThreadStage2(InitArgs *args);
 extern ExecEnv *getExecEnv();
 
-extern void createJavaThread(Object *jThread, long long stack_size);
+// JaPHa Modification
+extern void createJavaThread0(Object *jThread, long long stack_size,
+                              SavedThread *resume);
+#define createJavaThread(jThread, stack_size) \
+    createJavaThread0(jThread, stack_size, NULL)
+// End of modification
 extern void mainThreadSetContextClassLoader(Object *loader);
 extern void mainThreadWaitToExitVM();
 extern void uncaughtException();
@@ -1238,7 +1507,14 @@ int nvml_alloc, persistent, errr, first_ex;
 PMEMobjpool *pop_heap;
 PMEMoid root_heap;
 PHeap *pheap;
-uint total_tx_count;
+
+extern TxState *getTxState();
+extern void recordBornObject(char *addr, int size);
+extern void flushBornRange(TxState *tx_state);
+extern void txAborted(TxState *tx_state);
+extern void logStore(TxState *tx_state, char *type, Object *ob,
+                     void *addr, int size);
+extern void resetWriteSet(TxState *tx_state);
 /*
 #define NVML_DIRECT(TYPE, PTR, SIZE) if(pmemobj_tx_stage() == TX_STAGE_WORK) { \
 										if(errr = pmemobj_tx_add_range_direct(PTR, SIZE)) { \
@@ -1266,29 +1542,118 @@ uint total_tx_count;
 					}
 */
 
-#define NVML_DIRECT(TYPE, PTR, SIZE) if(pmemobj_tx_stage() == TX_STAGE_WORK) { \
-										if(errr = pmemobj_tx_add_range_direct(PTR, SIZE)) { \
+#define IS_BORN(tx_state, PTR, SIZE) \
+    ((char*)(PTR) >= (tx_state)->born_start && \
+     (char*)(PTR) + (SIZE) <= (tx_state)->born_end)
+
+/* NVM emulation (see nvmemu.c).  Every flush and fence made through
+   libpmemobj is charged, as are undo log entries and commits */
+#define NVM_WRITE(BYTES, FENCES) \
+	(nvm_emulation ? nvmWrite(BYTES, FENCES) : (void)0)
+#define NVM_TX_ADD(tx_state, SIZE) \
+	(nvm_emulation ? nvmTxAdd(tx_state, SIZE) : (void)0)
+#define NVM_TX_COMMIT(tx_state) \
+	(nvm_emulation ? nvmTxCommit(tx_state) : (void)0)
+
+#define pmemobj_persist(pop, addr, len) \
+	(NVM_WRITE(len, 1), pmemobj_persist(pop, addr, len))
+#define pmemobj_flush(pop, addr, len) \
+	(NVM_WRITE(len, 0), pmemobj_flush(pop, addr, len))
+#define pmemobj_drain(pop) \
+	(NVM_WRITE(0, 1), pmemobj_drain(pop))
+
+/* Loads from the pool are only charged when built with NVMEMU_HEAP */
+#ifdef NVMEMU_HEAP
+#define NVM_READ(PTR, SIZE) \
+	if(PERSISTENT_STORES && nvm_emulation) \
+		nvmRead(PTR, SIZE);
+#else
+#define NVM_READ(PTR, SIZE)
+#endif
+
+/* In log mode a store only records its range in the thread's
+   redo set, the contents are copied to the log at commit.  Outside
+   a transaction there is no born range (see walFlush) */
+#define WAL_RANGE(PTR, SIZE) \
+	tx_state = getTxState(); \
+	if(!IS_BORN(tx_state, PTR, SIZE)) \
+		walRange(tx_state, (char*)(PTR), SIZE);
+
+/* Store barrier for a field or element of a heap object.  Unlike
+   NVML_DIRECT the snapshot is taken a cache line at a time, once per
+   transaction (see logStore) */
+#define NVML_STORE(TYPE, OB, PTR, SIZE) { \
+										TxState *tx_state; \
+										if(wal_mode) { \
+											WAL_RANGE(PTR, SIZE) \
+										} else if(!snapshot_mode && \
+										   (tx_state = getTxState())->stage == TX_STAGE_WORK && \
+										   !IS_BORN(tx_state, PTR, SIZE)) \
+											logStore(tx_state, TYPE, OB, PTR, SIZE); \
+									}
+
+/* The transaction stage is cached in the thread's TxState.  It is only
+   re-read from libpmemobj when it may have changed behind our back
+   (a failed add_range aborts the transaction, ending a nested one
+   returns to the outer) */
+#define NVML_DIRECT(TYPE, PTR, SIZE) { \
+										TxState *tx_state; \
+										if(wal_mode) { \
+											WAL_RANGE(PTR, SIZE) \
+										} else if(!snapshot_mode && \
+										   (tx_state = getTxState())->stage == TX_STAGE_WORK && \
+										   !IS_BORN(tx_state, PTR, SIZE) && \
+										   (NVM_TX_ADD(tx_state, SIZE), \
+										    errr = pmemobj_tx_add_range_direct(PTR, SIZE))) { \
 											printf("%s ERROR %d: could not add range to transaction\n", TYPE, errr); \
+											tx_state->stage = pmemobj_tx_stage(); \
+											txAborted(tx_state); \
 										} \
 									}
 
-#define BEGIN_TX(TYPE) if(errr = pmemobj_tx_begin(pop_heap, NULL, TX_LOCK_NONE)) { \
-					       printf("ERROR %d at BEGIN\n", errr); \
-                       } else {	\
-						   total_tx_count++; \
-						   if (FALSE) printf("BEGIN_TX(" #TYPE "), tx_count=%u\n", total_tx_count);	\
-					    } \
+#define BEGIN_TX(TYPE) { \
+						   TxState *tx_state = getTxState(); \
+						   if(snapshot_mode) { \
+							   tx_state->depth++; \
+						   } else if(errr = pmemobj_tx_begin(pop_heap, NULL, TX_LOCK_NONE)) { \
+							   printf("ERROR %d at BEGIN\n", errr); \
+						   } else { \
+							   if(tx_state->depth++ == 0) \
+								   tx_state->stores = 0; \
+							   tx_state->stage = TX_STAGE_WORK; \
+							   if (FALSE) printf("BEGIN_TX(" #TYPE "), tx_depth=%d\n", tx_state->depth); \
+						   } \
+					   }
 
 // JAPHA: should flushPHValue be here?
-#define END_TX(TYPE) if(pmemobj_tx_stage() == TX_STAGE_WORK) { \
-					     pmemobj_tx_process(); \
-				     } \
-				     if(pmemobj_tx_stage() != TX_STAGE_NONE) { \
-					     flushPHValues(); \
-					     pmemobj_tx_end(); \
-   					     total_tx_count--; \
-					     if (FALSE) printf("END_TX(" #TYPE "), tx_count=%u\n", total_tx_count);	\
-				     }
+#define END_TX(TYPE) { \
+						 TxState *tx_state = getTxState(); \
+						 if(snapshot_mode) { \
+							 if(tx_state->depth == 1 && wal_mode) \
+								 walCommit(tx_state); \
+							 if(tx_state->depth > 0) \
+								 tx_state->depth--; \
+						 } else { \
+							 if(tx_state->depth == 1) { \
+								 if(tx_state->stage != TX_STAGE_WORK) \
+									 txAborted(tx_state); \
+								 else if(tx_state->nvm_free_count > 0) \
+									 commitNVMFrees(tx_state); \
+								 resetWriteSet(tx_state); \
+								 NVM_TX_COMMIT(tx_state); \
+							 } \
+							 if(tx_state->stage == TX_STAGE_WORK) { \
+								 pmemobj_tx_process(); \
+							 } \
+							 if(tx_state->depth > 0) { \
+								 flushPHValues(); \
+								 pmemobj_tx_end(); \
+								 tx_state->depth--; \
+								 tx_state->stage = pmemobj_tx_stage(); \
+								 if (FALSE) printf("END_TX(" #TYPE "), tx_depth=%d\n", tx_state->depth); \
+							 } \
+						 } \
+					 }
 
 /*
 #define NVML_DIRECT(TYPE, PTR, SIZE) do {} while (0);
@@ -1297,4 +1662,131 @@ uint total_tx_count;
 //	#define END_TX(TYPE)  do {} while (0);
 */
 extern void flushPHValues();
+
+/* persist */
+
+extern int epoch_limit;
+extern volatile unsigned int durable_epoch;
+
+extern void openEpoch(ExecEnv *ee);
+extern void closeEpoch(ExecEnv *ee);
+extern void renewEpoch(ExecEnv *ee);
+extern void commitEpoch(ExecEnv *ee);
+extern void initialisePersistence(InitArgs *args);
+extern void faseLock(Object *obj);
+extern void faseUnlock(Object *obj);
+
+/* checkpoint */
+
+extern volatile int checkpoint_requested;
+
+extern void checkpointSafepoint(ExecEnv *ee, uintptr_t *top);
+extern int resumeCheckpoint();
+extern void resumeJavaStack(SavedThread *saved);
+extern void scanCheckpoint();
+
+/* snapshot */
+
+extern int snapshot_mode;
+
+extern int restoreSnapshot(char *pool_path);
+extern void initialiseSnapshots(InitArgs *args);
+extern void persistSnapshotHeap();
+extern void requestSnapshot();
+
+/* wal */
+
+extern int wal_mode;
+
+extern void replayLog(char *pool_path, int replay);
+extern void truncateLog(unsigned long generation);
+extern void initialiseLog(InitArgs *args);
+extern void startLog();
+extern unsigned long rotateLog(int barrier);
+extern void logBarrier();
+extern void syncLog();
+extern void dropLogs();
+extern void walRange(TxState *tx_state, char *addr, int size);
+extern void walCommit(TxState *tx_state);
+extern void walFlush(TxState *tx_state);
+extern void walBeginGC(TxState *tx_state);
+extern void walEndGC(TxState *tx_state);
+
+/* nvmemu */
+
+extern int nvm_emulation;
+
+extern void initialiseNVMEmulation(InitArgs *args);
+extern void nvmWrite(unsigned long bytes, int fences);
+extern void nvmRead(void *addr, int size);
+extern void nvmTxAdd(TxState *tx_state, int size);
+extern void nvmTxCommit(TxState *tx_state);
+
+/* Whether the barriers below are compiled in.  Within the interpreter
+   this is a constant (see interp/engine/interp-persist.c), so the
+   volatile handlers carry no persistence code at all */
+#ifndef PERSISTENT_STORES
+#define PERSISTENT_STORES persistent
+#endif
+
+/* Store barrier brackets used by the interpreter.  Without epochs
+   each store is its own transaction.  With epochs the store is
+   logged into the thread's open epoch, which is renewed first if
+   it is full or older than the global epoch.  Inside a failure-atomic
+   section the store is simply logged into the section.  In snapshot
+   mode nothing is logged at all, unless the redo log is on, when the
+   store is again its own bracket */
+#define BEGIN_STORE(TYPE) if((snapshot_mode && !wal_mode) || ee->fase_depth) { \
+						  } else if(epoch_limit) { \
+							  if(!ee->epoch_open || ee->epoch_stores >= epoch_limit || \
+								 ee->epoch != durable_epoch) \
+								  renewEpoch(ee); \
+						  } else { \
+							  BEGIN_TX(TYPE) \
+						  }
+
+/* Stores into transient objects bypass the persistence path
+   altogether.  A reference stored into a durable object or a
+   static field publishes the referenced object first */
+#define DURABLE_STORE(ob) (PERSISTENT_STORES && !isTransient(ob))
+
+#define PUBLISH(ob) { \
+					Object *_pub = (Object*)(ob); \
+					if(_pub != NULL && isTransient(_pub)) \
+						publishObject(_pub); \
+				}
+
+/* A reference to a young object stored into a heap object adds the
+   holder to the remembered set (see rememberYoungRef) */
+#define REMEMBER(holder, ob) { \
+					if(nursery_enabled) \
+						rememberYoungRef((Object*)(holder), (Object*)(ob)); \
+				}
+
+#define END_STORE(TYPE) if((snapshot_mode && !wal_mode) || ee->fase_depth) { \
+						} else if(epoch_limit) { \
+							ee->epoch_stores++; \
+						} else { \
+							END_TX(TYPE) \
+						}
+
+/* Allocation brackets used by the interpreter.  With a young
+   generation the object is bump-allocated in DRAM and the
+   persistence path is not entered at all, otherwise it is
+   allocated in the NVM heap within a transaction and starts
+   out transient.  Whether the object is young is passed to the
+   allocation function (YOUNG_ALLOC), so allocations made while
+   resolving the array class are not young */
+#define YOUNG_ALLOC (PERSISTENT_STORES && nursery_enabled)
+
+#define BEGIN_ALLOC(TYPE) if(PERSISTENT_STORES && !nursery_enabled) { \
+							  BEGIN_STORE(TYPE) \
+							  nvml_alloc = TRUE; \
+						  }
+
+#define END_ALLOC(TYPE, ob) if(PERSISTENT_STORES && !nursery_enabled) { \
+								END_STORE(TYPE) \
+								nvml_alloc = FALSE; \
+								makeTransient(ob); \
+							}
 // End of modification
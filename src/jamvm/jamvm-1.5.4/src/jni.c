@@ -870,7 +870,13 @@ jarray Jam_GetObjectArrayElement(JNIEnv *env, jobjectArray array, jsize index) {
 void Jam_SetObjectArrayElement(JNIEnv *env, jobjectArray array, jsize index,
                                jobject value) {
 
+    // JaPHa Modification
+    publishReference(REF_TO_OBJ(array), REF_TO_OBJ(value));
+    // End of modification
     ARRAY_DATA(REF_TO_OBJ(array), Object*)[index] = value;
+    // JaPHa Modification
+    REMEMBER(REF_TO_OBJ(array), REF_TO_OBJ(value))
+    // End of modification
 }
 
 jint Jam_RegisterNatives(JNIEnv *env, jclass clazz,
@@ -883,12 +889,12 @@ jint Jam_UnregisterNatives(JNIEnv *env, jclass clazz) {
 }
 
 jint Jam_MonitorEnter(JNIEnv *env, jobject obj) {
-    objectLock(REF_TO_OBJ(obj));
+    faseLock(REF_TO_OBJ(obj));
     return JNI_OK;
 }
 
 jint Jam_MonitorExit(JNIEnv *env, jobject obj) {
-    objectUnlock(REF_TO_OBJ(obj));
+    faseUnlock(REF_TO_OBJ(obj));
     return JNI_OK;
 }
 
@@ -993,7 +999,13 @@ void Jam_SetObjectField(JNIEnv *env, jobject obj, jfieldID fieldID,
     Object *ob = REF_TO_OBJ(obj);
     FieldBlock *fb = fieldID;
 
+    // JaPHa Modification
+    publishReference(ob, REF_TO_OBJ(value));
+    // End of modification
     INST_DATA(ob, jobject, fb->u.offset) = value;
+    // JaPHa Modification
+    REMEMBER(ob, REF_TO_OBJ(value))
+    // End of modification
 }
 
 jobject Jam_GetStaticObjectField(JNIEnv *env, jclass clazz, jfieldID fieldID) {
@@ -1005,7 +1017,14 @@ void Jam_SetStaticObjectField(JNIEnv *env, jclass clazz, jfieldID fieldID,
                               jobject value) {
 
     FieldBlock *fb = fieldID;
+
+    // JaPHa Modification
+    publishReference(NULL, REF_TO_OBJ(value));
+    // End of modification
     fb->u.static_value.p = value;
+    // JaPHa Modification
+    REMEMBER(fb->class, REF_TO_OBJ(value))
+    // End of modification
 }
 
 #define VIRTUAL_METHOD(type, native_type)                                    \
@@ -186,6 +186,11 @@ int monitorWait0(Monitor *mon, Thread *self, long long ms, int ns,
     if(mon->owner != self)
         return FALSE;
 
+    // JaPHa Modification
+    /* Don't keep an open durability epoch while blocked */
+    epochSafepoint(self);
+    // End of modification
+
     disableSuspend(self);
 
     /* Unlock the monitor.  As it could be recursively
@@ -194,6 +199,11 @@ int monitorWait0(Monitor *mon, Thread *self, long long ms, int ns,
     mon->owner = NULL;
     mon->count = 0;
 
+    // JaPHa Modification
+    /* Re-entered when resuming from a checkpoint (see checkpoint.c) */
+    self->wait_lock_count = old_count;
+    // End of modification
+
     /* Counter used in thin-lock deflation */
     mon->in_wait++;
 
@@ -357,6 +367,12 @@ void objectLock(Object *obj) {
 
     TRACE("Thread %p lock on obj %p...\n", self, obj);
 
+    // JaPHa Modification
+    /* Counted so a shutdown can tell no lock word is left
+       owned (see shutdownPersistentHeap) */
+    self->locks_held++;
+    // End of modification
+
     if(LOCKWORD_COMPARE_AND_SWAP(&obj->lock, 0, thin_locked)) {
         /* This barrier is not needed for the thin-locking implementation;
            it's a requirement of the Java memory model. */
@@ -420,6 +436,10 @@ void objectUnlock(Object *obj) {
     TRACE("Thread %p unlock on obj %p...\n", self, obj);
 
     if(lockword == thin_locked) {
+        // JaPHa Modification
+        self->locks_held--;
+        // End of modification
+
         /* This barrier is not needed for the thin-locking implementation;
            it's a requirement of the Java memory model. */
         JMM_UNLOCK_MBARRIER();
@@ -443,12 +463,20 @@ retry:
             monitorUnlock(mon, self);
         }
     } else {
-        if((lockword & (TID_MASK|SHAPE_BIT)) == thin_locked)
+        if((lockword & (TID_MASK|SHAPE_BIT)) == thin_locked) {
+            // JaPHa Modification
+            self->locks_held--;
+            // End of modification
             LOCKWORD_WRITE(&obj->lock, lockword - (1<<COUNT_SHIFT));
-        else
+        } else
             if((lockword & SHAPE_BIT) != 0) {
                 Monitor *mon = (Monitor*) (lockword & ~SHAPE_BIT);
 
+                // JaPHa Modification
+                if(mon->owner == self)
+                    self->locks_held--;
+                // End of modification
+
                 if((mon->count == 0) && (LOCKWORD_READ(&mon->entering) == 0) &&
                                 (mon->in_wait == 0)) {
                     TRACE("Thread %p is deflating obj %p...\n", self, obj);
@@ -564,12 +592,54 @@ Thread *objectLockedBy(Object *obj) {
     return owner;
 }
 
+// JaPHa Modification
+/* The lock words referring to the monitor have been cleared
+   (see resumeHeap), so it is left free for reuse */
+static void resetMonitor(Monitor *mon) {
+    Object *obj = mon->obj;
+
+    monitorInit(mon);
+    mon->obj = obj;
+    mon->entering = UN_USED;
+}
+
+/* At shutdown, once all threads are stopped.  An object is inflated
+   while its monitor is in use, even if the object is not locked */
+int monitorsInUse() {
+    int in_use = 0;
+
+#define ITERATE(ptr)                                     \
+    if(LOCKWORD_READ(&((Monitor*)ptr)->entering) != UN_USED) \
+        in_use++;
+
+    hashIterate(mon_cache);
+#undef ITERATE
+
+    return in_use;
+}
+// End of modification
+
 void initialiseMonitor(InitArgs *args) {
 
     /* Init hash table, create lock */
     /* XXX NVM CHANGE 005.001.006 - Monitors HT - N*/
     // JaPHa Modification
     initHashTable(mon_cache, MONITOR_HT_ENTRY_COUNT, TRUE, HT_NAME_MONITOR, TRUE);
+
+    /* Detach monitors from objects which were young when the VM
+       stopped -- a new object at the same address must not find
+       them (see scrubYoungReferences).  After a crash the monitors
+       are also freed of the last run's owners and waiters */
+#define ITERATE(ptr) {                     \
+    Monitor *mon = (Monitor*)ptr;          \
+    if(isStaleYoungRef(mon->obj))          \
+        mon->obj = NULL;                   \
+    if(!clean_restart)                     \
+        resetMonitor(mon);                 \
+}
+
+    hashIterate(mon_cache);
+#undef ITERATE
     // End of modification
 }
 
@@ -40,6 +40,7 @@ extern void objectWait0(Object *ob, long long ms, int ns, int interruptible);
 extern int objectLockedByCurrent(Object *ob);
 extern Thread *objectLockedBy(Object *ob);
 extern void threadMonitorCache();
+extern int monitorsInUse();
 
 #define objectWait(ob, ms, ns) \
     objectWait0(ob, ms, ns, TRUE)
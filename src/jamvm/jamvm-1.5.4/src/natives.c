@@ -117,6 +117,27 @@ uintptr_t *arraycopy(Class *class, MethodBlock *mb, uintptr_t *ostack) {
             return ostack;
         }
 
+        // JaPHa Modification
+        /* Copying references into a durable array publishes them */
+        if(persist_by_reachability && !isTransient(dest) &&
+                  ((scb->name[1] == 'L') || (scb->name[1] == '['))) {
+            int i;
+
+            for(i = 0; i < length; i++)
+                publishReference(dest, ((Object**)sdata)[start1 + i]);
+        }
+
+        /* Copying references to young objects into the heap
+           remembers the array */
+        if(nursery_enabled &&
+                  ((scb->name[1] == 'L') || (scb->name[1] == '['))) {
+            int i;
+
+            for(i = 0; i < length; i++)
+                rememberYoungRef(dest, ((Object**)sdata)[start1 + i]);
+        }
+        // End of modification
+
         if(isInstanceOf(dest->class, src->class)) {
             int size = sigElement2Size(scb->name[1]);
             memmove(ddata + start2*size, sdata + start1*size, length*size);
@@ -649,6 +670,9 @@ uintptr_t *defineClass0(Class *clazz, MethodBlock *mb, uintptr_t *ostack) {
 
             if(class != NULL) {
                 INST_DATA(class, uintptr_t, pd_offset) = pd;
+                // JaPHa Modification
+                REMEMBER(class, pd)
+                // End of modification
                 linkClass(class);
             }
 
@@ -1029,8 +1053,22 @@ uintptr_t *fieldSet(Class *class, MethodBlock *mb, uintptr_t *ostack) {
     void *field = getPntr2Field(ostack);
 
     if(field != NULL) {
-        int size = unwrapAndWidenObject(field_type, value, field,
-                                        REF_DST_FIELD);
+        int size;
+
+        // JaPHa Modification
+        /* A primitive field is set from a wrapper, which isn't stored */
+        if(!IS_PRIMITIVE(CLASS_CB(field_type))) {
+            FieldBlock *fb = getFieldFieldBlock((Object*)ostack[0]);
+
+            publishReference(fb->access_flags & ACC_STATIC ? NULL
+                                              : (Object*)ostack[1], value);
+            REMEMBER(fb->access_flags & ACC_STATIC ? (Object*)fb->class
+                                              : (Object*)ostack[1], value)
+        }
+        // End of modification
+
+        size = unwrapAndWidenObject(field_type, value, field,
+                                    REF_DST_FIELD);
 
         if(size == 0)
             signalException(java_lang_IllegalArgumentException,
@@ -1560,6 +1598,13 @@ uintptr_t *compareAndSwapObject(Class *class, MethodBlock *mb,
     uintptr_t update = ostack[5];
     int result;
 
+    // JaPHa Modification
+    /* Published before the swap, as it may be seen as soon as
+       it's stored.  Should the swap fail it's durable early */
+    publishReference((Object*)ostack[1], (Object*)update);
+    REMEMBER(ostack[1], update)
+    // End of modification
+
 #ifdef COMPARE_AND_SWAP
     result = COMPARE_AND_SWAP(addr, expect, update);
 #else
@@ -1578,6 +1623,11 @@ uintptr_t *putOrderedObject(Class *class, MethodBlock *mb, uintptr_t *ostack) {
     volatile uintptr_t *addr = (uintptr_t*)((char *)ostack[1] + offset);
     uintptr_t value = ostack[4];
 
+    // JaPHa Modification
+    publishReference((Object*)ostack[1], (Object*)value);
+    REMEMBER(ostack[1], value)
+    // End of modification
+
     *addr = value;
     return ostack;
 }
@@ -1587,6 +1637,11 @@ uintptr_t *putObjectVolatile(Class *class, MethodBlock *mb, uintptr_t *ostack) {
     volatile uintptr_t *addr = (uintptr_t*)((char *)ostack[1] + offset);
     uintptr_t value = ostack[4];
 
+    // JaPHa Modification
+    publishReference((Object*)ostack[1], (Object*)value);
+    REMEMBER(ostack[1], value)
+    // End of modification
+
     MBARRIER();
     *addr = value;
 
@@ -1608,6 +1663,11 @@ uintptr_t *putObject(Class *class, MethodBlock *mb, uintptr_t *ostack) {
     uintptr_t *addr = (uintptr_t*)((char *)ostack[1] + offset);
     uintptr_t value = ostack[4];
 
+    // JaPHa Modification
+    publishReference((Object*)ostack[1], (Object*)value);
+    REMEMBER(ostack[1], value)
+    // End of modification
+
     *addr = value;
     return ostack;
 }
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2003, 2004, 2005, 2006, 2007, 2008, 2009
+ * Robert Lougher <rob@jamvm.org.uk>.
+ *
+ * This file is part of JamVM.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+// JaPHa Modification
+/* NVM emulation (-Xnvmwrite, -Xnvmread).
+
+   On DRAM the persistence paths run faster than they would on NVM.
+   With emulation on, delays are injected where NVM would stall the
+   thread.  Every fence -- a drain or persist, an undo log entry, and
+   the two of a transaction commit -- costs the write latency, and the
+   bytes flushed are queued on a write channel whose bandwidth is
+   shared by all threads.  Plain stores are absorbed by the caches on
+   NVM as well, so they are paid for when they are flushed.
+
+   When built with NVMEMU_HEAP, the persistent interpreter's field and
+   array loads from the pool also cost the read latency and are queued
+   on a read channel.  It is a build option so that the volatile
+   handlers, and builds which don't want it, don't check on every load.
+
+   A thread owes its delays and pays them off by spinning on the
+   monotonic clock once they add up to NVMEMU_QUANTUM, so a short
+   delay doesn't pay for a clock read of its own.  The cost of a clock
+   read is measured on startup and is deducted. */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "jam.h"
+#include "thread.h"
+
+/* Delay in ns which is owed before it is paid */
+#define NVMEMU_QUANTUM 1000
+
+/* Bytes written to the undo log besides the range */
+#define UNDO_ENTRY_HEADER 16
+
+/* Clock reads averaged over to calibrate */
+#define CALIBRATE_READS 1000
+
+typedef struct nvm_channel {
+    long latency;             /* ns per access or fence */
+    long ps_per_byte;         /* transfer time, 0 = unlimited */
+    volatile uintptr_t busy;  /* clock time the channel is busy until */
+} NVMChannel;
+
+int nvm_emulation = FALSE;
+
+static NVMChannel write_channel, read_channel;
+static long clock_cost;
+
+/* Owed by threads which aren't VM threads */
+static long other_debt;
+
+static uintptr_t nanoClock() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uintptr_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Queues a transfer behind those already on the channel, and
+   returns how long the caller must wait for it to complete */
+static long transfer(NVMChannel *channel, unsigned long bytes) {
+    uintptr_t now, start, end, busy;
+
+    if(channel->ps_per_byte == 0 || bytes == 0)
+        return 0;
+
+    now = nanoClock();
+
+    do {
+        busy = channel->busy;
+        start = busy > now ? busy : now;
+        end = start + bytes * channel->ps_per_byte / 1000;
+    } while(!COMPARE_AND_SWAP(&channel->busy, busy, end));
+
+    return end - now > clock_cost ? end - now - clock_cost : 0;
+}
+
+static void delay(long ns) {
+    Thread *self = threadSelf();
+    long *debt = self != NULL && self->ee != NULL ? &self->ee->nvm_debt
+                                                  : &other_debt;
+
+    if((*debt += ns) >= NVMEMU_QUANTUM) {
+        uintptr_t until = nanoClock() + *debt - clock_cost;
+
+        while(nanoClock() < until);
+        *debt = 0;
+    }
+}
+
+void nvmWrite(unsigned long bytes, int fences) {
+    delay(fences * write_channel.latency + transfer(&write_channel, bytes));
+}
+
+void nvmRead(void *addr, int size) {
+    if((char*)addr >= (char*)pop_heap &&
+            (char*)addr < (char*)pop_heap + pheap->pool_size)
+        delay(read_channel.latency + transfer(&read_channel, size));
+}
+
+/* The undo log entry is made durable before the range is written.
+   The range itself is flushed at commit */
+void nvmTxAdd(TxState *tx_state, int size) {
+    tx_state->nvm_bytes += size;
+    nvmWrite(size + UNDO_ENTRY_HEADER, 1);
+}
+
+/* The ranges are flushed and drained, then the undo log is cleared */
+void nvmTxCommit(TxState *tx_state) {
+    nvmWrite(tx_state->nvm_bytes, 2);
+    tx_state->nvm_bytes = 0;
+}
+
+static void initChannel(NVMChannel *channel, int latency, int bandwidth) {
+    channel->latency = latency;
+    channel->ps_per_byte = bandwidth > 0 ? 1000000 / bandwidth : 0;
+}
+
+void initialiseNVMEmulation(InitArgs *args) {
+    uintptr_t start;
+    int i;
+
+    if(!args->persistent_heap ||
+            (args->nvm_write_latency <= 0 && args->nvm_write_bandwidth <= 0 &&
+             args->nvm_read_latency <= 0 && args->nvm_read_bandwidth <= 0))
+        return;
+
+    initChannel(&write_channel, args->nvm_write_latency,
+                args->nvm_write_bandwidth);
+    initChannel(&read_channel, args->nvm_read_latency,
+                args->nvm_read_bandwidth);
+
+    for(start = nanoClock(), i = 0; i < CALIBRATE_READS; i++)
+        nanoClock();
+
+    clock_cost = (nanoClock() - start) / (CALIBRATE_READS + 1);
+    nvm_emulation = TRUE;
+
+    jam_printf("<NVM emulation: write %dns %dMB/s, read %dns %dMB/s, "
+               "clock read %ldns>\n",
+               args->nvm_write_latency, args->nvm_write_bandwidth,
+               args->nvm_read_latency, args->nvm_read_bandwidth, clock_cost);
+
+#ifndef NVMEMU_HEAP
+    if(args->nvm_read_latency > 0 || args->nvm_read_bandwidth > 0)
+        jam_printf("<NVM emulation: heap loads aren't charged, "
+                   "build with NVMEMU_HEAP>\n");
+#endif
+}
+// End of modification
@@ -0,0 +1,385 @@
+/*
+ * Copyright (C) 2003, 2004, 2005, 2006, 2007, 2008, 2009
+ * Robert Lougher <rob@jamvm.org.uk>.
+ *
+ * This file is part of JamVM.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+// JaPHa Modification
+/* Durability epochs for the persistent heap.
+
+   By default every persistent store executed by the interpreter is
+   wrapped in its own libpmemobj transaction.  In epoch mode the store
+   barrier only records the range into the undo log of a long-running,
+   per-thread transaction (the thread's write set).  The whole epoch is
+   then committed atomically, either after a number of stores, when the
+   epoch timer advances the global epoch, or when the thread reaches a
+   safepoint (blocking, exiting or shutting down the VM).  A crash loses
+   at most the stores of the open epochs.
+
+   Java synchronized regions are failure-atomic sections (FASEs).  The
+   section is keyed to the outermost monitor held by the thread: the
+   transaction begins when the thread acquires its first monitor and
+   commits when it releases its last, on both the normal and the
+   exceptional (unwinding) path.  Stores inside a section go straight
+   into the section's log without any per-store transaction. */
+
+#include <stdio.h>
+
+#include "jam.h"
+#include "thread.h"
+#include "lock.h"
+
+/* Trace epoch commits */
+#ifdef TRACEEPOCH
+#define TRACE_EPOCH(fmt, ...) jam_printf(fmt, ## __VA_ARGS__)
+#else
+#define TRACE_EPOCH(fmt, ...)
+#endif
+
+/* Maximum number of stores in an epoch.  Zero means
+   epochs are disabled (one transaction per store) */
+int epoch_limit = 0;
+
+/* The global epoch, advanced by the epoch timer thread.  A
+   thread whose epoch is older than this closes it on its
+   next persistent store */
+volatile unsigned int durable_epoch = 0;
+
+/* Epoch timer period in milliseconds */
+static int epoch_interval;
+
+/* Transaction state used before the main thread
+   has been setup (see initialiseThreadStage1) */
+static TxState boot_tx_state;
+
+TxState *getTxState() {
+    Thread *self = threadSelf();
+
+    return self != NULL ? &self->ee->tx : &boot_tx_state;
+}
+
+void openEpoch(ExecEnv *ee) {
+    BEGIN_TX("EPOCH")
+
+    ee->epoch_open = TRUE;
+    ee->epoch_stores = 0;
+    ee->epoch = durable_epoch;
+}
+
+void closeEpoch(ExecEnv *ee) {
+    if(ee == NULL || !ee->epoch_open)
+        return;
+
+    TRACE_EPOCH("<EPOCH: committing %d stores (epoch %u)>\n",
+                ee->epoch_stores, ee->epoch);
+
+    ee->epoch_open = FALSE;
+    END_TX("EPOCH")
+}
+
+/* Called by the store barrier when the current epoch is full,
+   stale or not yet open.  The old epoch is committed before
+   the new one is begun so the store which triggered the renewal
+   is logged into the new epoch */
+
+void renewEpoch(ExecEnv *ee) {
+    closeEpoch(ee);
+    openEpoch(ee);
+}
+
+/* Safepoint hook.  Called when a thread is about to block, exit or
+   shut down the VM -- any stores recorded in the thread's open
+   epoch are committed so they don't stay volatile indefinitely */
+
+void epochSafepoint(Thread *thread) {
+    ExecEnv *ee;
+
+    if(!persistent || thread == NULL || (ee = thread->ee) == NULL)
+        return;
+
+    if(epoch_limit)
+        closeEpoch(ee);
+
+    /* Blocking inside a section (e.g. Object.wait) releases the
+       monitor, so the section's stores must be made durable before
+       other threads can observe them.  The section carries on in a
+       new transaction */
+    if(ee->fase_depth) {
+        END_TX("FASE")
+        BEGIN_TX("FASE")
+    }
+}
+
+/* Commits the stores of the thread's epoch where it may stay for
+   long: at an invoke once the epoch is stale, entering a JNI native
+   (which may block in I/O) and parking for a collection.  The epoch
+   timer can't commit it on the thread's behalf as libpmemobj
+   transactions belong to a thread.  The thread may be within a store
+   bracket, so the epoch is renewed rather than closed, and it is
+   left alone while a nested transaction is open */
+
+void commitEpoch(ExecEnv *ee) {
+    if(ee == NULL || !ee->epoch_open || ee->tx.depth != 1)
+        return;
+
+    if(ee->epoch_stores > 0)
+        renewEpoch(ee);
+    else
+        ee->epoch = durable_epoch;
+}
+
+/* Objects allocated inside a transaction are unreachable should it
+   roll back, so stores into them need not be undo-logged (see
+   NVML_DIRECT).  Allocation is first-fit and usually carves
+   consecutive objects from the same chunk, so a single contiguous
+   range per thread captures most of them.  A non-adjacent allocation
+   flushes the current range and starts a new one.  In log mode an
+   object allocated outside a transaction is logged along with the
+   allocator's stores, once it is cleared */
+
+void recordBornObject(char *addr, int size) {
+    TxState *tx_state = getTxState();
+
+    if(tx_state->depth == 0) {
+        if(wal_mode) {
+            walRange(tx_state, addr, size);
+            walFlush(tx_state);
+        }
+        return;
+    }
+
+    if(addr != tx_state->born_end) {
+        flushBornRange(tx_state);
+        tx_state->born_start = addr;
+    }
+
+    tx_state->born_end = addr + size;
+}
+
+/* Called at the outermost commit, and by the GC as objects
+   may be freed or moved out from under the range.  The drain
+   at commit orders the flush before the commit record.  In log
+   mode the range is copied to the redo log at commit instead */
+
+void flushBornRange(TxState *tx_state) {
+    if(tx_state->born_end > tx_state->born_start) {
+        if(wal_mode)
+            walRange(tx_state, tx_state->born_start,
+                     tx_state->born_end - tx_state->born_start);
+        else if(!snapshot_mode)
+            pmemobj_flush(pop_heap, tx_state->born_start,
+                          tx_state->born_end - tx_state->born_start);
+    }
+
+    tx_state->born_start = tx_state->born_end = NULL;
+}
+
+/* Called when the thread's transaction aborts.  The allocations made
+   in it are rolled back, so the born range may cover memory which is
+   free, or which is handed out again to an object that must be logged.
+   The NVM metadata allocator's volatile state is rebuilt likewise, and
+   the frees it deferred to the commit are dropped */
+
+void txAborted(TxState *tx_state) {
+    tx_state->born_start = tx_state->born_end = NULL;
+    tx_state->nvm_free_count = 0;
+    rebuildNVMLists();
+}
+
+/* The write set.  The first store to a cache line within a transaction
+   snapshots the whole line, clamped to the object being stored into so
+   the snapshot never covers another object.  Later stores to the same
+   part of the line are not logged at all.  The part is keyed by where
+   it starts, the line or the object whichever is later, so a store to
+   another object sharing the line snapshots its own part.  At commit
+   libpmemobj flushes each snapshotted line once followed by a single
+   drain.  Should the set fill up stores are logged individually */
+
+#define WS_HASH(key) ((((key) / sizeof(uintptr_t)) * 2654435761U) & (WS_SIZE - 1))
+
+static int writeSetInsert(TxState *tx_state, uintptr_t key) {
+    int i = WS_HASH(key);
+
+    while(tx_state->ws_lines[i] != 0) {
+        if(tx_state->ws_lines[i] == key)
+            return FALSE;
+        i = (i + 1) & (WS_SIZE - 1);
+    }
+
+    tx_state->ws_lines[i] = key;
+    tx_state->ws_used[tx_state->ws_count++] = i;
+    return TRUE;
+}
+
+static void addRange(TxState *tx_state, char *type, void *addr, int size) {
+    NVM_TX_ADD(tx_state, size);
+
+    if((errr = pmemobj_tx_add_range_direct(addr, size))) {
+        jam_fprintf(stderr, "%s ERROR %d: could not add range to "
+                    "transaction\n", type, errr);
+        tx_state->stage = pmemobj_tx_stage();
+        txAborted(tx_state);
+    }
+}
+
+void logStore(TxState *tx_state, char *type, Object *ob,
+              void *addr, int size) {
+
+    uintptr_t line = (uintptr_t)addr & ~(WS_LINE_SIZE - 1);
+    uintptr_t last = ((uintptr_t)addr + size - 1) & ~(WS_LINE_SIZE - 1);
+    char *ob_end = NULL;
+
+    tx_state->stores++;
+
+    for(; line <= last; line += WS_LINE_SIZE) {
+        char *start = (char*)line;
+        char *end = start + WS_LINE_SIZE;
+
+        /* Keep the load factor below 1/2 */
+        if(tx_state->ws_count >= WS_SIZE / 2) {
+            addRange(tx_state, type, addr, size);
+            return;
+        }
+
+        if(start < (char*)ob)
+            start = (char*)ob;
+
+        if(!writeSetInsert(tx_state, (uintptr_t)start))
+            continue;
+
+        if(ob_end == NULL)
+            ob_end = getObjectEnd(ob);
+
+        if(end > ob_end)
+            end = ob_end;
+
+        addRange(tx_state, type, start, end - start);
+    }
+}
+
+/* Called at the outermost commit and by the GC.  In log mode the
+   born range of a transaction open across a collection is added to
+   its redo set, whose contents are only copied when it commits */
+
+void resetWriteSet(TxState *tx_state) {
+    int i;
+
+    for(i = 0; i < tx_state->ws_count; i++)
+        tx_state->ws_lines[tx_state->ws_used[i]] = 0;
+
+    tx_state->ws_count = 0;
+    flushBornRange(tx_state);
+}
+
+/* Failure-atomic sections.  Used in place of objectLock/objectUnlock
+   for Java-level monitors (monitorenter/monitorexit, synchronized
+   methods and JNI MonitorEnter/MonitorExit) */
+
+void faseLock(Object *obj) {
+    ExecEnv *ee;
+
+    if(!persistent) {
+        objectLock(obj);
+        return;
+    }
+
+    ee = getExecEnv();
+
+    /* Commit any stores made before the section so the section
+       is a transaction of its own, and no epoch is kept open
+       while blocking on the monitor */
+    if(ee->fase_depth == 0 && epoch_limit)
+        closeEpoch(ee);
+
+    objectLock(obj);
+
+    if(ee->fase_depth++ == 0) {
+        BEGIN_TX("FASE")
+        TRACE_EPOCH("<FASE: begin on obj %p>\n", obj);
+    }
+
+    /* Log the lock word so it is restored on recovery.  The
+       monitor is held, so no other thread can change it between
+       the snapshot and the section's stores */
+    NVML_DIRECT("ENTEROBJ", obj, sizeof(Object));
+}
+
+void faseUnlock(Object *obj) {
+    ExecEnv *ee;
+
+    /* The outermost section commits before the monitor is
+       released, so the next owner only sees durable state */
+    if(persistent && (ee = getExecEnv())->fase_depth > 0 &&
+                     --ee->fase_depth == 0) {
+        TRACE_EPOCH("<FASE: commit on obj %p>\n", obj);
+        END_TX("FASE")
+    }
+
+    objectUnlock(obj);
+}
+
+/* The epoch timer loop.  Advancing the global epoch bounds the
+   data-loss window of threads which keep storing, and of threads
+   which reach an invoke (see commitEpoch) */
+
+void epochTimerThreadLoop(Thread *self) {
+    for(;;) {
+        threadSleep(self, epoch_interval, 0);
+        durable_epoch++;
+    }
+}
+
+/* Epochs and persistence by reachability are enabled once the VM
+   has been initialised -- during initialisation all stores belong
+   to the INITVM transaction and all objects are durable */
+
+void initialisePersistence(InitArgs *args) {
+    if(!persistent)
+        return;
+
+    /* Snapshots take the place of transactions.  Every object in
+       the NVM heap is in the next snapshot, so objects are neither
+       transient nor young */
+    if(args->snapshot_interval > 0) {
+        if(args->nursery_size > 0 || args->epoch_stores > 0)
+            jam_fprintf(stderr, "-Xnursery and -Xepoch ignored in "
+                                "snapshot mode\n");
+
+        initialiseNursery(0);
+        initialiseLog(args);
+        initialiseSnapshots(args);
+        return;
+    }
+
+    if(args->wal_interval > 0)
+        jam_fprintf(stderr, "-Xwal ignored without -Xsnapshot\n");
+
+    persist_by_reachability = args->persist_reachable;
+
+    initialiseNursery(args->nursery_size);
+
+    if(args->epoch_stores == 0)
+        return;
+
+    epoch_interval = args->epoch_time;
+    epoch_limit = args->epoch_stores;
+
+    if(epoch_interval > 0)
+        createVMThread("Epoch Timer", epochTimerThreadLoop);
+}
+// End of modification
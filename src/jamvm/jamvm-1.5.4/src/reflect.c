@@ -1087,15 +1087,15 @@ Object *invoke(Object *ob, MethodBlock *mb, Object *arg_array,
     }
 
     if(mb->access_flags & ACC_SYNCHRONIZED)
-        objectLock(ob ? ob : mb->class);
+        faseLock(ob ? ob : mb->class);
 
     if(mb->access_flags & ACC_NATIVE)
         (*mb->native_invoker)(mb->class, mb, ret);
     else
-        executeJava();
+        EXECUTE_JAVA();
 
     if(mb->access_flags & ACC_SYNCHRONIZED)
-        objectUnlock(ob ? ob : mb->class);
+        faseUnlock(ob ? ob : mb->class);
 
     POP_TOP_FRAME(ee);
 
@@ -22,6 +22,11 @@
 
 void shutdownVM(int status) {
     shutdownInterpreter();
+
+    // JaPHa Modification
+    shutdownPersistentHeap();
+    // End of modification
+
     jamvm_exit(status);
 }
 
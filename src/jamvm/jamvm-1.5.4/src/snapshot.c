@@ -0,0 +1,742 @@
+/*
+ * Copyright (C) 2003, 2004, 2005, 2006, 2007, 2008, 2009
+ * Robert Lougher <rob@jamvm.org.uk>.
+ *
+ * This file is part of JamVM.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+// JaPHa Modification
+/* Snapshot mode (-Xsnapshot).
+
+   The heap is used as plain memory: stores are neither logged nor
+   flushed, and BEGIN_TX/END_TX only keep count of the brackets.  In
+   place of transactions the pool is snapshotted every interval.  The
+   snapshot thread stops the world at a point where no thread is within
+   a bracket or holds a monitor (bar one it is waiting on), copies the
+   parts of the pool in use -- heap, NVM metadata and persistent hash
+   tables alike -- and writes the copy out to <pool>.snapshot once the
+   world has been restarted.  A crash loses at most the stores since the last complete
+   snapshot.
+
+   The pool is mapped shared, so a fork wouldn't give the writer a
+   copy-on-write image of it.  The copy is made in DRAM while the world
+   is stopped instead.
+
+   On open a snapshot, if there is one, is copied over the pool before
+   libpmemobj opens it, and then dropped: the pool is consistent from
+   then on.  Transactions stay on until the first snapshot of the run
+   is complete, so the pool can always be recovered.  A clean shutdown
+   makes the whole pool durable, and also drops the snapshot.
+
+   Only the first snapshot of a run is a full one.  After it the pages
+   of the pool written to are tracked by the kernel's soft-dirty bits
+   (see Documentation/admin-guide/mm/soft-dirty.rst), and a snapshot
+   copies and writes out just those.  The pages are written to a delta
+   file, which once complete is applied to the snapshot and dropped.
+   A delta left by a crash is applied again before restoring.  Unlike
+   write-protecting the pool, soft-dirty bits also catch writes made by
+   the kernel, such as a read into a Java array.
+
+   Only the parts of the pool in use are tracked (see poolRanges):
+   the heap up to its limit, the NVM metadata and the hash tables,
+   along with libpmemobj's own metadata below them.  The rest of the
+   pool is sparse.  A page of a file-backed pool which is written back
+   and reclaimed loses its bit, so while snapshots are incremental the
+   parts in use are locked in memory, and more of it as they grow.
+   Should a page not be present all the same, or have come into use
+   since the last snapshot, it is taken as dirty.  Without soft-dirty
+   support, or if the pool can't be locked, every snapshot is a full
+   one.
+
+   With -Xwal the stores since the last snapshot are also kept in a
+   redo log, which a snapshot checkpoints (see wal.c). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "jam.h"
+#include "thread.h"
+
+/* Trace snapshots */
+#ifdef TRACESNAPSHOT
+#define TRACE_SNAPSHOT(fmt, ...) jam_printf(fmt, ## __VA_ARGS__)
+#else
+#define TRACE_SNAPSHOT(fmt, ...)
+#endif
+
+#define SNAPSHOT_SUFFIX ".snapshot"
+#define SNAPSHOT_TMP_SUFFIX ".snapshot.tmp"
+#define DELTA_SUFFIX ".snapshot.delta"
+#define DELTA_TMP_SUFFIX ".snapshot.delta.tmp"
+
+/* Bits of a /proc/self/pagemap entry */
+#define PM_SOFT_DIRTY ((uint64_t)1 << 55)
+#define PM_PRESENT    ((uint64_t)1 << 63)
+
+#define PAGEMAP_BATCH 4096
+
+/* Zero chunks of an image are left as holes, as the pool is sparse */
+#define SNAPSHOT_CHUNK (64*KB)
+
+/* How often the threads are checked for a consistent
+   point while the snapshot thread waits, in milliseconds */
+#define SNAPSHOT_RETRY 10
+
+int snapshot_mode = FALSE;
+
+static int snapshot_interval;
+static char *snapshot_path;
+static char *snapshot_tmp;
+static char *delta_path;
+static char *delta_tmp;
+
+/* The DRAM copy of the pool as of the last snapshot.  It is reserved
+   at the size of the pool, but only the parts in use are copied to
+   it, so only they take up memory */
+static char *shadow;
+
+/* Whether the snapshot file holds the last snapshot,
+   so the next one can be written as a delta */
+static int have_snapshot;
+
+/* Dirty page tracking.  The pages dirty since the
+   last snapshot are kept as a list of indices */
+static int soft_dirty;
+static int page_size;
+static unsigned long pool_pages;
+static unsigned long *dirty;
+static unsigned long dirty_count;
+
+/* The parts of the pool in use, as offsets within it in
+   order, and as they were at the last snapshot */
+typedef struct snap_range {
+    unsigned long start;
+    unsigned long end;
+} SnapRange;
+
+static SnapRange used[POOL_RANGES];
+static SnapRange last_used[POOL_RANGES];
+static int used_count, last_used_count;
+static unsigned long used_pages;
+
+/* libpmemobj's metadata -- the pool header, the lanes and the chunk
+   headers of the first zone -- is below the first object.  A pool of
+   more than a zone has chunk headers amongst the objects, and an
+   object smaller than a chunk is in a run with a header of its own, so
+   for a pool that large or a heap of a few megabytes the whole of it
+   is taken as in use */
+#define PMEMOBJ_CHUNK_SIZE (256*KB)
+#define PMEMOBJ_ZONE_SIZE  (65528UL * PMEMOBJ_CHUNK_SIZE)
+
+/* The header of a delta file.  It is followed by the indices of the
+   pages, then at the next page boundary by the pages themselves.  A
+   full snapshot is written to a new file, so a delta left over from
+   before it doesn't apply to its inode */
+typedef struct delta_header {
+    unsigned long snapshot_ino;
+    unsigned long pool_size;
+    unsigned long count;
+} DeltaHeader;
+
+#define DELTA_PAGES(count) \
+    ((sizeof(DeltaHeader) + (count) * sizeof(unsigned long) + \
+      page_size - 1) & ~(page_size - 1))
+
+/* Held while a snapshot file is written.  Taken for
+   good once the pool has been made durable on shutdown */
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The snapshot thread waits on this between snapshots.  A
+   barrier in the log asks for the next one early */
+static VMWaitLock snapshot_wait;
+static int snapshot_due;
+
+static char *snapshotPath(char *pool_path, char *suffix) {
+    char *path = sysMalloc(strlen(pool_path) + strlen(suffix) + 1);
+
+    return strcat(strcpy(path, pool_path), suffix);
+}
+
+/* Makes a rename or unlink within the directory durable */
+static int syncDirectory(char *path) {
+    char *copy = strcpy(sysMalloc(strlen(path) + 1), path);
+    int fd = open(dirname(copy), O_RDONLY);
+    int ok = fd != -1 && fsync(fd) == 0;
+
+    if(fd != -1)
+        close(fd);
+
+    sysFree(copy);
+    return ok;
+}
+
+static int zeroChunk(char *chunk, int len) {
+    uintptr_t *word = (uintptr_t*)chunk;
+    uintptr_t *end = (uintptr_t*)(chunk + len);
+
+    while(word < end)
+        if(*word++ != 0)
+            return FALSE;
+
+    return TRUE;
+}
+
+/* Writes the listed ranges of an image over the file, which is
+   emptied first so the rest and the zero chunks need not be written */
+static int writeImage(int fd, char *image, unsigned long size,
+                      SnapRange *ranges, int count) {
+    int i;
+
+    if(ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0)
+        return FALSE;
+
+    for(i = 0; i < count; i++) {
+        unsigned long end = ranges[i].end < size ? ranges[i].end : size;
+        unsigned long offset;
+
+        for(offset = ranges[i].start; offset < end; offset += SNAPSHOT_CHUNK) {
+            int len = end - offset < SNAPSHOT_CHUNK ? end - offset
+                                                    : SNAPSHOT_CHUNK;
+
+            if(!zeroChunk(image + offset, len) &&
+                     pwrite(fd, image + offset, len, offset) != len)
+                return FALSE;
+        }
+    }
+
+    return fdatasync(fd) == 0;
+}
+
+/* Writes the listed pages, a run of consecutive ones at a time.  In
+   a delta the pages are packed one after another, in the shadow and
+   in the snapshot each is at its offset within the pool, which ends
+   at size */
+static int writePages(int fd, char *from, int from_packed, off_t to,
+                      int to_packed, unsigned long *pages,
+                      unsigned long count, unsigned long size) {
+    unsigned long i, run;
+
+    for(i = 0; i < count; i += run) {
+        unsigned long offset = pages[i] * page_size;
+        long len;
+
+        for(run = 1; i + run < count && pages[i + run] == pages[i] + run;
+            run++);
+
+        len = run * page_size;
+        if(!to_packed && offset + len > size)
+            len = size - offset;
+
+        if(pwrite(fd, from + (from_packed ? i * page_size : offset), len,
+                  to + (to_packed ? i * page_size : offset)) != len)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Applies a complete delta to the snapshot, then drops it.  Should
+   this be interrupted the delta is applied again on restore */
+static int applyDelta(char *path, char *delta) {
+    int from, to, ok = FALSE;
+    struct stat info;
+    DeltaHeader *header;
+
+    if((from = open(delta, O_RDONLY)) == -1)
+        return FALSE;
+
+    if(fstat(from, &info) == 0 &&
+          (header = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE,
+                         from, 0)) != MAP_FAILED) {
+
+        unsigned long *pages = (unsigned long*)(header + 1);
+        char *data = (char*)header + DELTA_PAGES(header->count);
+
+        if(data + header->count * page_size <= (char*)header + info.st_size &&
+                (to = open(path, O_WRONLY)) != -1) {
+            struct stat target;
+
+            ok = fstat(to, &target) == 0 &&
+                 (target.st_ino != header->snapshot_ino ||
+                  (writePages(to, data, TRUE, 0, FALSE, pages,
+                              header->count, header->pool_size) &&
+                   fdatasync(to) == 0));
+            close(to);
+        }
+
+        munmap(header, info.st_size);
+    }
+
+    close(from);
+
+    return ok && unlink(delta) == 0 && syncDirectory(delta);
+}
+
+/* Called before the pool is opened, whatever the mode.  A crash
+   part-way through leaves the snapshot, which is restored again */
+int restoreSnapshot(char *pool_path) {
+    char *path = snapshot_path = snapshotPath(pool_path, SNAPSHOT_SUFFIX);
+    int from, to, ok = FALSE;
+    struct stat info;
+    char *image;
+
+    snapshot_tmp = snapshotPath(pool_path, SNAPSHOT_TMP_SUFFIX);
+    delta_path = snapshotPath(pool_path, DELTA_SUFFIX);
+    delta_tmp = snapshotPath(pool_path, DELTA_TMP_SUFFIX);
+    page_size = getpagesize();
+
+    if(access(delta_path, F_OK) == 0) {
+        /* Without its snapshot the delta was left by a shutdown */
+        if(access(path, F_OK) != 0)
+            unlink(delta_path);
+        else if(!applyDelta(path, delta_path)) {
+            printf("failed to apply %s to %s\n", delta_path, path);
+            return FALSE;
+        }
+    }
+
+    if((from = open(path, O_RDONLY)) == -1)
+        return TRUE;
+
+    if(fstat(from, &info) == 0 &&
+          (image = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE,
+                        from, 0)) != MAP_FAILED) {
+
+        if((to = open(pool_path, O_WRONLY|O_CREAT, 0666)) != -1) {
+            SnapRange all = {0, info.st_size};
+
+            ok = writeImage(to, image, info.st_size, &all, 1);
+            close(to);
+        }
+
+        munmap(image, info.st_size);
+    }
+
+    close(from);
+
+    if(ok)
+        ok = unlink(path) == 0 && syncDirectory(path);
+
+    if(ok)
+        jam_printf("<Snapshot: restored pool %s from %s>\n", pool_path, path);
+    else
+        printf("failed to restore pool %s from %s\n", pool_path, path);
+
+    return ok;
+}
+
+static int writeSnapshot(char *image, unsigned long size) {
+    int fd = open(snapshot_tmp, O_WRONLY|O_CREAT, 0666);
+    int ok;
+
+    if(fd == -1)
+        return FALSE;
+
+    ok = writeImage(fd, image, size, used, used_count);
+    close(fd);
+
+    /* The rename makes the snapshot complete */
+    return ok && rename(snapshot_tmp, snapshot_path) == 0 &&
+                 syncDirectory(snapshot_path);
+}
+
+/* Writes the dirty pages of the shadow to the delta.  Once renamed
+   into place the delta is complete, and is applied to the snapshot */
+static int writeDelta() {
+    DeltaHeader header = {0, pheap->pool_size, dirty_count};
+    long len = dirty_count * sizeof(unsigned long);
+    struct stat snapshot;
+    int fd, ok;
+
+    if(stat(snapshot_path, &snapshot) != 0 ||
+          (fd = open(delta_tmp, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1)
+        return FALSE;
+
+    header.snapshot_ino = snapshot.st_ino;
+
+    ok = pwrite(fd, &header, sizeof(header), 0) == sizeof(header) &&
+         pwrite(fd, dirty, len, sizeof(header)) == len &&
+         writePages(fd, shadow, FALSE, DELTA_PAGES(dirty_count), TRUE,
+                    dirty, dirty_count, header.pool_size) &&
+         fdatasync(fd) == 0;
+
+    close(fd);
+
+    return ok && rename(delta_tmp, delta_path) == 0 &&
+                 syncDirectory(delta_path) &&
+                 applyDelta(snapshot_path, delta_path);
+}
+
+static int clearSoftDirty() {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    int ok = fd != -1 && write(fd, "4", 1) == 1;
+
+    if(fd != -1)
+        close(fd);
+
+    return ok;
+}
+
+static int compareRanges(const void *a, const void *b) {
+    const SnapRange *x = a, *y = b;
+
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* Finds the parts of the pool in use, as whole pages, keeping those
+   of the last snapshot.  Called with the world stopped */
+static void findUsedRanges() {
+    unsigned long size = pheap->pool_size;
+    PoolRange ranges[POOL_RANGES];
+    SnapRange found[POOL_RANGES];
+    int i, count = poolRanges(ranges);
+
+    memcpy(last_used, used, used_count * sizeof(SnapRange));
+    last_used_count = used_count;
+
+    for(i = 0; i < count; i++) {
+        found[i].start = (ranges[i].start - (char*)pop_heap) &
+                         ~(unsigned long)(page_size - 1);
+        found[i].end = (ranges[i].end - (char*)pop_heap + page_size - 1) &
+                       ~(unsigned long)(page_size - 1);
+        if(found[i].end > size)
+            found[i].end = size;
+    }
+
+    qsort(found, count, sizeof(SnapRange), compareRanges);
+    found[0].start = 0;
+
+    if(size > PMEMOBJ_ZONE_SIZE ||
+             MARKBITS_SIZE(pheap->maxHeap) < PMEMOBJ_CHUNK_SIZE) {
+        found[0].end = size;
+        count = 1;
+    }
+
+    used_count = 0;
+    used_pages = 0;
+
+    for(i = 0; i < count; i++)
+        if(used_count > 0 && found[i].start <= used[used_count - 1].end) {
+            if(found[i].end > used[used_count - 1].end)
+                used[used_count - 1].end = found[i].end;
+        } else
+            used[used_count++] = found[i];
+
+    for(i = 0; i < used_count; i++)
+        used_pages += (used[i].end - used[i].start + page_size - 1) / page_size;
+}
+
+/* Whether the page at an offset was in use at the last snapshot.  The
+   offsets asked about must ascend from a cursor starting at zero */
+static int wasUsed(unsigned long offset, int *cursor) {
+    while(*cursor < last_used_count && last_used[*cursor].end <= offset)
+        (*cursor)++;
+
+    return *cursor < last_used_count && last_used[*cursor].start <= offset;
+}
+
+/* Locks the parts of the pool which have come into use since the last
+   snapshot.  Those already locked stay so */
+static int lockNewRanges() {
+    int i, cursor = 0;
+
+    for(i = 0; i < used_count; i++) {
+        unsigned long start = used[i].start;
+
+        while(start < used[i].end) {
+            unsigned long end;
+
+            if(wasUsed(start, &cursor)) {
+                start = last_used[cursor].end;
+                continue;
+            }
+
+            end = cursor < last_used_count &&
+                  last_used[cursor].start < used[i].end ?
+                      last_used[cursor].start : used[i].end;
+
+            if(mlock((char*)pop_heap + start, end - start) != 0)
+                return FALSE;
+
+            start = end;
+        }
+    }
+
+    return TRUE;
+}
+
+/* Lists the pages in use written to since the bits were last cleared,
+   along with those come into use since, which may have been written
+   back and reclaimed before they were locked.  Called with the world
+   stopped */
+static int scanDirtyPages() {
+    static uint64_t entries[PAGEMAP_BATCH];
+    off_t base = (uintptr_t)pop_heap / page_size * sizeof(uint64_t);
+    int fd = open("/proc/self/pagemap", O_RDONLY);
+    int i, cursor = 0;
+
+    if(fd == -1)
+        return FALSE;
+
+    dirty_count = 0;
+
+    for(i = 0; i < used_count; i++) {
+        unsigned long page = used[i].start / page_size;
+        unsigned long end = (used[i].end + page_size - 1) / page_size;
+        int count;
+
+        for(; page < end; page += count) {
+            long len;
+            int j;
+
+            count = end - page < PAGEMAP_BATCH ? end - page : PAGEMAP_BATCH;
+            len = count * sizeof(uint64_t);
+
+            if(pread(fd, entries, len, base + page * sizeof(uint64_t)) != len) {
+                close(fd);
+                return FALSE;
+            }
+
+            for(j = 0; j < count; j++)
+                if(entries[j] & PM_SOFT_DIRTY || !(entries[j] & PM_PRESENT) ||
+                       !wasUsed((page + j) * page_size, &cursor))
+                    dirty[dirty_count++] = page + j;
+        }
+    }
+
+    close(fd);
+    return TRUE;
+}
+
+/* Whether the kernel keeps soft-dirty bits for the pool.  The
+   probe stores a value the pool already holds */
+static int probeSoftDirty() {
+    volatile unsigned long *probe = &pheap->pool_size;
+    off_t entry = (uintptr_t)probe / page_size * sizeof(uint64_t);
+    int fd, ok = FALSE;
+    uint64_t bits;
+
+    if(!clearSoftDirty())
+        return FALSE;
+
+    *probe = *probe;
+
+    if((fd = open("/proc/self/pagemap", O_RDONLY)) != -1) {
+        ok = pread(fd, &bits, sizeof(bits), entry) == sizeof(bits) &&
+             (bits & PM_SOFT_DIRTY);
+        close(fd);
+    }
+
+    return ok;
+}
+
+/* Stops the world at a consistent point (see threadsQuiescent).
+   Gives up, with the world running, if the threads don't reach one
+   within an interval.  The caller has suspension disabled */
+static int stopAtConsistentPoint(Thread *self, int no_tx) {
+    int waited;
+
+    for(waited = 0; ; waited += SNAPSHOT_RETRY) {
+        stopTheWorld(self);
+
+        if(threadsQuiescent(self, no_tx))
+            return TRUE;
+
+        restartTheWorld(self);
+
+        if(waited >= snapshot_interval)
+            return FALSE;
+
+        threadSleep(self, SNAPSHOT_RETRY, 0);
+    }
+}
+
+static void takeSnapshot(Thread *self) {
+    unsigned long size = pheap->pool_size;
+    unsigned long generation;
+    int incremental, ok, i;
+
+    disableSuspend(self);
+
+    if(!stopAtConsistentPoint(self, FALSE)) {
+        TRACE_SNAPSHOT("<Snapshot: no consistent point, skipped>\n");
+        enableSuspend(self);
+        return;
+    }
+
+    /* The persistent hash tables' counts are
+       otherwise only stored at commit */
+    flushPHValues();
+
+    /* Commits from now on go to a new log, replayed over this
+       snapshot.  The snapshot records where replay starts */
+    if(wal_mode)
+        pheap->wal_generation = rotateLog(FALSE);
+
+    generation = pheap->wal_generation;
+
+    findUsedRanges();
+
+    if(soft_dirty && !lockNewRanges()) {
+        jam_printf("<Snapshot: couldn't lock the pool in memory, "
+                   "taking full snapshots>\n");
+        soft_dirty = FALSE;
+    }
+
+    if(soft_dirty && !scanDirtyPages()) {
+        jam_printf("<Snapshot: couldn't read the dirty pages, "
+                   "taking full snapshots>\n");
+        soft_dirty = FALSE;
+    }
+
+    incremental = soft_dirty && have_snapshot;
+
+    if(incremental) {
+        unsigned long page;
+
+        for(page = 0; page < dirty_count; page++) {
+            unsigned long offset = dirty[page] * page_size;
+            memcpy(shadow + offset, (char*)pop_heap + offset, page_size);
+        }
+    } else
+        for(i = 0; i < used_count; i++)
+            memcpy(shadow + used[i].start, (char*)pop_heap + used[i].start,
+                   used[i].end - used[i].start);
+
+    /* Writes from now on belong to the next snapshot */
+    if(soft_dirty)
+        clearSoftDirty();
+
+    restartTheWorld(self);
+
+    pthread_mutex_lock(&snapshot_lock);
+    ok = incremental ? writeDelta() : writeSnapshot(shadow, size);
+
+    if(ok && wal_mode)
+        truncateLog(generation);
+
+    pthread_mutex_unlock(&snapshot_lock);
+
+    /* Pages copied to the shadow but not written out would be
+       missing from the next delta, so the next one is full */
+    have_snapshot = ok;
+
+    if(!ok)
+        jam_printf("<Snapshot: couldn't write %s>\n", snapshot_path);
+    else {
+        TRACE_SNAPSHOT("<Snapshot: wrote %ld pages to %s>\n",
+                       incremental ? dirty_count : used_pages,
+                       snapshot_path);
+
+        /* A crash is now covered by the snapshot, so transactions
+           can be dropped.  None may be open when they are, not even
+           by a thread waiting within a section */
+        if(!snapshot_mode && stopAtConsistentPoint(self, TRUE)) {
+            snapshot_mode = TRUE;
+            startLog();
+            restartTheWorld(self);
+        }
+    }
+
+    enableSuspend(self);
+}
+
+void snapshotThreadLoop(Thread *self) {
+    for(;;) {
+        disableSuspend(self);
+        lockVMWaitLock(snapshot_wait, self);
+
+        if(!snapshot_due)
+            timedWaitVMWaitLock(snapshot_wait, self, snapshot_interval);
+
+        snapshot_due = FALSE;
+        unlockVMWaitLock(snapshot_wait, self);
+        enableSuspend(self);
+
+        takeSnapshot(self);
+    }
+}
+
+void requestSnapshot() {
+    Thread *self = threadSelf();
+
+    lockVMWaitLock(snapshot_wait, self);
+    snapshot_due = TRUE;
+    notifyVMWaitLock(snapshot_wait, self);
+    unlockVMWaitLock(snapshot_wait, self);
+}
+
+/* Called by a clean shutdown or a checkpoint, with the other threads
+   stopped at a consistent point.  The pool itself is then the most
+   recent consistent state, so the snapshot is dropped.  No snapshot
+   is written afterwards */
+void persistSnapshotHeap() {
+    static int persisted = FALSE;
+
+    if(!snapshot_mode || persisted)
+        return;
+
+    persisted = TRUE;
+
+    flushPHValues();
+    pmemobj_persist(pop_heap, pop_heap, pheap->pool_size);
+
+    pthread_mutex_lock(&snapshot_lock);
+
+    dropLogs();
+
+    /* The snapshot goes first.  A delta left on its own is dropped */
+    unlink(snapshot_path);
+    unlink(delta_path);
+    syncDirectory(snapshot_path);
+}
+
+void initialiseSnapshots(InitArgs *args) {
+    shadow = mmap(0, pheap->pool_size, PROT_READ|PROT_WRITE,
+                  MAP_PRIVATE|MAP_ANON|MAP_NORESERVE, -1, 0);
+
+    if(shadow == MAP_FAILED) {
+        perror("Couldn't allocate the snapshot copy, snapshots disabled");
+        return;
+    }
+
+    snapshot_interval = args->snapshot_interval;
+    initVMWaitLock(snapshot_wait);
+    pool_pages = (pheap->pool_size + page_size - 1) / page_size;
+
+    dirty = sysMalloc(pool_pages * sizeof(unsigned long));
+
+    findUsedRanges();
+
+    if(!(soft_dirty = probeSoftDirty()))
+        jam_printf("<Snapshot: no soft-dirty bits, taking full snapshots>\n");
+    else if(!lockNewRanges()) {
+        perror("Couldn't lock the pool in memory, taking full snapshots");
+        soft_dirty = FALSE;
+    }
+
+    createVMThread("Snapshot", snapshotThreadLoop);
+}
+// End of modification
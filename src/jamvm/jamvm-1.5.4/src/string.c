@@ -98,6 +98,12 @@ Object *createString(char *utf8) {
 Object *findInternedString(Object *string) {
     Object *interned;
 
+    // JaPHa Modification
+    /* The table is a durable root, so the string must be durable
+       before it is added */
+    publishReference(NULL, string);
+    // End of modification
+
     /* Add if absent, no scavenge, locked */
     /* XXX NVM CHANGE 006.003.007  */
     findHashEntry(hash_table, string, interned, TRUE, FALSE, TRUE, HT_NAME_STRING, TRUE);
@@ -105,6 +111,42 @@ Object *findInternedString(Object *string) {
     return interned;
 }
  
+// JaPHa Modification
+static void shrinkInternedStrings(int unmarked) {
+    int size;
+
+    /* Update count to remaining number of strings */
+    hash_table.hash_count -= unmarked;
+
+    /* Calculate nearest multiple of 2 larger than count */
+    for(size = 1; size < hash_table.hash_count; size <<= 1);
+
+    /* Ensure new table is less than 2/3 full */
+    size = hash_table.hash_count*3 > size*2 ? size<< 1 : size;
+    /* XXX NVM CHANGE 006.002.001  */
+    resizeHash(&hash_table, size, HT_NAME_STRING, TRUE);
+}
+
+/* On restart remove the strings which were interned while
+   young and never promoted (see scrubYoungReferences) */
+#define ITERATE(ptr)              \
+    if(isStaleYoungRef(*ptr)) {   \
+        *ptr = NULL;              \
+        unmarked++;               \
+    }
+
+static void scrubInternedStrings() {
+    int unmarked = 0;
+
+    hashIterateP(hash_table);
+
+    if(unmarked)
+        shrinkInternedStrings(unmarked);
+}
+
+#undef ITERATE
+// End of modification
+
 #define ITERATE(ptr)          \
     if(!isMarked(*ptr)) {     \
         *ptr = NULL;          \
@@ -116,20 +158,10 @@ void freeInternedStrings() {
 
     hashIterateP(hash_table);
 
-    if(unmarked) {
-        int size;
-
-        /* Update count to remaining number of strings */
-        hash_table.hash_count -= unmarked;
-
-        /* Calculate nearest multiple of 2 larger than count */
-        for(size = 1; size < hash_table.hash_count; size <<= 1);
-
-        /* Ensure new table is less than 2/3 full */
-        size = hash_table.hash_count*3 > size*2 ? size<< 1 : size;
-        /* XXX NVM CHANGE 006.002.001  */
-        resizeHash(&hash_table, size, HT_NAME_STRING, TRUE);
-    }
+    // JaPHa Modification
+    if(unmarked)
+        shrinkInternedStrings(unmarked);
+    // End of modification
 }
 
 #undef ITERATE
@@ -199,6 +231,10 @@ void initialiseString(InitArgs *args) {
     if(is_persistent) {
     	OPC *ph_value = get_opc_ptr();
     	hash_table.hash_count = ph_value->string_hash_count;
+
+    	// JaPHa Modification
+    	scrubInternedStrings();
+    	// End of modification
     }
 }
 
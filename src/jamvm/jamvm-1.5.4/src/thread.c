@@ -257,6 +257,10 @@ void threadPark(Thread *self, int absolute, long long time) {
        we're now blocked */
 
     if(--self->park_state == PARK_BLOCKED) {
+        // JaPHa Modification
+        epochSafepoint(self);
+        // End of modification
+
         /* Really must disable suspension now as we're
            going to sleep */
         disableSuspend(self);
@@ -570,6 +574,9 @@ Thread *attachThread(char *name, char is_daemon, void *stack_base,
 
     /* Initialiser doesn't handle the thread group */
     INST_DATA(java_thread, Object*, group_offset) = group;
+    // JaPHa Modification
+    REMEMBER(java_thread, group)
+    // End of modification
     executeMethod(group, addThread_mb, java_thread);
 
     /* We're now attached to the VM...*/
@@ -622,6 +629,12 @@ void detachThread(Thread *thread) {
     if(exceptionOccurred0(ee))
         uncaughtException();
 
+    // JaPHa Modification
+    /* Commit the thread's open durability epoch before the
+       ExecEnv holding it is freed */
+    epochSafepoint(thread);
+    // End of modification
+
     /* remove thread from thread group */
     executeMethod(group, (CLASS_CB(group->class))->
                                      method_table[rmveThrd_mtbl_idx], jThread);
@@ -669,6 +682,9 @@ void detachThread(Thread *thread) {
        is safe to free during GC when the VMThread is determined to be no
        longer reachable. */
     sysFree(ee->stack);
+    // JaPHa Modification
+    sysFree(ee->tx.wal_ranges);
+    // End of modification
     sysFree(ee);
 
     /* If no more daemon threads notify the main thread (which
@@ -704,8 +720,19 @@ void *threadStart(void *arg) {
     /* Add thread to thread ID map hash table. */
     addThreadToHash(thread);
 
-    /* Execute the thread's run method */
-    executeMethod(jThread, CLASS_CB(jThread->class)->method_table[run_mtbl_idx]);
+    // JaPHa Modification
+    /* Execute the thread's run method, or carry on from where
+       a checkpoint stopped it */
+    thread->root_state = ROOT_RUNNING;
+
+    if(thread->ee->resume != NULL)
+        resumeJavaStack(thread->ee->resume);
+    else
+        executeMethod(jThread,
+                      CLASS_CB(jThread->class)->method_table[run_mtbl_idx]);
+
+    thread->root_state = ROOT_OUTSIDE;
+    // End of modification
 
     /* Run has completed.  Detach the thread from the VM and exit */
     detachThread(thread);
@@ -714,7 +741,10 @@ void *threadStart(void *arg) {
     return NULL;
 }
 
-void createJavaThread(Object *jThread, long long stack_size) {
+// JaPHa Modification
+void createJavaThread0(Object *jThread, long long stack_size,
+                       SavedThread *resume) {
+// End of modification
     ExecEnv *ee;
     Thread *thread;
     Thread *self = threadSelf();
@@ -743,9 +773,17 @@ void createJavaThread(Object *jThread, long long stack_size) {
     ee->thread = jThread;
     ee->stack_size = stack_size;
 
+    // JaPHa Modification
+    ee->resume = resume;
+    thread->root_state = ROOT_OUTSIDE;
+    // End of modification
+
     INST_DATA(vmthread, Thread*, vmData_offset) = thread;
     INST_DATA(vmthread, Object*, thread_offset) = jThread;
     INST_DATA(jThread, Object*, vmthread_offset) = vmthread;
+    // JaPHa Modification
+    REMEMBER(vmthread, jThread)
+    // End of modification
 
     pthread_mutex_unlock(&lock);
 
@@ -767,6 +805,17 @@ void createJavaThread(Object *jThread, long long stack_size) {
     enableSuspend(self);
 }
 
+// JaPHa Modification
+/* Starts a thread saved by a checkpoint (see checkpoint.c).  The
+   VMThread it refers to is from the run the checkpoint was taken
+   in, so it is replaced */
+
+void resumeJavaThread(SavedThread *saved) {
+    INST_DATA(saved->thread, Object*, vmthread_offset) = NULL;
+    createJavaThread0(saved->thread, saved->stack_size, saved);
+}
+// End of modification
+
 static void initialiseSignals();
 
 Thread *attachJNIThread(char *name, char is_daemon, Object *group) {
@@ -863,6 +912,12 @@ void resumeThread(Thread *thread) {
     }
 }
 
+// JaPHa Modification
+Thread *mainThread() {
+    return &main_thread;
+}
+// End of modification
+
 void suspendAllThreads(Thread *self) {
     Thread *thread;
 
@@ -978,6 +1033,13 @@ void disableSuspend0(Thread *thread, void *stack_top) {
     sigemptyset(&mask);
     sigaddset(&mask, SIGUSR1);
     pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    // JaPHa Modification
+    /* The thread may block, so its stores made outside a
+       transaction are committed first */
+    if(wal_mode && thread->ee != NULL)
+        walFlush(&thread->ee->tx);
+    // End of modification
 }
 
 void enableSuspend(Thread *thread) {
@@ -987,6 +1049,12 @@ void enableSuspend(Thread *thread) {
     MBARRIER();
 
     if(thread->suspend) {
+        // JaPHa Modification
+        /* Parked for a collection.  SIGUSR1 is still blocked */
+        if(epoch_limit)
+            commitEpoch(thread->ee);
+        // End of modification
+
         TRACE("Thread 0x%x id: %d is self suspending\n", thread, thread->id);
         suspendLoop(thread);
         TRACE("Thread 0x%x id: %d resumed\n", thread, thread->id);
@@ -1015,6 +1083,11 @@ void fastEnableSuspend(Thread *thread) {
         sigaddset(&mask, SIGUSR1);
         pthread_sigmask(SIG_BLOCK, &mask, NULL);
 
+        // JaPHa Modification
+        if(epoch_limit)
+            commitEpoch(thread->ee);
+        // End of modification
+
         TRACE("Thread 0x%x id: %d is fast self suspending\n",
               thread, thread->id);
 
@@ -1035,6 +1108,9 @@ void dumpThreadsLoop(Thread *self) {
     sigemptyset(&mask);
     sigaddset(&mask, SIGQUIT);
     sigaddset(&mask, SIGINT);
+    // JaPHa Modification
+    sigaddset(&mask, SIGUSR2);
+    // End of modification
 
     disableSuspend0(self, &self);
     for(;;) {
@@ -1044,6 +1120,14 @@ void dumpThreadsLoop(Thread *self) {
         if(sig == SIGINT)
             exitVM(0);
 
+        // JaPHa Modification
+        /* Checkpoint the program and exit (see checkpoint.c) */
+        if(sig == SIGUSR2) {
+            checkpointVM(self);
+            continue;
+        }
+        // End of modification
+
         /* It must be a SIGQUIT.  Do a thread dump */
 
         suspendAllThreads(self);
@@ -1111,6 +1195,9 @@ static void initialiseSignals() {
     sigaddset(&mask, SIGQUIT);
     sigaddset(&mask, SIGINT);
     sigaddset(&mask, SIGPIPE);
+    // JaPHa Modification
+    sigaddset(&mask, SIGUSR2);
+    // End of modification
     sigprocmask(SIG_BLOCK, &mask, NULL);
 }
 
@@ -1137,6 +1224,73 @@ int systemIdle(Thread *self) {
     return TRUE;
 }
 
+// JaPHa Modification
+/* Number of threads with an open persistent transaction */
+int threadsInTransaction() {
+    Thread *thread;
+    int count = 0;
+
+    pthread_mutex_lock(&lock);
+    for(thread = &main_thread; thread != NULL; thread = thread->next)
+        if(thread->ee != NULL && thread->ee->tx.depth > 0)
+            count++;
+    pthread_mutex_unlock(&lock);
+
+    return count;
+}
+
+/* Number of threads holding an object lock */
+int threadsHoldingLocks() {
+    Thread *thread;
+    int count = 0;
+
+    pthread_mutex_lock(&lock);
+    for(thread = &main_thread; thread != NULL; thread = thread->next)
+        if(thread->locks_held > 0)
+            count++;
+    pthread_mutex_unlock(&lock);
+
+    return count;
+}
+
+/* Whether the heap is at a consistent point for a snapshot: no
+   thread but self is within a transaction or holds a monitor, other
+   than the one it is waiting on, whose section was committed when it
+   started waiting (see epochSafepoint).  The waiting thread's section
+   carries on in a transaction of its own, so when no_tx is set (the
+   switch to snapshot mode, after which it could never end) it must
+   not be waiting within one either.  Called with all threads
+   suspended */
+int threadsQuiescent(Thread *self, int no_tx) {
+    Thread *thread;
+
+    for(thread = &main_thread; thread != NULL; thread = thread->next) {
+        Monitor *mon = thread->wait_mon;
+        int waiting;
+
+        if(thread == self || thread->ee == NULL)
+            continue;
+
+        waiting = mon != NULL && mon->obj != NULL ? thread->wait_lock_count : 0;
+
+        if(thread->locks_held != waiting ||
+                  thread->ee->tx.depth > (waiting && !no_tx ? 1 : 0))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Called by the GC with all threads suspended */
+void resetWriteSets() {
+    Thread *thread;
+
+    for(thread = &main_thread; thread != NULL; thread = thread->next)
+        if(thread->ee != NULL)
+            resetWriteSet(&thread->ee->tx);
+}
+// End of modification
+
 Thread *findRunningThreadByTid(int tid) {
     Thread *thread;
 
@@ -1158,12 +1312,18 @@ void flushPHValues() {
     ph_values->string_hash_count = get_string_HC();
     ph_values->utf8_hash_count = get_utf8_HC();
     ph_values->classes_hash_count = get_CL_HC();
+    ph_values->ref_referent_offset = ref_referent_offset;
+    ph_values->ref_queue_offset = ref_queue_offset;
 }
 // End of modification
 
 void exitVM(int status) {
     main_exited = TRUE;
 
+    // JaPHa Modification
+    epochSafepoint(threadSelf());
+    // End of modification
+
     /* Execute System.exit() to run any registered shutdown hooks.
        In the unlikely event that System.exit() can't be found, or
        it returns, fall through and exit. */
@@ -1172,18 +1332,16 @@ void exitVM(int status) {
         Class *system = findSystemClass(SYMBOL(java_lang_System));
         if(system) {
             MethodBlock *exit = findMethod(system, SYMBOL(exit), SYMBOL(_I__V));
-			// FIXME: this is actually quitting the VM, and we never get to pmemobj_close below
             if(exit)
                 executeStaticMethod(system, exit, status);
         }
     }
 	
     //JaPHa Modification
-    //TODO close the heap before ending the VM
-    if(is_persistent) {
-        pmemobj_close(pop_heap);
-		printf("EXIT VM\n");
-    }
+    /* System.exit doesn't return, the heap is marked as shut down
+       on its way out (see shutdownVM).  Only reached if it can't
+       be run */
+    shutdownPersistentHeap();
     //End of modification
 
     jamvm_exit(status);
@@ -1193,6 +1351,11 @@ void mainThreadWaitToExitVM() {
     Thread *self = threadSelf();
     TRACE("Waiting for %d non-daemon threads to exit\n", non_daemon_thrds);
 
+    // JaPHa Modification
+    /* Nothing of main is left to checkpoint */
+    self->root_state = ROOT_DONE;
+    // End of modification
+
     disableSuspend(self);
     pthread_mutex_lock(&exit_lock);
 
@@ -1255,6 +1418,16 @@ void initialiseThreadStage1(InitArgs *args) {
     main_thread.state = RUNNING;
     main_thread.ee = &main_ee;
 
+    // JaPHa Modification
+    main_thread.root_state = ROOT_OUTSIDE;
+    // End of modification
+
+    // JaPHa Modification
+    /* The main thread inherits the transaction begun while
+       initialising the heap, before it had an ExecEnv */
+    main_ee.tx = *getTxState();
+    // End of modification
+
     initialiseJavaStack(&main_ee);
     setThreadSelf(&main_thread);
 
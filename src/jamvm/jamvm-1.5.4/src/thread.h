@@ -55,6 +55,16 @@
 #define PARK_RUNNING 1
 #define PARK_PERMIT  2
 
+// JaPHa Modification
+/* Whether a thread is running its root method (Thread.run or
+   main), which decides if a checkpoint saves it (see checkpoint.c) */
+
+#define ROOT_NONE     0     /* VM and attached threads, never saved */
+#define ROOT_OUTSIDE  1     /* starting or exiting, not saveable yet */
+#define ROOT_RUNNING  2
+#define ROOT_DONE     3     /* main has returned */
+// End of modification
+
 typedef struct thread Thread;
 
 typedef struct monitor {
@@ -93,6 +103,12 @@ struct thread {
     Thread *prev, *next;
     unsigned int wait_id;
     unsigned int notify_id;
+    // JaPHa Modification
+    int locks_held;     /* object locks held, see objectLock */
+    int wait_lock_count;    /* recursion count of the monitor waited on */
+    char root_state;
+    uintptr_t *safepoint_sp;    /* stopped for a checkpoint, see checkpoint.c */
+    // End of modification
 };
 
 extern Thread *threadSelf();
@@ -135,9 +151,19 @@ extern void detachJNIThread(Thread *thread);
 extern char *getThreadStateString(Thread *thread);
 
 extern Thread *findThreadById(long long id);
+extern void epochSafepoint(Thread *thread);
+extern int threadsInTransaction();
+extern int threadsHoldingLocks();
+extern int threadsQuiescent(Thread *self, int no_tx);
+extern void resetWriteSets();
 extern Thread *findRunningThreadByTid(int tid);
 extern void suspendThread(Thread *thread);
 extern void resumeThread(Thread *thread);
+extern Thread *mainThread();
+extern void resumeJavaThread(SavedThread *saved);
+extern void checkpointVM(Thread *self);
+extern void stopTheWorld(Thread *self);
+extern void restartTheWorld(Thread *self);
 
 #define disableSuspend(thread)          \
 {                                       \
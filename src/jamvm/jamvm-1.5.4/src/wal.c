@@ -0,0 +1,631 @@
+/*
+ * Copyright (C) 2003, 2004, 2005, 2006, 2007, 2008, 2009
+ * Robert Lougher <rob@jamvm.org.uk>.
+ *
+ * This file is part of JamVM.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+// JaPHa Modification
+/* Redo log for snapshot mode (-Xwal).
+
+   Snapshots alone lose the stores since the last one.  With the log
+   on, BEGIN_TX/END_TX and the store brackets are kept as in transaction
+   mode, but a store only records its range in the thread's redo set.
+   At the outermost commit the current contents of the ranges are
+   copied into the log buffer as one checksummed transaction, and the
+   stores made outside a transaction are logged as one of their own
+   as soon as they are done (see walFlush).  Every
+   interval the log writer thread writes the buffer out to the log
+   file with a single write and fdatasync, committing all of the
+   transactions since the last time as a group.  A commit never waits
+   for the disk: a crash loses at most an interval of transactions,
+   and never part of one.
+
+   The snapshots are the log's checkpoints.  Each snapshot starts a
+   new log generation, <pool>.wal.<generation>, and the snapshot records
+   the generation it starts in the pool.  On open the logs from that
+   generation on are replayed over the pool in order, stopping at the
+   first torn transaction, after which the pool is made durable and
+   the logs dropped.  A log older than the last complete snapshot is
+   no longer needed, and is deleted.
+
+   A collection is logged as a transaction of its own, made of the
+   ranges the collector writes (see walBeginGC).  A compaction, which
+   moves every object, and the growing of the NVM metadata region
+   write the pool without logging, as they do in transaction mode.
+   Before they do a barrier is written to the log: replay stops at it,
+   and the transactions after it are only replayed over a snapshot
+   taken later, which the barrier asks for straight away.  Transactions
+   committed before the first snapshot of the run are covered by the
+   second one in the same way. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "jam.h"
+#include "thread.h"
+
+/* Trace log group commits and replay */
+#ifdef TRACEWAL
+#define TRACE_WAL(fmt, ...) jam_printf(fmt, ## __VA_ARGS__)
+#else
+#define TRACE_WAL(fmt, ...)
+#endif
+
+#define WAL_SUFFIX ".wal."
+
+#define WAL_MAGIC   0x4a57414c
+#define WAL_BARRIER 0x4a424152
+
+/* Initial size of the log buffer and of a thread's redo set */
+#define LOG_BUFFER_SIZE (256*KB)
+#define REDO_SET_SIZE   64
+
+/* A transaction in the log.  The header is followed by its records,
+   each a range of the pool and its contents padded to a word */
+typedef struct wal_header {
+    unsigned int magic;
+    unsigned int checksum;
+    unsigned long length;
+} WalHeader;
+
+typedef struct wal_record {
+    unsigned long offset;
+    unsigned long length;
+} WalRecord;
+
+#define WAL_ALIGN(len) (((len) + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1))
+
+typedef struct log_buffer {
+    char *data;
+    unsigned long len;
+    unsigned long size;
+} LogBuffer;
+
+int wal_mode = FALSE;
+
+static int log_enabled;
+static int wal_interval;
+static char *log_prefix;
+
+/* Transactions are copied into the active buffer.  The log writer
+   swaps in the spare one, and writes out the buffer swapped out */
+static LogBuffer active, spare;
+
+/* The generation the active buffer belongs to and its file, and the
+   file of the previous generation if it hasn't been synced yet.  No
+   log file is open before the log is started */
+static unsigned long generation;
+static unsigned long oldest;
+static int log_fd = -1;
+static int sealed_fd = -1;
+static int log_created;
+
+/* wal_lock guards the active buffer and is only held to copy into it.
+   io_lock orders the writes to the files, and is taken first.  A
+   thread holding either has suspension disabled, so neither is held
+   by a thread stopped by a collection or snapshot */
+static pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *logPath(unsigned long gen) {
+    char *path = sysMalloc(strlen(log_prefix) + 21);
+
+    sprintf(path, "%s%lu", log_prefix, gen);
+    return path;
+}
+
+/* Makes the creation or removal of a log durable */
+static void syncLogDirectory() {
+    char *copy = strcpy(sysMalloc(strlen(log_prefix) + 1), log_prefix);
+    int fd = open(dirname(copy), O_RDONLY);
+
+    if(fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+
+    sysFree(copy);
+}
+
+static unsigned int checksum(char *data, unsigned long len) {
+    uintptr_t *word = (uintptr_t*)data;
+    uintptr_t *end = (uintptr_t*)(data + len);
+    uint64_t a = 0, b = 0;
+
+    while(word < end) {
+        a += *word++;
+        b += a;
+    }
+
+    return (unsigned int)(a ^ b ^ (b >> 32));
+}
+
+/* Called with wal_lock held */
+static unsigned long reserveLog(unsigned long len) {
+    unsigned long offset = active.len;
+
+    if(active.len + len > active.size) {
+        if(active.size == 0)
+            active.size = LOG_BUFFER_SIZE;
+
+        while(active.len + len > active.size)
+            active.size *= 2;
+
+        active.data = sysRealloc(active.data, active.size);
+    }
+
+    active.len += len;
+    return offset;
+}
+
+static int writeBuffer(int fd, LogBuffer *buffer) {
+    unsigned long done = 0;
+
+    while(done < buffer->len) {
+        long len = write(fd, buffer->data + done, buffer->len - done);
+
+        if(len <= 0)
+            return FALSE;
+
+        done += len;
+    }
+
+    return TRUE;
+}
+
+/* Stores only take the range, and stores to neighbouring
+   fields are merged.  The pool is all there is to replay */
+void walRange(TxState *tx_state, char *addr, int size) {
+    WalRange *last;
+
+    if(addr < (char*)pop_heap || addr + size > (char*)pop_heap + pheap->pool_size)
+        return;
+
+    if(tx_state->wal_count > 0) {
+        last = &tx_state->wal_ranges[tx_state->wal_count - 1];
+
+        if(addr >= last->addr && addr <= last->addr + last->size) {
+            if(addr + size > last->addr + last->size)
+                last->size = addr + size - last->addr;
+            return;
+        }
+    }
+
+    if(tx_state->wal_count == tx_state->wal_size) {
+        tx_state->wal_size = tx_state->wal_size ? tx_state->wal_size * 2
+                                                : REDO_SET_SIZE;
+        tx_state->wal_ranges = sysRealloc(tx_state->wal_ranges,
+                                          tx_state->wal_size * sizeof(WalRange));
+    }
+
+    tx_state->wal_ranges[tx_state->wal_count].addr = addr;
+    tx_state->wal_ranges[tx_state->wal_count++].size = size;
+}
+
+/* The contents are copied under wal_lock, so the order of the
+   transactions in the log is the order they were copied in */
+static void copyRanges(TxState *tx_state) {
+    Thread *self = threadSelf();
+    int critical = self != NULL && !self->blocking;
+    unsigned long start;
+    WalHeader *header;
+    int i;
+
+    if(critical)
+        fastDisableSuspend(self);
+
+    pthread_mutex_lock(&wal_lock);
+
+    start = reserveLog(sizeof(WalHeader));
+
+    for(i = 0; i < tx_state->wal_count; i++) {
+        WalRange *range = &tx_state->wal_ranges[i];
+        unsigned long offset = reserveLog(sizeof(WalRecord) +
+                                          WAL_ALIGN(range->size));
+        WalRecord *record = (WalRecord*)(active.data + offset);
+
+        record->offset = range->addr - (char*)pop_heap;
+        record->length = range->size;
+        memcpy(record + 1, range->addr, range->size);
+        memset((char*)(record + 1) + range->size, 0,
+               WAL_ALIGN(range->size) - range->size);
+    }
+
+    header = (WalHeader*)(active.data + start);
+    header->magic = WAL_MAGIC;
+    header->length = active.len - start - sizeof(WalHeader);
+    header->checksum = checksum((char*)(header + 1), header->length);
+
+    pthread_mutex_unlock(&wal_lock);
+
+    if(critical)
+        fastEnableSuspend(self);
+
+    tx_state->wal_count = 0;
+}
+
+/* Called by the outermost END_TX */
+void walCommit(TxState *tx_state) {
+
+    /* The hash tables' counts and the objects allocated
+       belong to the transaction */
+    flushPHValues();
+    flushBornRange(tx_state);
+
+    if(tx_state->wal_count > 0)
+        copyRanges(tx_state);
+}
+
+/* Called by the collector with the world stopped.  The collecting
+   thread may be within a transaction of its own, so its redo set is
+   put aside and the collection's ranges are gathered in another */
+static WalRange *gc_ranges;
+static int gc_size, gc_count;
+static int gc_logging;
+
+void walBeginGC(TxState *tx_state) {
+    WalRange *ranges = tx_state->wal_ranges;
+    int count = tx_state->wal_count;
+    int size = tx_state->wal_size;
+
+    if(!(gc_logging = wal_mode))
+        return;
+
+    tx_state->wal_ranges = gc_ranges;
+    tx_state->wal_size = gc_size;
+    tx_state->wal_count = 0;
+
+    gc_ranges = ranges;
+    gc_size = size;
+    gc_count = count;
+}
+
+/* The objects promoted and the hash tables' counts belong to the
+   collection, which is committed before any thread runs again */
+void walEndGC(TxState *tx_state) {
+    WalRange *ranges = tx_state->wal_ranges;
+    int size = tx_state->wal_size;
+
+    if(!gc_logging)
+        return;
+
+    flushPHValues();
+    flushBornRange(tx_state);
+
+    if(tx_state->wal_count > 0)
+        copyRanges(tx_state);
+
+    tx_state->wal_ranges = gc_ranges;
+    tx_state->wal_size = gc_size;
+    tx_state->wal_count = gc_count;
+
+    gc_ranges = ranges;
+    gc_size = size;
+    gc_logging = FALSE;
+}
+
+/* The barrier comes before the store, so the ranges of stores made
+   outside a transaction are kept until the store is done.  They are
+   committed together once the allocation they belong to is complete
+   (see recordBornObject), before the thread may block (see
+   disableSuspend), or with the thread's next transaction */
+void walFlush(TxState *tx_state) {
+    if(tx_state->depth == 0 && tx_state->wal_count > 0)
+        copyRanges(tx_state);
+}
+
+/* Starts a new generation.  The active buffer is written to the old
+   one first, and the old one is synced before anything is written to
+   the new (see flushLog).  Returns the new generation */
+unsigned long rotateLog(int barrier) {
+    char *path;
+
+    pthread_mutex_lock(&io_lock);
+    pthread_mutex_lock(&wal_lock);
+
+    if(log_fd != -1) {
+        if(barrier) {
+            WalHeader *header = (WalHeader*)(active.data +
+                                             reserveLog(sizeof(WalHeader)));
+            header->magic = WAL_BARRIER;
+            header->checksum = 0;
+            header->length = 0;
+        }
+
+        if(sealed_fd != -1) {
+            fdatasync(sealed_fd);
+            close(sealed_fd);
+        }
+
+        if(!writeBuffer(log_fd, &active))
+            jam_printf("<Log: couldn't write generation %lu>\n", generation);
+
+        active.len = 0;
+        sealed_fd = log_fd;
+    }
+
+    path = logPath(++generation);
+    if((log_fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1)
+        jam_printf("<Log: couldn't create %s>\n", path);
+
+    log_created = TRUE;
+    sysFree(path);
+
+    pthread_mutex_unlock(&wal_lock);
+    pthread_mutex_unlock(&io_lock);
+
+    return generation;
+}
+
+/* Called before the pool is written without logging */
+void logBarrier() {
+    Thread *self;
+    int critical;
+
+    if(!wal_mode)
+        return;
+
+    self = threadSelf();
+    critical = self != NULL && !self->blocking;
+
+    if(critical)
+        fastDisableSuspend(self);
+
+    rotateLog(TRUE);
+
+    if(critical)
+        fastEnableSuspend(self);
+
+    requestSnapshot();
+}
+
+/* Called by the snapshot thread once the first snapshot of the run is
+   complete, with the world stopped at a consistent point.  The stores
+   made since the snapshot weren't logged, so the log starts in a new
+   generation.  The snapshot's generation has no log, which stops the
+   replay the same as a barrier */
+void startLog() {
+    if(log_enabled) {
+        rotateLog(FALSE);
+        wal_mode = TRUE;
+    }
+}
+
+/* The group commit */
+static void flushLog() {
+    LogBuffer buffer;
+    int fd, sealed, created;
+    int ok = TRUE;
+
+    pthread_mutex_lock(&io_lock);
+    pthread_mutex_lock(&wal_lock);
+
+    buffer = active;
+    active = spare;
+    active.len = 0;
+    spare = buffer;
+
+    fd = log_fd;
+    sealed = sealed_fd;
+    created = log_created;
+    sealed_fd = -1;
+    log_created = FALSE;
+
+    pthread_mutex_unlock(&wal_lock);
+
+    if(sealed != -1) {
+        ok = fdatasync(sealed) == 0;
+        close(sealed);
+    }
+
+    if(created)
+        syncLogDirectory();
+
+    if(spare.len > 0 && fd != -1)
+        ok = writeBuffer(fd, &spare) && fdatasync(fd) == 0 && ok;
+
+    pthread_mutex_unlock(&io_lock);
+
+    if(!ok)
+        jam_printf("<Log: couldn't write generation %lu>\n", generation);
+    else if(spare.len > 0)
+        TRACE_WAL("<Log: committed %lu bytes to generation %lu>\n",
+                  spare.len, generation);
+}
+
+void logWriterThreadLoop(Thread *self) {
+    for(;;) {
+        threadSleep(self, wal_interval, 0);
+
+        disableSuspend(self);
+        flushLog();
+        enableSuspend(self);
+    }
+}
+
+/* Called on shutdown, with the other threads stopped, so the
+   transactions committed so far are durable */
+void syncLog() {
+    if(wal_mode)
+        flushLog();
+}
+
+/* Called by the snapshot thread once a snapshot starting in the
+   generation is complete */
+void truncateLog(unsigned long gen) {
+    char *path;
+
+    for(; oldest < gen; oldest++) {
+        unlink(path = logPath(oldest));
+        sysFree(path);
+    }
+}
+
+static void removeLogs() {
+    char *copy = strcpy(sysMalloc(strlen(log_prefix) + 1), log_prefix);
+    char *prefix = basename(copy);
+    int len = strlen(prefix);
+    char *dir = strcpy(sysMalloc(strlen(log_prefix) + 1), log_prefix);
+    DIR *stream = opendir(dirname(dir));
+    struct dirent *entry;
+
+    if(stream != NULL) {
+        int dir_fd = dirfd(stream);
+
+        while((entry = readdir(stream)) != NULL)
+            if(strncmp(entry->d_name, prefix, len) == 0)
+                unlinkat(dir_fd, entry->d_name, 0);
+
+        closedir(stream);
+    }
+
+    syncLogDirectory();
+
+    sysFree(copy);
+    sysFree(dir);
+}
+
+/* Called by a clean shutdown or a checkpoint, once the pool has been
+   made durable.  The logs go before the snapshot: a snapshot left on
+   its own is an older consistent state, logs without one are not.
+   Nothing is written to the log afterwards */
+void dropLogs() {
+    if(!log_enabled)
+        return;
+
+    log_enabled = wal_mode = FALSE;
+    pthread_mutex_lock(&io_lock);
+
+    if(sealed_fd != -1)
+        close(sealed_fd);
+    if(log_fd != -1)
+        close(log_fd);
+
+    sealed_fd = log_fd = -1;
+    removeLogs();
+}
+
+/* Replays the transactions of a log file until its end, a torn
+   transaction or a barrier.  Returns FALSE if replay is to stop */
+static int replayFile(char *path, unsigned long *count) {
+    char *pool = (char*)pop_heap;
+    unsigned long pool_size = pheap->pool_size;
+    int fd = open(path, O_RDONLY);
+    int more = FALSE;
+    struct stat info;
+    char *log, *pos, *end;
+
+    if(fd == -1)
+        return FALSE;
+
+    /* A generation may be started and not written to */
+    if(fstat(fd, &info) == 0 && info.st_size == 0) {
+        close(fd);
+        return TRUE;
+    }
+
+    if(fstat(fd, &info) != 0 || (log = mmap(0, info.st_size, PROT_READ,
+                                  MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return FALSE;
+    }
+
+    for(pos = log, end = log + info.st_size; ; ) {
+        WalHeader *header = (WalHeader*)pos;
+        char *body = pos + sizeof(WalHeader);
+        char *next;
+
+        if(pos == end) {
+            more = TRUE;
+            break;
+        }
+
+        if(body > end || header->magic != WAL_MAGIC ||
+              header->length > end - body ||
+              checksum(body, header->length) != header->checksum)
+            break;
+
+        next = body + header->length;
+
+        for(pos = body; pos < next; ) {
+            WalRecord *record = (WalRecord*)pos;
+
+            if(record->offset > pool_size ||
+                   record->length > pool_size - record->offset)
+                break;
+
+            memcpy(pool + record->offset, record + 1, record->length);
+            pos += sizeof(WalRecord) + WAL_ALIGN(record->length);
+        }
+
+        (*count)++;
+        pos = next;
+    }
+
+    munmap(log, info.st_size);
+    close(fd);
+
+    return more;
+}
+
+/* Called once the pool has been opened, before it is relocated or
+   recovered, whatever the mode.  A new pool has no logs to replay,
+   only stale ones to drop.  Replay is idempotent, so should it be
+   interrupted it's simply done again */
+void replayLog(char *pool_path, int replay) {
+    unsigned long gen, count = 0;
+    char *path;
+    int more;
+
+    log_prefix = strcat(strcpy(sysMalloc(strlen(pool_path) +
+                                         strlen(WAL_SUFFIX) + 1),
+                               pool_path), WAL_SUFFIX);
+
+    for(gen = pheap->wal_generation, more = replay; more; gen++) {
+        more = replayFile(path = logPath(gen), &count);
+        sysFree(path);
+    }
+
+    if(count > 0) {
+        pmemobj_persist(pop_heap, pop_heap, pheap->pool_size);
+        jam_printf("<Log: replayed %lu transactions over pool %s>\n",
+                   count, pool_path);
+    }
+
+    removeLogs();
+}
+
+void initialiseLog(InitArgs *args) {
+    if(args->wal_interval <= 0)
+        return;
+
+    wal_interval = args->wal_interval;
+    generation = oldest = pheap->wal_generation;
+    log_enabled = TRUE;
+
+    createVMThread("Log Writer", logWriterThreadLoop);
+}
+// End of modification